@@ -1,34 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
 
-#include "math2d.h"
+#include "timer.h"
 #include "bitpack.h"
 
-#define CPU_LITTLE_ENDIAN 1
-#define CPU_BIG_ENDIAN 2
-
-#if    defined(__386__) || defined(i386)    || defined(__i386__)  \
-    || defined(__X86)   || defined(_M_IX86)                       \
-    || defined(_M_X64)  || defined(__x86_64__)                    \
-    || defined(alpha)   || defined(__alpha) || defined(__alpha__) \
-    || defined(_M_ALPHA)                                          \
-    || defined(ARM)     || defined(_ARM)    || defined(__arm__)   \
-    || defined(WIN32)   || defined(_WIN32)  || defined(__WIN32__) \
-    || defined(_WIN32_WCE) || defined(__NT__)                     \
-    || defined(__MIPSEL__)
-  #define CPU_ENDIAN CPU_LITTLE_ENDIAN
-#else
-  #define CPU_ENDIAN CPU_BIG_ENDIAN
-#endif
-
-static inline uint32_t conv_endian32(uint32_t value)
-{
-#if CPU_ENDIAN == CPU_BIG_ENDIAN
-    return __builtin_bswap32( value );
-#else
-    return value;
-#endif
-}
-
 static void _print_binary(uint32_t val)
 {
     for(int j = 31; j >= 0; --j)
@@ -58,7 +36,23 @@ void bitpack_create(BitPack* bp, size_t num_bytes)
     bp->words_written = 0;
     bp->scratch = 0;
     bp->bit_index = 0;
-    bp->overflow = 1;
+    bp->overflow = BITPACK_OK;
+}
+
+// Wraps an existing buffer (e.g. a received packet's payload) so it can be
+// read in place. The pack doesn't own the buffer; don't bitpack_delete() it.
+void bitpack_attach(BitPack* bp, void* data, int num_bytes)
+{
+    bp->data = (uint32_t*)data;
+    bp->size_in_bits = 8*num_bytes;
+    bp->size_in_words = (num_bytes + 3)/4;
+
+    bp->bits_written = bp->size_in_bits;
+    bp->words_written = bp->size_in_words;
+    bp->word_index = 0;
+    bp->scratch = 0;
+    bp->bit_index = 0;
+    bp->overflow = BITPACK_OK;
 }
 
 void bitpack_clear(BitPack* bp)
@@ -69,7 +63,19 @@ void bitpack_clear(BitPack* bp)
     bp->bits_written = 0;
     bp->word_index = 0;
     bp->words_written = 0;
-    bp->overflow = 0;
+    bp->overflow = BITPACK_OK;
+}
+
+// Like bitpack_clear() but leaves the buffer contents alone. Writes always
+// store whole words, so nothing stale survives into the written range.
+void bitpack_reset(BitPack* bp)
+{
+    bp->scratch = 0x0;
+    bp->bit_index = 0;
+    bp->bits_written = 0;
+    bp->word_index = 0;
+    bp->words_written = 0;
+    bp->overflow = BITPACK_OK;
 }
 
 void bitpack_delete(BitPack* bp)
@@ -77,7 +83,7 @@ void bitpack_delete(BitPack* bp)
     bp->bits_written = 0;
     bp->word_index = 0;
     bp->words_written = 0;
-    bp->overflow = 0;
+    bp->overflow = BITPACK_OK;
     free(bp->data);
     bp->data = NULL;
 }
@@ -106,38 +112,34 @@ void bitpack_memcpy(BitPack* bp, uint8_t* data, int len)
     bp->bits_written = len * 8;
 }
 
+// Checked write. Errors are recorded in bp->overflow rather than reported;
+// an out of range value is masked to num_bits and still written.
 int bitpack_write(BitPack* bp, int num_bits, uint32_t value)
 {
     if(!bp->data)
         return 0;
 
-    if(num_bits < 0 || num_bits > 32)
+    if(num_bits <= 0 || num_bits > 32)
+    {
+        bp->overflow = BITPACK_ERR_WIDTH;
         return 0;
+    }
 
-    uint64_t max = ((uint64_t)1 << (num_bits));
-
-    int ret = 1;
-    if(value >= max)
+    if(!bitpack_has_room(bp, num_bits))
     {
-        ret = 0;
-        printf("value needs more bits! (value: %u, max: %lld (%d bits)\n", value, max, num_bits);
+        bp->overflow = BITPACK_ERR_OVERFLOW;
+        return 0;
     }
 
-    value &= ((uint64_t)1 << num_bits) -1;
-
-    bp->scratch |= ((uint64_t)value) << ( 64 - bp->bit_index - num_bits);
-    bp->bit_index += num_bits;
-
-    if(bp->bit_index >= 32)
+    int ret = 1;
+    if((uint64_t)value >= ((uint64_t)1 << num_bits))
     {
-        bp->data[bp->word_index] = conv_endian32((uint32_t)(bp->scratch >> 32));
-        bp->word_index++;
-        bp->words_written++;
-        bp->scratch <<= 32;
-        bp->bit_index -= 32;
+        bp->overflow = BITPACK_ERR_RANGE;
+        value &= (uint32_t)(((uint64_t)1 << num_bits) - 1);
+        ret = 0;
     }
-    bp->bits_written += num_bits;
 
+    bitpack_write_fast(bp, num_bits, value);
     return ret;
 }
 
@@ -145,10 +147,9 @@ void bitpack_flush(BitPack* bp)
 {
     if(bp->bit_index != 0)
     {
-        assert(bp->word_index < bp->size_in_words);
         if (bp->word_index >= bp->size_in_words )
         {
-            bp->overflow = 1;
+            bp->overflow = BITPACK_ERR_OVERFLOW;
             return;
         }
         bp->data[bp->word_index] = conv_endian32((uint32_t)(bp->scratch >> 32));
@@ -158,7 +159,7 @@ void bitpack_flush(BitPack* bp)
     }
 }
 
-uint32_t bitpack_print(BitPack* bp)
+void bitpack_print(BitPack* bp)
 {
     printf("Bit Pack (Addr: %p)\n", bp);
     printf("(%d bits (%d words))\n",bp->bits_written, bp->words_written);
@@ -172,6 +173,35 @@ uint32_t bitpack_print(BitPack* bp)
 }
 
 uint32_t bitpack_read(BitPack* bp, int num_bits)
+{
+    if(!bp->data)
+        return 0;
+
+    if(num_bits <= 0 || num_bits > 32)
+        return 0;
+
+    if(32*bp->word_index + bp->bit_index + num_bits > bp->size_in_bits)
+    {
+        bp->overflow = BITPACK_ERR_OVERFLOW;
+        return 0;
+    }
+
+    // load the current and next word into a 64-bit window and extract the field in one shift pair
+    uint64_t hi = conv_endian32(bp->data[bp->word_index]);
+    uint64_t lo = (bp->word_index + 1 < bp->size_in_words) ? conv_endian32(bp->data[bp->word_index+1]) : 0;
+    uint64_t window = (hi << 32) | lo;
+
+    uint32_t val = (uint32_t)((window << bp->bit_index) >> (64 - num_bits));
+
+    bp->bit_index += num_bits;
+    bp->word_index += bp->bit_index >> 5;
+    bp->bit_index &= 31;
+
+    return val;
+}
+
+// Original bit-at-a-time reader, kept as a reference for bitpack_bench()
+static uint32_t bitpack_read_bitwise(BitPack* bp, int num_bits)
 {
     if(!bp->data)
         return 0;
@@ -200,49 +230,142 @@ uint32_t bitpack_read(BitPack* bp, int num_bits)
     return val;
 }
 
+// Reads back fields of every width 1-32 at every bit offset, against the
+// values written and the bit-at-a-time reader, then reads off the end of an
+// attached buffer, which must flag BITPACK_ERR_OVERFLOW and return 0.
 void bitpack_test()
 {
-    BitPack bp;
+    const int num_fields = 4096;
+    int failures = 0;
 
-    bitpack_create(&bp,8);
+    BitPack bp;
+    bitpack_create(&bp, num_fields*4 + 8);
 
-    bitpack_write(&bp,12, 2048); // 10000000 0000
-    bitpack_write(&bp,4,  9);    // 1001
-    bitpack_write(&bp,3,  5);    // 101
-    bitpack_write(&bp,10, 1020); // 11 1111 1100
-    bitpack_write(&bp,1,  1);    // 1
-    bitpack_write(&bp,1,  0);    // 0
-    bitpack_write(&bp,4,  3);    // 0011
-    bitpack_write(&bp,13, 4123);
-    bitpack_write(&bp,4,  3);
-    bitpack_write(&bp,9,  100);
+    // a fixed pattern, then random values with the width cycling through
+    // 1-32 so fields start at every offset and straddle words
+    const int fixed_widths[] = {12, 4, 3, 10, 1, 1, 4, 13, 4, 9};
+    const uint32_t fixed_values[] = {2048, 9, 5, 1020, 1, 0, 3, 4123, 3, 100};
+    const int num_fixed = sizeof(fixed_widths)/sizeof(fixed_widths[0]);
 
-    // 10000000 00001001 10111111 11100101
+    int* widths = malloc(num_fields*sizeof(int));
+    uint32_t* values = malloc(num_fields*sizeof(uint32_t));
 
+    srand(7);
+    for(int i = 0; i < num_fields; ++i)
+    {
+        if(i < num_fixed)
+        {
+            widths[i] = fixed_widths[i];
+            values[i] = fixed_values[i];
+        }
+        else
+        {
+            widths[i] = 1 + (i*7) % 32;
+            uint32_t r = ((uint32_t)rand() << 16) ^ (uint32_t)rand() ^ ((uint32_t)rand() << 31);
+            values[i] = r & (uint32_t)(((uint64_t)1 << widths[i]) - 1);
+        }
+        bitpack_write(&bp, widths[i], values[i]);
+    }
     bitpack_flush(&bp);
-    //bitpack_print(&bp);
+
+    if(bp.overflow != BITPACK_OK)
+        failures++;
+
+    BitPack ref = bp;
     bitpack_seek_begin(&bp);
+    bitpack_seek_begin(&ref);
+
+    for(int i = 0; i < num_fields; ++i)
+    {
+        uint32_t v = bitpack_read(&bp, widths[i]);
+        uint32_t v_ref = bitpack_read_bitwise(&ref, widths[i]);
+        if(v != values[i] || v_ref != values[i])
+        {
+            if(failures < 10)
+                printf("  field %d (%d bits): wrote %u, read %u, bitwise %u\n", i, widths[i], values[i], v, v_ref);
+            failures++;
+        }
+    }
+
+    if(bp.overflow != BITPACK_OK)
+        failures++;
+
+    // 40 bits: a whole word and one byte, then nothing
+    BitPack out;
+    bitpack_create(&out, 8);
+    bitpack_write(&out, 32, 0xDEADBEEF);
+    bitpack_write(&out, 8, 0xA5);
+    bitpack_flush(&out);
+
+    BitPack in;
+    bitpack_attach(&in, out.data, 5);
+
+    uint32_t first = bitpack_read(&in, 32);
+    uint32_t last = bitpack_read(&in, 8);
+    uint32_t past = bitpack_read(&in, 1);
+    if(first != 0xDEADBEEF || last != 0xA5 || past != 0 || in.overflow != BITPACK_ERR_OVERFLOW)
+        failures++;
+
+    bitpack_attach(&in, out.data, 5);
+    bitpack_read(&in, 20);
+    past = bitpack_read(&in, 21); // straddles the end
+    if(past != 0 || in.overflow != BITPACK_ERR_OVERFLOW)
+        failures++;
+
+    printf("Bitpack test (%d fields of 1-32 bits, reads past the end)\n", num_fields);
+    printf("%s (%d failures)\n", failures == 0 ? "PASSED" : "FAILED", failures);
+
+    free(widths);
+    free(values);
+    bitpack_delete(&out);
+    bitpack_delete(&bp);
+}
+
+void bitpack_bench()
+{
+    const int num_fields = 100000;
+    const int passes = 50;
+
+    BitPack bp;
+    bitpack_create(&bp, num_fields*4 + 8);
+
+    int* widths = malloc(num_fields*sizeof(int));
+
+    srand(1);
+    for(int i = 0; i < num_fields; ++i)
+    {
+        widths[i] = 1 + rand() % 32;
+        uint32_t value = (uint32_t)rand() & (uint32_t)(((uint64_t)1 << widths[i]) - 1);
+        bitpack_write(&bp, widths[i], value);
+    }
+    bitpack_flush(&bp);
+
+    uint32_t sum_word = 0, sum_bit = 0;
+
+    double t0 = timer_get_time();
+    for(int p = 0; p < passes; ++p)
+    {
+        bitpack_seek_begin(&bp);
+        for(int i = 0; i < num_fields; ++i)
+            sum_word += bitpack_read(&bp, widths[i]);
+    }
+    double t_word = timer_get_time() - t0;
+
+    t0 = timer_get_time();
+    for(int p = 0; p < passes; ++p)
+    {
+        bitpack_seek_begin(&bp);
+        for(int i = 0; i < num_fields; ++i)
+            sum_bit += bitpack_read_bitwise(&bp, widths[i]);
+    }
+    double t_bit = timer_get_time() - t0;
+
+    double reads = (double)num_fields*passes;
 
-    uint32_t v1 = bitpack_read(&bp,12);
-    uint32_t v2 = bitpack_read(&bp,4);
-    uint32_t v3 = bitpack_read(&bp,3);
-    uint32_t v4 = bitpack_read(&bp,10);
-    uint32_t v5 = bitpack_read(&bp,1);
-    uint32_t v6 = bitpack_read(&bp,1);
-    uint32_t v7 = bitpack_read(&bp,4);
-    uint32_t v8 = bitpack_read(&bp,13);
-    uint32_t v9 = bitpack_read(&bp,4);
-    uint32_t v10 = bitpack_read(&bp,9);
-
-    printf("v1: %u\n",v1);
-    printf("v2: %u\n",v2);
-    printf("v3: %u\n",v3);
-    printf("v4: %u\n",v4);
-    printf("v5: %u\n",v5);
-    printf("v6: %u\n",v6);
-    printf("v7: %u\n",v7);
-    printf("v8: %u\n",v8);
-    printf("v9: %u\n",v9);
-    printf("v10:%u\n",v10);
+    printf("bitpack_read (random 1-32 bit fields, %s):\n", sum_word == sum_bit ? "results match" : "RESULTS DIFFER");
+    printf("  word-at-a-time: %8.1f M reads/s\n", reads/t_word/1000000.0);
+    printf("  bit-at-a-time:  %8.1f M reads/s\n", reads/t_bit/1000000.0);
 
+    free(widths);
+    bitpack_delete(&bp);
 }
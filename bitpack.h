@@ -1,11 +1,37 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+#define CPU_LITTLE_ENDIAN 1
+#define CPU_BIG_ENDIAN 2
+
+#if    defined(__386__) || defined(i386)    || defined(__i386__)  \
+    || defined(__X86)   || defined(_M_IX86)                       \
+    || defined(_M_X64)  || defined(__x86_64__)                    \
+    || defined(alpha)   || defined(__alpha) || defined(__alpha__) \
+    || defined(_M_ALPHA)                                          \
+    || defined(ARM)     || defined(_ARM)    || defined(__arm__)   \
+    || defined(__aarch64__) || defined(_M_ARM64)                  \
+    || defined(WIN32)   || defined(_WIN32)  || defined(__WIN32__) \
+    || defined(_WIN32_WCE) || defined(__NT__)                     \
+    || defined(__MIPSEL__)
+  #define CPU_ENDIAN CPU_LITTLE_ENDIAN
+#else
+  #define CPU_ENDIAN CPU_BIG_ENDIAN
+#endif
+
+// error codes stored in BitPack.overflow
+#define BITPACK_OK           0
+#define BITPACK_ERR_OVERFLOW 1 // ran out of buffer
+#define BITPACK_ERR_RANGE    2 // value needed more bits than given
+#define BITPACK_ERR_WIDTH    3 // num_bits not in 1-32
 
 typedef struct
 {
     uint32_t* data;
-    uint32_t scratch;
+    uint64_t scratch;
     int overflow;
 
     int size_in_bits;
@@ -18,7 +44,9 @@ typedef struct
 } BitPack;
 
 void bitpack_create(BitPack* bp, size_t num_bytes);
+void bitpack_attach(BitPack* bp, void* data, int num_bytes);
 void bitpack_clear(BitPack* bp);
+void bitpack_reset(BitPack* bp);
 void bitpack_delete(BitPack* bp);
 void bitpack_seek_begin(BitPack* bp);
 void bitpack_seek_to_written(BitPack* bp);
@@ -26,5 +54,39 @@ int bitpack_write(BitPack* bp, int num_bits, uint32_t value);
 void bitpack_memcpy(BitPack* bp, uint8_t* data, int len);
 void bitpack_flush(BitPack* bp);
 uint32_t bitpack_read(BitPack* bp, int num_bits);
-uint32_t bitpack_print(BitPack* bp);
+void bitpack_print(BitPack* bp);
 void bitpack_test();
+void bitpack_bench();
+
+static inline uint32_t conv_endian32(uint32_t value)
+{
+#if CPU_ENDIAN == CPU_BIG_ENDIAN
+    return __builtin_bswap32( value );
+#else
+    return value;
+#endif
+}
+
+static inline bool bitpack_has_room(BitPack* bp, int num_bits)
+{
+    return bp->bits_written + num_bits <= bp->size_in_bits;
+}
+
+// Unchecked write for serializers with known field widths. The caller
+// guarantees 1 <= num_bits <= 32, value < 2^num_bits and room in the buffer
+// (see bitpack_has_room()). The top scratch word is stored on every call so
+// the only data dependent step is how far to advance.
+static inline void bitpack_write_fast(BitPack* bp, int num_bits, uint32_t value)
+{
+    bp->scratch |= ((uint64_t)value) << (64 - bp->bit_index - num_bits);
+    bp->bit_index += num_bits;
+    bp->bits_written += num_bits;
+
+    bp->data[bp->word_index] = conv_endian32((uint32_t)(bp->scratch >> 32));
+
+    int full = bp->bit_index >> 5; // 0 or 1
+    bp->word_index += full;
+    bp->words_written += full;
+    bp->scratch <<= (full << 5);
+    bp->bit_index &= 31;
+}
@@ -16,5 +16,54 @@ gcc main.c \
     sky.c \
     lights.c \
     socket.c \
+    timer.c \
     -lraylib -lGL -lm \
     -o bin/rekt
+
+# Dedicated server: the simulation and net only, no raylib library or GL.
+# raylib/src is there for its headers, with the math inlined, and for the
+# stb_image the heightmap is decoded with.
+gcc -O2 -Wall -Wextra -DHEADLESS=1 -DRAYMATH_STATIC_INLINE -Iraylib/src \
+    server_main.c \
+    player.c \
+    terrain.c \
+    net.c \
+    socket.c \
+    timer.c \
+    bitpack.c \
+    snapshot.c \
+    channel.c \
+    interp.c \
+    spsc.c \
+    jobs.c \
+    lagcomp.c \
+    interest.c \
+    metrics.c \
+    -lm -lpthread \
+    -o bin/rekt_server
+
+# Tests: net.c's internals against fake clients, each module's own tests and
+# a loopback run. "./build.sh test" runs them after building; the benches
+# are "bin/rekt_test --bench".
+gcc -O2 -Wall -Wextra -DHEADLESS=1 -DRAYMATH_STATIC_INLINE -Iraylib/src \
+    net_test.c \
+    player.c \
+    terrain.c \
+    socket.c \
+    timer.c \
+    bitpack.c \
+    snapshot.c \
+    channel.c \
+    interp.c \
+    spsc.c \
+    jobs.c \
+    lagcomp.c \
+    interest.c \
+    metrics.c \
+    -lm -lpthread \
+    -o bin/rekt_test
+
+if [ "$1" = "test" ]; then
+    bin/rekt_test | tee bin/rekt_test.log
+    ! grep -q FAILED bin/rekt_test.log
+fi
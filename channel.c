@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "channel.h"
+
+#define MESSAGE_HEADER_BITS (16 + CHANNEL_MESSAGE_LEN_BITS)
+
+void channel_reset(Channel* ch)
+{
+    memset(ch, 0, sizeof(Channel));
+    ch->rto = CHANNEL_RTO_MAX;
+}
+
+bool channel_send(Channel* ch, const uint8_t* data, int len)
+{
+    if(len < 0 || len > CHANNEL_MESSAGE_MAX)
+        return false;
+
+    if((uint16_t)(ch->send_id - ch->oldest_unacked) >= CHANNEL_QUEUE_SIZE)
+        return false; // receiver can't buffer further ahead than this
+
+    ChannelMessage* msg = &ch->send_queue[ch->send_id % CHANNEL_QUEUE_SIZE];
+    msg->id = ch->send_id++;
+    msg->valid = true;
+    msg->acked = false;
+    msg->time_last_sent = 0.0;
+    msg->len = len;
+    memcpy(msg->data, data, len);
+    return true;
+}
+
+static inline bool message_is_due(Channel* ch, ChannelMessage* msg, double now)
+{
+    if(!msg->valid || msg->acked)
+        return false;
+    return msg->time_last_sent == 0.0 || now - msg->time_last_sent >= ch->rto;
+}
+
+bool channel_has_pending(Channel* ch, double now)
+{
+    for(uint16_t id = ch->oldest_unacked; id != ch->send_id; ++id)
+    {
+        if(message_is_due(ch, &ch->send_queue[id % CHANNEL_QUEUE_SIZE], now))
+            return true;
+    }
+    return false;
+}
+
+// Per packet:
+//    4 bits  message count
+// Per message:
+//   16 bits  message id
+//    8 bits  length
+//            bytes
+void channel_write(Channel* ch, BitPack* bp, uint16_t packet_id, double now, int max_bits)
+{
+    if(max_bits < CHANNEL_COUNT_BITS || !bitpack_has_room(bp, CHANNEL_COUNT_BITS))
+    {
+        bp->overflow = BITPACK_ERR_OVERFLOW;
+        return;
+    }
+
+    // pick what fits first, the count goes ahead of the messages
+    ChannelMessage* picked[CHANNEL_MSGS_PER_PACKET];
+    int count = 0;
+    int bits = CHANNEL_COUNT_BITS;
+
+    for(uint16_t id = ch->oldest_unacked; id != ch->send_id && count < CHANNEL_MSGS_PER_PACKET; ++id)
+    {
+        ChannelMessage* msg = &ch->send_queue[id % CHANNEL_QUEUE_SIZE];
+        if(!message_is_due(ch, msg, now))
+            continue;
+
+        int msg_bits = MESSAGE_HEADER_BITS + 8*msg->len;
+        if(bits + msg_bits > max_bits || !bitpack_has_room(bp, bits + msg_bits))
+            break; // keep ordering simple, the rest goes in the next packet
+
+        picked[count++] = msg;
+        bits += msg_bits;
+    }
+
+    bitpack_write_fast(bp, CHANNEL_COUNT_BITS, count);
+
+    if(count == 0)
+        return;
+
+    ChannelSentPacket* sp = &ch->sent_packets[packet_id % CHANNEL_SENT_PACKETS];
+    sp->packet_id = packet_id;
+    sp->valid = true;
+    sp->time_sent = now;
+    sp->count = count;
+
+    for(int i = 0; i < count; ++i)
+    {
+        ChannelMessage* msg = picked[i];
+
+        bitpack_write_fast(bp, 16, msg->id);
+        bitpack_write_fast(bp, CHANNEL_MESSAGE_LEN_BITS, msg->len);
+        for(int j = 0; j < msg->len; ++j)
+            bitpack_write_fast(bp, 8, msg->data[j]);
+
+        if(msg->time_last_sent != 0.0)
+            ch->resent_count++;
+
+        msg->time_last_sent = now;
+        sp->message_ids[i] = msg->id;
+    }
+}
+
+void channel_renumber_sent(Channel* ch, uint16_t packet_id, uint16_t new_packet_id)
+{
+    ChannelSentPacket* sp = &ch->sent_packets[packet_id % CHANNEL_SENT_PACKETS];
+    if(!sp->valid || sp->packet_id != packet_id)
+        return;
+
+    ChannelSentPacket* dst = &ch->sent_packets[new_packet_id % CHANNEL_SENT_PACKETS];
+    *dst = *sp;
+    dst->packet_id = new_packet_id;
+    if(dst != sp)
+        sp->valid = false;
+}
+
+static void update_rtt(Channel* ch, double sample)
+{
+    if(ch->srtt == 0.0)
+    {
+        ch->srtt = sample;
+        ch->rttvar = sample / 2.0;
+    }
+    else
+    {
+        ch->rttvar = 0.75*ch->rttvar + 0.25*fabs(ch->srtt - sample);
+        ch->srtt = 0.875*ch->srtt + 0.125*sample;
+    }
+
+    ch->rto = ch->srtt + 4.0*ch->rttvar;
+    if(ch->rto < CHANNEL_RTO_MIN) ch->rto = CHANNEL_RTO_MIN;
+    if(ch->rto > CHANNEL_RTO_MAX) ch->rto = CHANNEL_RTO_MAX;
+}
+
+// ack is the newest packet the peer received, bit n of ack_bits is ack-n-1
+void channel_process_ack(Channel* ch, uint16_t ack, uint32_t ack_bits, double now)
+{
+    for(int i = 0; i <= 32; ++i)
+    {
+        if(i > 0 && !(ack_bits & ((uint32_t)1 << (i - 1))))
+            continue;
+
+        uint16_t packet_id = ack - i;
+        ChannelSentPacket* sp = &ch->sent_packets[packet_id % CHANNEL_SENT_PACKETS];
+        if(!sp->valid || sp->packet_id != packet_id)
+            continue;
+
+        for(int j = 0; j < sp->count; ++j)
+        {
+            ChannelMessage* msg = &ch->send_queue[sp->message_ids[j] % CHANNEL_QUEUE_SIZE];
+            if(msg->valid && msg->id == sp->message_ids[j])
+                msg->acked = true;
+        }
+
+        update_rtt(ch, now - sp->time_sent);
+        sp->valid = false; // later acks of the same packet are repeats
+    }
+
+    while(ch->oldest_unacked != ch->send_id)
+    {
+        ChannelMessage* msg = &ch->send_queue[ch->oldest_unacked % CHANNEL_QUEUE_SIZE];
+        if(msg->valid && !msg->acked)
+            break;
+        msg->valid = false;
+        ch->oldest_unacked++;
+    }
+}
+
+bool channel_read(Channel* ch, BitPack* bp)
+{
+    int count = (int)bitpack_read(bp, CHANNEL_COUNT_BITS);
+    if(count > CHANNEL_MSGS_PER_PACKET)
+        return false;
+
+    for(int i = 0; i < count; ++i)
+    {
+        uint16_t id = (uint16_t)bitpack_read(bp, 16);
+        int len = (int)bitpack_read(bp, CHANNEL_MESSAGE_LEN_BITS);
+        if(len > CHANNEL_MESSAGE_MAX || bp->overflow != BITPACK_OK)
+            return false;
+
+        // already delivered, or too far ahead to buffer
+        bool keep = (uint16_t)(id - ch->recv_id) < CHANNEL_QUEUE_SIZE;
+
+        ChannelMessage* msg = &ch->recv_queue[id % CHANNEL_QUEUE_SIZE];
+        if(keep && msg->valid && msg->id == id)
+            keep = false; // duplicate
+
+        for(int j = 0; j < len; ++j)
+        {
+            uint8_t b = (uint8_t)bitpack_read(bp, 8);
+            if(keep) msg->data[j] = b;
+        }
+
+        if(keep)
+        {
+            msg->id = id;
+            msg->len = len;
+            msg->valid = true;
+        }
+    }
+
+    return bp->overflow == BITPACK_OK;
+}
+
+int channel_receive(Channel* ch, uint8_t* data, int max_len)
+{
+    ChannelMessage* msg = &ch->recv_queue[ch->recv_id % CHANNEL_QUEUE_SIZE];
+    if(!msg->valid || msg->id != ch->recv_id)
+        return -1;
+
+    int len = msg->len < max_len ? msg->len : max_len;
+    memcpy(data, msg->data, len);
+
+    msg->valid = false;
+    ch->recv_id++;
+    return len;
+}
+
+// Sends numbered messages one way over a simulated link with loss and
+// latency, acking with the same id + bitfield scheme as PacketHeader, and
+// checks they all arrive in order exactly once.
+void channel_test()
+{
+    const int num_messages = 2000;
+    const int loss_pct = 20;
+    const int latency_ticks = 3;
+    const double dt = 1.0/30.0;
+
+    static Channel a, b; // a sends, b receives
+    channel_reset(&a);
+    channel_reset(&b);
+
+    BitPack bp;
+    bitpack_create(&bp, 4096);
+
+    // in flight, indexed by arrival tick
+    #define LINK_SLOTS 8
+    struct { bool used; uint16_t id; uint8_t data[4096]; int len; } to_b[LINK_SLOTS] = {0};
+    struct { bool used; uint16_t ack; uint32_t bits; } to_a[LINK_SLOTS] = {0};
+
+    uint16_t packet_id = 1;
+    uint16_t b_latest = 0;
+    uint32_t b_bits = 0;
+
+    int queued = 0, received = 0, out_of_order = 0, packets = 0;
+    int expected = 0;
+
+    for(int tick = 0; tick < 100000 && received < num_messages; ++tick)
+    {
+        double now = tick*dt;
+        int slot = tick % LINK_SLOTS;
+
+        // a: deliver acks, queue a few messages, send a packet
+        if(to_a[slot].used)
+        {
+            channel_process_ack(&a, to_a[slot].ack, to_a[slot].bits, now);
+            to_a[slot].used = false;
+        }
+
+        while(queued < num_messages)
+        {
+            uint8_t msg[16];
+            int len = snprintf((char*)msg, sizeof(msg), "msg %d", queued);
+            if(!channel_send(&a, msg, len))
+                break;
+            queued++;
+            if(queued % 3 == 0) break; // trickle in
+        }
+
+        bitpack_reset(&bp);
+        channel_write(&a, &bp, packet_id, now, CHANNEL_MAX_BITS);
+        bitpack_flush(&bp);
+        packets++;
+
+        int arrive = (tick + latency_ticks) % LINK_SLOTS;
+        if(rand() % 100 >= loss_pct)
+        {
+            to_b[arrive].used = true;
+            to_b[arrive].id = packet_id;
+            to_b[arrive].len = bp.words_written*4;
+            memcpy(to_b[arrive].data, bp.data, to_b[arrive].len);
+        }
+        packet_id++;
+
+        // b: receive, drain in order, send back an ack
+        if(to_b[slot].used)
+        {
+            uint16_t id = to_b[slot].id;
+            uint16_t diff = id - b_latest;
+            if(diff != 0 && diff < 32768)
+            {
+                b_bits = (diff > 32) ? 0 : ((b_bits << diff) | ((uint32_t)1 << (diff - 1)));
+                b_latest = id;
+            }
+            else if(diff != 0 && (uint16_t)(b_latest - id) <= 32)
+            {
+                b_bits |= (uint32_t)1 << ((uint16_t)(b_latest - id) - 1);
+            }
+
+            BitPack in;
+            bitpack_attach(&in, to_b[slot].data, to_b[slot].len);
+            channel_read(&b, &in);
+            to_b[slot].used = false;
+        }
+
+        uint8_t buf[CHANNEL_MESSAGE_MAX+1];
+        int len;
+        while((len = channel_receive(&b, buf, CHANNEL_MESSAGE_MAX)) >= 0)
+        {
+            buf[len] = '\0';
+            int n = atoi((char*)buf + 4);
+            if(n != expected)
+                out_of_order++;
+            expected = n + 1;
+            received++;
+        }
+
+        if(rand() % 100 >= loss_pct)
+        {
+            to_a[arrive].used = true;
+            to_a[arrive].ack = b_latest;
+            to_a[arrive].bits = b_bits;
+        }
+    }
+    #undef LINK_SLOTS
+
+    printf("Channel test (%d messages, %d%% loss, %d ticks latency)\n", num_messages, loss_pct, latency_ticks);
+    printf("  received: %d, out of order: %d\n", received, out_of_order);
+    printf("  packets: %d, resent messages: %u (%.1f%%), rto: %.3fs\n", packets, a.resent_count, 100.0*a.resent_count/num_messages, a.rto);
+    printf("%s\n", (received == num_messages && out_of_order == 0) ? "PASSED" : "FAILED");
+
+    bitpack_delete(&bp);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bitpack.h"
+
+// Reliable, ordered messages carried inside the unreliable packet stream.
+//
+// Messages are queued with channel_send() and piggybacked onto outgoing
+// packets by channel_write(), which records which messages went out in
+// which packet. When the peer acks that packet (PacketHeader ack +
+// ack_bitfield, see channel_process_ack()) the messages are released;
+// anything not acked within the retransmission timeout is written again.
+// The receiver buffers out of order arrivals and channel_receive() hands
+// them back in send order, each exactly once.
+
+#define CHANNEL_MESSAGE_MAX     128 // bytes
+#define CHANNEL_QUEUE_SIZE      32  // messages in flight, power of 2
+#define CHANNEL_SENT_PACKETS    64  // packets remembered for acks, power of 2
+#define CHANNEL_MSGS_PER_PACKET 8
+
+#define CHANNEL_RTO_MIN 0.05 // seconds
+#define CHANNEL_RTO_MAX 1.0
+
+// worst case size of one channel_write(), so callers can reserve room
+#define CHANNEL_MESSAGE_LEN_BITS 8
+#define CHANNEL_COUNT_BITS       4
+#define CHANNEL_MAX_BITS (CHANNEL_COUNT_BITS + CHANNEL_MSGS_PER_PACKET*(16 + CHANNEL_MESSAGE_LEN_BITS + 8*CHANNEL_MESSAGE_MAX))
+
+typedef struct
+{
+    uint16_t id;
+    bool valid;
+    bool acked;
+    double time_last_sent; // 0 if never sent
+    int len;
+    uint8_t data[CHANNEL_MESSAGE_MAX];
+} ChannelMessage;
+
+typedef struct
+{
+    uint16_t packet_id;
+    bool valid;
+    double time_sent;
+    int count;
+    uint16_t message_ids[CHANNEL_MSGS_PER_PACKET];
+} ChannelSentPacket;
+
+typedef struct
+{
+    // sending
+    uint16_t send_id;        // id given to the next queued message
+    uint16_t oldest_unacked;
+    ChannelMessage send_queue[CHANNEL_QUEUE_SIZE];
+    ChannelSentPacket sent_packets[CHANNEL_SENT_PACKETS];
+
+    // receiving
+    uint16_t recv_id;        // next id to hand out in order
+    ChannelMessage recv_queue[CHANNEL_QUEUE_SIZE];
+
+    // smoothed round trip, from acks of packets that carried messages
+    double srtt;
+    double rttvar;
+    double rto;
+
+    uint32_t resent_count;
+} Channel;
+
+void channel_reset(Channel* ch);
+
+// false if the send queue is full or the message is too long
+bool channel_send(Channel* ch, const uint8_t* data, int len);
+bool channel_has_pending(Channel* ch, double now);
+
+// Piggybacks due messages onto a packet being built, using at most
+// max_bits of bp. Always writes at least the message count.
+void channel_write(Channel* ch, BitPack* bp, uint16_t packet_id, double now, int max_bits);
+// For a write that ends up going out in a different packet than planned
+void channel_renumber_sent(Channel* ch, uint16_t packet_id, uint16_t new_packet_id);
+void channel_process_ack(Channel* ch, uint16_t ack, uint32_t ack_bits, double now);
+
+// false if the data was malformed
+bool channel_read(Channel* ch, BitPack* bp);
+// copies out the next in order message, returns its length or -1 if none
+int channel_receive(Channel* ch, uint8_t* data, int max_len);
+
+void channel_test();
@@ -1,8 +1,16 @@
+#pragma once
+
 #include <stdio.h>
 #include <stdbool.h>
 
 #define ABS(x) ((x) < 0 ? -1*(x) : (x))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
 #define GRAVITY 9.8f
 
+#define LOGN(format, ...) printf(format "\n", ##__VA_ARGS__)
+#define LOGI(format, ...) printf("[INFO] " format "\n", ##__VA_ARGS__)
+
 extern bool g_debug;
 extern bool g_editor;
+extern double g_timer; // seconds simulated, advanced by the server tick
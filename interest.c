@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "interest.h"
+
+bool interest_grid_init(InterestGrid* g, const float min[3], const float max[3], float cell_size, int max_entities)
+{
+    interest_grid_free(g);
+
+    g->min[0] = min[0];
+    g->min[1] = min[2];
+    g->cell_size = cell_size;
+    g->cols = (int)ceilf((max[0] - min[0]) / cell_size);
+    g->rows = (int)ceilf((max[2] - min[2]) / cell_size);
+    if(g->cols < 1) g->cols = 1;
+    if(g->rows < 1) g->rows = 1;
+
+    int cells = g->cols*g->rows;
+    g->cell_start = calloc(cells + 1, sizeof(int));
+    g->cell_fill = calloc(cells, sizeof(int));
+
+    g->cap = max_entities;
+    g->index = malloc(max_entities*sizeof(uint16_t));
+    g->x = malloc(max_entities*sizeof(float));
+    g->z = malloc(max_entities*sizeof(float));
+    g->add_index = malloc(max_entities*sizeof(uint16_t));
+    g->add_x = malloc(max_entities*sizeof(float));
+    g->add_z = malloc(max_entities*sizeof(float));
+
+    if(!g->cell_start || !g->cell_fill || !g->index || !g->x || !g->z || !g->add_index || !g->add_x || !g->add_z)
+    {
+        interest_grid_free(g);
+        return false;
+    }
+
+    return true;
+}
+
+void interest_grid_free(InterestGrid* g)
+{
+    free(g->cell_start);
+    free(g->cell_fill);
+    free(g->index);
+    free(g->x);
+    free(g->z);
+    free(g->add_index);
+    free(g->add_x);
+    free(g->add_z);
+    memset(g, 0, sizeof(InterestGrid));
+}
+
+// Positions outside the bounds go in the edge cells
+static inline int cell_coord(float v, float min, float cell_size, int n)
+{
+    int c = (int)((v - min) / cell_size);
+    if(c < 0) return 0;
+    if(c >= n) return n - 1;
+    return c;
+}
+
+static inline int cell_of(InterestGrid* g, float x, float z)
+{
+    return cell_coord(z, g->min[1], g->cell_size, g->rows)*g->cols + cell_coord(x, g->min[0], g->cell_size, g->cols);
+}
+
+void interest_grid_begin(InterestGrid* g)
+{
+    g->count = 0;
+}
+
+void interest_grid_add(InterestGrid* g, uint16_t index, float x, float z)
+{
+    if(g->count >= g->cap)
+        return;
+
+    g->add_index[g->count] = index;
+    g->add_x[g->count] = x;
+    g->add_z[g->count] = z;
+    g->count++;
+}
+
+// Counting sort by cell, so each cell's entities are contiguous
+void interest_grid_end(InterestGrid* g)
+{
+    int cells = g->cols*g->rows;
+    memset(g->cell_start, 0, (cells + 1)*sizeof(int));
+
+    for(int i = 0; i < g->count; ++i)
+        g->cell_start[cell_of(g, g->add_x[i], g->add_z[i]) + 1]++;
+
+    for(int c = 0; c < cells; ++c)
+    {
+        g->cell_start[c + 1] += g->cell_start[c];
+        g->cell_fill[c] = g->cell_start[c];
+    }
+
+    for(int i = 0; i < g->count; ++i)
+    {
+        int j = g->cell_fill[cell_of(g, g->add_x[i], g->add_z[i])]++;
+        g->index[j] = g->add_index[i];
+        g->x[j] = g->add_x[i];
+        g->z[j] = g->add_z[i];
+    }
+}
+
+static int cmp_index(const void* a, const void* b)
+{
+    return (int)*(const uint16_t*)a - (int)*(const uint16_t*)b;
+}
+
+int interest_grid_query(InterestGrid* g, float x, float z, float radius, uint16_t* out, int max)
+{
+    int c0 = cell_coord(x - radius, g->min[0], g->cell_size, g->cols);
+    int c1 = cell_coord(x + radius, g->min[0], g->cell_size, g->cols);
+    int r0 = cell_coord(z - radius, g->min[1], g->cell_size, g->rows);
+    int r1 = cell_coord(z + radius, g->min[1], g->cell_size, g->rows);
+
+    float r2 = radius*radius;
+    int count = 0;
+
+    for(int r = r0; r <= r1; ++r)
+    {
+        for(int c = c0; c <= c1; ++c)
+        {
+            int cell = r*g->cols + c;
+            for(int i = g->cell_start[cell]; i < g->cell_start[cell + 1]; ++i)
+            {
+                float dx = g->x[i] - x, dz = g->z[i] - z;
+                if(dx*dx + dz*dz <= r2 && count < max)
+                    out[count++] = g->index[i];
+            }
+        }
+    }
+
+    qsort(out, count, sizeof(uint16_t), cmp_index);
+    return count;
+}
+
+float interest_weight(const float viewer[3], float viewer_theta, const float target[3], float radius)
+{
+    float dx = target[0] - viewer[0];
+    float dy = target[1] - viewer[1];
+    float dz = target[2] - viewer[2];
+    float dist = sqrtf(dx*dx + dy*dy + dz*dz);
+
+    if(dist > radius)
+        return 0.0f;
+    if(dist <= INTEREST_NEAR)
+        return 1.0f;
+
+    float near = 1.0f - (dist - INTEREST_NEAR)/(radius - INTEREST_NEAR);
+    float w = INTEREST_WEIGHT_MIN + (1.0f - INTEREST_WEIGHT_MIN)*near*near;
+
+    // facing is +z turned theta degrees about +y
+    {
+        float theta = viewer_theta*(float)M_PI/180.0f;
+        float facing = (sinf(theta)*dx + cosf(theta)*dz) / dist;
+        if(facing < INTEREST_VIEW_COS)
+            w *= INTEREST_BEHIND;
+    }
+
+    return w;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Area of interest for state packets.
+//
+// Players are bucketed each snapshot into a uniform grid over the world
+// bounds (the terrain's, see snapshot_set_bounds()). A viewer only gets
+// the players within INTEREST_RADIUS of it, found by visiting the cells
+// the radius overlaps, and each of those gets a weight for how often it
+// should be updated: 1 (every snapshot) up close, falling off with
+// distance beyond that, and less for ones behind the viewer than in front.
+
+#define INTEREST_CELL_SIZE   32.0f // meters
+#define INTEREST_RADIUS      128.0f
+#define INTEREST_NEAR        24.0f // full weight whichever way the viewer faces
+#define INTEREST_VIEW_COS    0.5f  // cos of half the view cone
+#define INTEREST_BEHIND      0.35f // weight scale outside the view cone
+#define INTEREST_WEIGHT_MIN  0.05f // at the edge of the radius
+
+typedef struct
+{
+    float min[2]; // x, z
+    float cell_size;
+    int cols;
+    int rows;
+
+    int* cell_start; // cols*rows + 1, into the entries below
+    int* cell_fill;  // write position while building
+
+    // bucketed by cell
+    uint16_t* index;
+    float* x;
+    float* z;
+
+    // added this snapshot, in add order
+    uint16_t* add_index;
+    float* add_x;
+    float* add_z;
+    int count;
+    int cap;
+} InterestGrid;
+
+bool interest_grid_init(InterestGrid* g, const float min[3], const float max[3], float cell_size, int max_entities);
+void interest_grid_free(InterestGrid* g);
+
+void interest_grid_begin(InterestGrid* g);
+void interest_grid_add(InterestGrid* g, uint16_t index, float x, float z);
+void interest_grid_end(InterestGrid* g);
+
+// Entities within radius of (x,z), sorted by index. Returns the count,
+// at most max.
+int interest_grid_query(InterestGrid* g, float x, float z, float radius, uint16_t* out, int max);
+
+// Update weight of target for a viewer at pos facing theta degrees, 0 if
+// it's outside the radius
+float interest_weight(const float viewer[3], float viewer_theta, const float target[3], float radius);
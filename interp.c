@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "interp.h"
+
+#define SLOT(id) ((int)((id) & (INTERP_BUFFER_SIZE - 1)))
+
+void interp_init(InterpBuffer* buf, double tick_interval)
+{
+    interp_free(buf);
+    buf->tick_interval = tick_interval;
+    buf->delay = tick_interval;
+    buf->target_delay = tick_interval;
+}
+
+void interp_free(InterpBuffer* buf)
+{
+    for(int i = 0; i < INTERP_BUFFER_SIZE; ++i)
+        snapshot_free(&buf->snaps[i]);
+    memset(buf, 0, sizeof(InterpBuffer));
+}
+
+void interp_push(InterpBuffer* buf, Snapshot* snap, double now)
+{
+    int64_t id;
+
+    if(!buf->started)
+    {
+        id = snap->id;
+        buf->started = true;
+        buf->latest_id = id;
+        buf->offset = now - id*buf->tick_interval;
+        buf->last_transit = buf->offset;
+    }
+    else
+    {
+        // ids wrap at 16 bits, unwrap relative to the newest
+        id = buf->latest_id + (int16_t)(snap->id - (uint16_t)buf->latest_id);
+        if(id <= buf->latest_id - INTERP_BUFFER_SIZE)
+            return; // too old to keep
+    }
+
+    int slot = SLOT(id);
+    if(buf->snaps[slot].valid && buf->ids[slot] == id)
+        return; // duplicate
+
+    if(!snapshot_copy(&buf->snaps[slot], snap))
+        return;
+    buf->snaps[slot].valid = true;
+    buf->ids[slot] = id;
+
+    if(id > buf->latest_id)
+        buf->latest_id = id;
+
+    double transit = now - id*buf->tick_interval;
+    buf->jitter += (fabs(transit - buf->last_transit) - buf->jitter) / 16.0;
+    buf->offset += (transit - buf->offset) / 16.0;
+    buf->last_transit = transit;
+}
+
+static inline Snapshot* get_snap(InterpBuffer* buf, int64_t id)
+{
+    Snapshot* s = &buf->snaps[SLOT(id)];
+    return (s->valid && buf->ids[SLOT(id)] == id) ? s : NULL;
+}
+
+void interp_update(InterpBuffer* buf, double now, double dt)
+{
+    buf->from = NULL;
+    buf->to = NULL;
+
+    if(!buf->started)
+        return;
+
+    if(buf->fixed_delay > 0.0)
+    {
+        buf->target_delay = buf->delay = buf->fixed_delay;
+    }
+    else
+    {
+        buf->target_delay = buf->tick_interval + INTERP_JITTER_SCALE*buf->jitter;
+        if(buf->target_delay > INTERP_DELAY_MAX)
+            buf->target_delay = INTERP_DELAY_MAX;
+
+        // catch up on lateness fast, give latency back slowly
+        if(buf->delay < buf->target_delay)
+            buf->delay = fmin(buf->target_delay, buf->delay + INTERP_DELAY_GROW_RATE*dt);
+        else
+            buf->delay = fmax(buf->target_delay, buf->delay - INTERP_DELAY_SHRINK_RATE*dt);
+    }
+
+    buf->render_time = now - buf->offset - buf->delay;
+
+    // newest snapshot at or before render time, and the first one after it
+    int64_t from_id = 0, to_id = 0;
+    for(int64_t id = buf->latest_id; id > buf->latest_id - INTERP_BUFFER_SIZE; --id)
+    {
+        Snapshot* s = get_snap(buf, id);
+        if(!s)
+            continue;
+
+        if(id*buf->tick_interval <= buf->render_time)
+        {
+            buf->from = s;
+            from_id = id;
+            break;
+        }
+
+        buf->to = s;
+        to_id = id;
+    }
+
+    if(!buf->from)
+    {
+        // behind everything buffered, hold the oldest
+        buf->from = buf->to;
+        buf->to = NULL;
+        buf->extrapolate = 0.0;
+        return;
+    }
+
+    double t0 = from_id*buf->tick_interval;
+
+    if(buf->to)
+    {
+        double t1 = to_id*buf->tick_interval;
+        buf->alpha = (buf->render_time - t0) / (t1 - t0);
+        buf->extrapolate = 0.0;
+    }
+    else
+    {
+        buf->extrapolate = fmin(buf->render_time - t0, INTERP_EXTRAPOLATE_MAX);
+        buf->starved_frames++;
+    }
+}
+
+static float lerp_degrees(float a, float b, float t)
+{
+    float d = fmodf(b - a, 360.0f);
+    if(d > 180.0f) d -= 360.0f;
+    else if(d < -180.0f) d += 360.0f;
+    return a + d*t;
+}
+
+bool interp_sample(InterpBuffer* buf, uint16_t index, NetPlayerState* out)
+{
+    if(!buf->from)
+        return false;
+
+    SnapshotEntity* a = snapshot_find(buf->from, index);
+    if(!a)
+        return false;
+
+    player_state_dequantize(&a->state, out);
+
+    SnapshotEntity* b = buf->to ? snapshot_find(buf->to, index) : NULL;
+    if(b)
+    {
+        NetPlayerState next;
+        player_state_dequantize(&b->state, &next);
+
+        float t = (float)buf->alpha;
+        for(int i = 0; i < 3; ++i)
+        {
+            out->pos[i] += (next.pos[i] - out->pos[i])*t;
+            out->vel[i] += (next.vel[i] - out->vel[i])*t;
+        }
+        out->angle_theta = lerp_degrees(out->angle_theta, next.angle_theta, t);
+        out->angle_omega += (next.angle_omega - out->angle_omega)*t;
+    }
+    else if(buf->extrapolate > 0.0)
+    {
+        for(int i = 0; i < 3; ++i)
+            out->pos[i] += out->vel[i]*(float)buf->extrapolate;
+    }
+
+    return true;
+}
+
+// Moves one player along a known path, sends 30 Hz snapshots over a link
+// with random extra delay and 2% loss, and renders at 120 Hz. Error is the
+// rendered position against the true position at the render time, so it
+// measures glitches from late snapshots rather than the delay itself.
+static void true_state(double t, NetPlayerState* s)
+{
+    // strafing: 8 m/s side to side, turning every 0.6 s, while circling
+    const double speed = 8.0, period = 1.2;
+    double phase = fmod(t, period) / period;
+
+    memset(s, 0, sizeof(NetPlayerState));
+    s->pos[0] = (float)(phase < 0.5 ? speed*period*(phase - 0.25) : speed*period*(0.75 - phase));
+    s->vel[0] = (float)(phase < 0.5 ? speed : -speed);
+    s->pos[2] = (float)(15.0*cos(0.5*t));
+    s->vel[2] = (float)(-7.5*sin(0.5*t));
+}
+
+typedef struct
+{
+    double arrival;
+    uint16_t id;
+} TestArrival;
+
+static int cmp_arrival(const void* a, const void* b)
+{
+    double d = ((TestArrival*)a)->arrival - ((TestArrival*)b)->arrival;
+    return (d > 0) - (d < 0);
+}
+
+static void run_interp_test(double jitter, double fixed_delay)
+{
+    const double tick = 1.0/30.0;
+    const double frame = 1.0/120.0;
+    const double duration = 30.0;
+    const double base_latency = 0.05;
+    const int num_snaps = (int)(duration/tick);
+
+    TestArrival* arrivals = malloc(num_snaps*sizeof(TestArrival));
+    int count = 0;
+
+    srand(7);
+    for(int i = 1; i <= num_snaps; ++i)
+    {
+        if(rand() % 100 < 2)
+            continue;
+        arrivals[count].id = (uint16_t)i;
+        arrivals[count].arrival = i*tick + base_latency + jitter*(rand() / (double)RAND_MAX);
+        count++;
+    }
+    qsort(arrivals, count, sizeof(TestArrival), cmp_arrival);
+
+    static InterpBuffer buf;
+    interp_init(&buf, tick);
+    buf.fixed_delay = fixed_delay;
+
+    Snapshot snap = {0};
+    snapshot_reserve(&snap, 1);
+
+    double err_sum = 0.0, err_max = 0.0, delay_sum = 0.0;
+    int frames = 0, next = 0;
+
+    for(double now = 0.0; now < duration; now += frame)
+    {
+        while(next < count && arrivals[next].arrival <= now)
+        {
+            NetPlayerState s;
+            true_state(arrivals[next].id*tick, &s);
+
+            snap.id = arrivals[next].id;
+            snap.count = 1;
+            snap.valid = true;
+            snap.entities[0].index = 0;
+            player_state_quantize(&s, &snap.entities[0].state);
+
+            interp_push(&buf, &snap, now);
+            next++;
+        }
+
+        interp_update(&buf, now, frame);
+
+        NetPlayerState shown, truth;
+        if(now < 2.0 || !interp_sample(&buf, 0, &shown))
+            continue; // let the estimates settle
+
+        true_state(buf.render_time, &truth);
+
+        double dx = shown.pos[0] - truth.pos[0];
+        double dz = shown.pos[2] - truth.pos[2];
+        double err = sqrt(dx*dx + dz*dz);
+
+        err_sum += err;
+        if(err > err_max) err_max = err;
+        delay_sum += buf.delay;
+        frames++;
+    }
+
+    printf("  jitter %3.0f ms  %-8s  delay %5.1f ms  error avg %6.3f m  max %6.3f m  starved %4.1f%%\n",
+           jitter*1000.0, fixed_delay > 0.0 ? "fixed" : "adaptive",
+           1000.0*delay_sum/frames, err_sum/frames, err_max, 100.0*buf.starved_frames/frames);
+
+    snapshot_free(&snap);
+    interp_free(&buf);
+    free(arrivals);
+}
+
+void interp_test()
+{
+    printf("Interpolation test (30 Hz snapshots, 120 Hz render, 50 ms base latency, 2%% loss)\n");
+
+    double jitters[] = {0.0, 0.02, 0.05, 0.1};
+    for(int i = 0; i < (int)(sizeof(jitters)/sizeof(jitters[0])); ++i)
+    {
+        run_interp_test(jitters[i], 1.0/30.0);
+        run_interp_test(jitters[i], 2.0/30.0);
+        run_interp_test(jitters[i], 0.0);
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "snapshot.h"
+
+// Snapshot interpolation for remote players.
+//
+// Decoded snapshots are kept by server time (snapshot id * tick interval)
+// and rendered a playout delay behind the newest estimate of server time,
+// interpolating between the two snapshots around that point or briefly
+// extrapolating along the velocity when none is newer. The delay follows
+// the measured arrival jitter: one tick plus INTERP_JITTER_SCALE times the
+// jitter, growing quickly when snapshots arrive late and shrinking slowly.
+
+#define INTERP_BUFFER_SIZE       32   // snapshots kept, power of 2
+#define INTERP_JITTER_SCALE      3.0
+#define INTERP_DELAY_MAX         0.5  // seconds
+#define INTERP_EXTRAPOLATE_MAX   0.2  // seconds
+#define INTERP_DELAY_GROW_RATE   0.5  // delay change per second of real time
+#define INTERP_DELAY_SHRINK_RATE 0.05
+
+typedef struct
+{
+    Snapshot snaps[INTERP_BUFFER_SIZE]; // indexed by id % INTERP_BUFFER_SIZE
+    int64_t ids[INTERP_BUFFER_SIZE];    // unwrapped ids
+
+    double tick_interval;
+    bool started;
+    int64_t latest_id;
+
+    // arrival stats
+    double offset;      // smoothed (arrival time - server time)
+    double jitter;      // smoothed transit time variation (RFC 3550 style)
+    double last_transit;
+
+    double delay;
+    double target_delay;
+    double fixed_delay; // > 0 turns adaptation off
+    double render_time; // server time being shown
+
+    // set by interp_update() for interp_sample()
+    Snapshot* from;
+    Snapshot* to;
+    double alpha;        // 0..1 between from and to
+    double extrapolate;  // seconds past from when to is NULL
+
+    uint32_t starved_frames;
+} InterpBuffer;
+
+void interp_init(InterpBuffer* buf, double tick_interval);
+void interp_free(InterpBuffer* buf);
+
+// now is local time; snapshots may arrive out of order or not at all
+void interp_push(InterpBuffer* buf, Snapshot* snap, double now);
+void interp_update(InterpBuffer* buf, double now, double dt);
+bool interp_sample(InterpBuffer* buf, uint16_t index, NetPlayerState* out);
+
+void interp_test();
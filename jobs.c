@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "jobs.h"
+#include "timer.h"
+
+typedef struct
+{
+    _Alignas(64) _Atomic int64_t top;    // stolen from
+    _Alignas(64) _Atomic int64_t bottom; // pushed and popped by the owner
+    _Atomic uint64_t ranges[JOBS_DEQUE_SIZE];
+} JobDeque;
+
+static struct
+{
+    int num_workers;
+    pthread_t threads[JOBS_MAX_WORKERS];
+    JobDeque deques[JOBS_MAX_WORKERS];
+
+    // current loop
+    JobFunc fn;
+    void* data;
+    int grain;
+    _Atomic int remaining; // items not done yet
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint64_t generation;
+    bool quit;
+} jobs = {.num_workers = 1};
+
+static inline uint64_t range_pack(int begin, int end)
+{
+    return ((uint64_t)(uint32_t)begin << 32) | (uint32_t)end;
+}
+
+static inline void range_unpack(uint64_t r, int* begin, int* end)
+{
+    *begin = (int)(r >> 32);
+    *end = (int)(uint32_t)r;
+}
+
+//
+// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for
+// Weak Memory Models", 2013)
+
+static void deque_push(JobDeque* d, uint64_t r)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    atomic_store_explicit(&d->ranges[b & (JOBS_DEQUE_SIZE - 1)], r, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static bool deque_pop(JobDeque* d, uint64_t* r)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if(t > b)
+    {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return false; // empty
+    }
+
+    *r = atomic_load_explicit(&d->ranges[b & (JOBS_DEQUE_SIZE - 1)], memory_order_relaxed);
+    if(t < b)
+        return true;
+
+    // last one, race the thieves for it
+    bool won = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+static bool deque_steal(JobDeque* d, uint64_t* r)
+{
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    if(t >= b)
+        return false;
+
+    *r = atomic_load_explicit(&d->ranges[t & (JOBS_DEQUE_SIZE - 1)], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// Splits off the upper half for others to steal until the range is one
+// grain, then runs it
+static void run_range(int worker, uint64_t r)
+{
+    int begin, end;
+    range_unpack(r, &begin, &end);
+
+    while(end - begin > jobs.grain)
+    {
+        int mid = begin + (end - begin) / 2;
+        deque_push(&jobs.deques[worker], range_pack(mid, end));
+        end = mid;
+    }
+
+    for(int i = begin; i < end; ++i)
+        jobs.fn(jobs.data, i, worker);
+
+    atomic_fetch_sub_explicit(&jobs.remaining, end - begin, memory_order_release);
+}
+
+// Ranges are split as soon as they're taken, so once there's nothing to
+// steal for a while only the last grains are still running. Workers go
+// back to sleep then; the calling thread stays until everything is done.
+#define JOBS_IDLE_ROUNDS 16
+
+static void do_work(int worker)
+{
+    int idle = 0;
+
+    while(atomic_load_explicit(&jobs.remaining, memory_order_acquire) > 0)
+    {
+        uint64_t r;
+
+        if(deque_pop(&jobs.deques[worker], &r))
+        {
+            run_range(worker, r);
+            idle = 0;
+            continue;
+        }
+
+        bool stole = false;
+        for(int i = 1; i < jobs.num_workers && !stole; ++i)
+        {
+            int victim = (worker + i) % jobs.num_workers;
+            if(deque_steal(&jobs.deques[victim], &r))
+            {
+                run_range(worker, r);
+                stole = true;
+            }
+        }
+
+        if(stole)
+        {
+            idle = 0;
+        }
+        else
+        {
+            if(worker != 0 && ++idle > JOBS_IDLE_ROUNDS)
+                return;
+            sched_yield();
+        }
+    }
+}
+
+static void* worker_thread(void* arg)
+{
+    int worker = (int)(intptr_t)arg;
+    uint64_t seen = 0;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&jobs.lock);
+        while(jobs.generation == seen && !jobs.quit)
+            pthread_cond_wait(&jobs.wake, &jobs.lock);
+        seen = jobs.generation;
+        bool quit = jobs.quit;
+        pthread_mutex_unlock(&jobs.lock);
+
+        if(quit)
+            break;
+
+        do_work(worker);
+    }
+
+    return NULL;
+}
+
+bool jobs_init(int num_workers)
+{
+    jobs_shutdown();
+
+    if(num_workers < 1) num_workers = 1;
+    if(num_workers > JOBS_MAX_WORKERS) num_workers = JOBS_MAX_WORKERS;
+
+    pthread_mutex_init(&jobs.lock, NULL);
+    pthread_cond_init(&jobs.wake, NULL);
+    jobs.quit = false;
+    jobs.generation = 0;
+    jobs.num_workers = num_workers;
+
+    for(int i = 1; i < num_workers; ++i)
+    {
+        if(pthread_create(&jobs.threads[i], NULL, worker_thread, (void*)(intptr_t)i) != 0)
+        {
+            printf("Failed to start job worker %d\n", i);
+            jobs.num_workers = i;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void jobs_shutdown()
+{
+    if(jobs.num_workers <= 1)
+        return;
+
+    pthread_mutex_lock(&jobs.lock);
+    jobs.quit = true;
+    pthread_cond_broadcast(&jobs.wake);
+    pthread_mutex_unlock(&jobs.lock);
+
+    for(int i = 1; i < jobs.num_workers; ++i)
+        pthread_join(jobs.threads[i], NULL);
+
+    pthread_mutex_destroy(&jobs.lock);
+    pthread_cond_destroy(&jobs.wake);
+    jobs.num_workers = 1;
+}
+
+int jobs_worker_count()
+{
+    return jobs.num_workers;
+}
+
+void jobs_parallel_for(JobFunc fn, void* data, int count, int grain)
+{
+    if(count <= 0)
+        return;
+
+    if(grain < 1)
+        grain = 1;
+
+    if(jobs.num_workers == 1 || count <= grain)
+    {
+        for(int i = 0; i < count; ++i)
+            fn(data, i, 0);
+        return;
+    }
+
+    jobs.fn = fn;
+    jobs.data = data;
+    jobs.grain = grain;
+    atomic_store_explicit(&jobs.remaining, count, memory_order_relaxed);
+    deque_push(&jobs.deques[0], range_pack(0, count));
+
+    pthread_mutex_lock(&jobs.lock);
+    jobs.generation++;
+    pthread_cond_broadcast(&jobs.wake);
+    pthread_mutex_unlock(&jobs.lock);
+
+    do_work(0);
+}
+
+// Runs loops of uneven items on 1..JOBS_MAX_WORKERS threads and checks each
+// index runs exactly once per loop
+typedef struct
+{
+    _Atomic int* hits;
+    int spin_max;
+} JobTest;
+
+static void job_test_item(void* data, int index, int worker)
+{
+    (void)worker;
+    JobTest* t = data;
+
+    // later items cost more, so an even split would be unbalanced
+    volatile int x = 0;
+    int spin = (int)((int64_t)t->spin_max * index / 4096);
+    for(int i = 0; i < spin; ++i)
+        x += i;
+
+    atomic_fetch_add_explicit(&t->hits[index], 1, memory_order_relaxed);
+}
+
+void jobs_test()
+{
+    const int count = 4096;
+    const int loops = 20;
+
+    JobTest t = {.hits = calloc(count, sizeof(_Atomic int)), .spin_max = 20000};
+    int prev = jobs_worker_count();
+
+    printf("Jobs test (%d uneven items x %d loops)\n", count, loops);
+    bool ok = true;
+
+    for(int workers = 1; workers <= 8; workers *= 2)
+    {
+        jobs_init(workers);
+        memset(t.hits, 0, count*sizeof(_Atomic int));
+
+        double t0 = timer_get_time();
+        for(int i = 0; i < loops; ++i)
+            jobs_parallel_for(job_test_item, &t, count, 16);
+        double elapsed = timer_get_time() - t0;
+
+        int bad = 0;
+        for(int i = 0; i < count; ++i)
+            bad += (atomic_load(&t.hits[i]) != loops);
+        ok &= (bad == 0);
+
+        printf("  %d workers: %7.2f ms per loop, %d items miscounted\n", workers, 1000.0*elapsed/loops, bad);
+    }
+
+    printf("%s\n", ok ? "PASSED" : "FAILED");
+
+    jobs_init(prev);
+    free(t.hits);
+}
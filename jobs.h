@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Small fork-join job system for data parallel loops.
+//
+// A fixed set of worker threads sleeps until jobs_parallel_for() hands out
+// a range. The range is split in halves down to the grain size: each
+// thread pushes the half it isn't working on to the bottom of its own
+// deque and the others steal from the top (Chase-Lev), so load balances
+// itself when some items cost more than others. The calling thread works
+// too and returns once every item is done.
+
+#define JOBS_MAX_WORKERS 64 // including the calling thread
+#define JOBS_DEQUE_SIZE  256 // per thread, power of 2
+
+// fn is called once per index in [0,count) with the worker (0 is the
+// calling thread) so each can keep its own scratch
+typedef void (*JobFunc)(void* data, int index, int worker);
+
+// num_workers includes the calling thread, 1 runs everything inline
+bool jobs_init(int num_workers);
+void jobs_shutdown();
+int jobs_worker_count();
+
+void jobs_parallel_for(JobFunc fn, void* data, int count, int grain);
+
+void jobs_test();
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "lagcomp.h"
+#include "timer.h"
+
+bool lagcomp_pose_reserve(LagCompPose* pose, int count)
+{
+    if(count <= pose->cap)
+        return true;
+
+    uint16_t* index = realloc(pose->index, count*sizeof(uint16_t));
+    if(index) pose->index = index;
+    float* x = realloc(pose->x, count*sizeof(float));
+    if(x) pose->x = x;
+    float* y = realloc(pose->y, count*sizeof(float));
+    if(y) pose->y = y;
+    float* z = realloc(pose->z, count*sizeof(float));
+    if(z) pose->z = z;
+    float* height = realloc(pose->height, count*sizeof(float));
+    if(height) pose->height = height;
+
+    if(!index || !x || !y || !z || !height)
+        return false;
+
+    pose->cap = count;
+    return true;
+}
+
+void lagcomp_pose_free(LagCompPose* pose)
+{
+    free(pose->index);
+    free(pose->x);
+    free(pose->y);
+    free(pose->z);
+    free(pose->height);
+    memset(pose, 0, sizeof(LagCompPose));
+}
+
+bool lagcomp_init(LagCompHistory* h, int max_players, double tick_rate)
+{
+    lagcomp_free(h);
+
+    // one extra so a full window is always between two frames
+    h->num_frames = (int)ceil(LAGCOMP_WINDOW*tick_rate) + 1;
+    h->frames = calloc(h->num_frames, sizeof(LagCompPose));
+    if(!h->frames)
+        return false;
+
+    for(int i = 0; i < h->num_frames; ++i)
+    {
+        if(!lagcomp_pose_reserve(&h->frames[i], max_players))
+        {
+            lagcomp_free(h);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void lagcomp_free(LagCompHistory* h)
+{
+    if(h->frames)
+    {
+        for(int i = 0; i < h->num_frames; ++i)
+            lagcomp_pose_free(&h->frames[i]);
+        free(h->frames);
+    }
+    memset(h, 0, sizeof(LagCompHistory));
+}
+
+LagCompPose* lagcomp_begin_frame(LagCompHistory* h, double time)
+{
+    LagCompPose* f = &h->frames[h->head];
+    f->time = time;
+    f->count = 0;
+
+    h->head = (h->head + 1) % h->num_frames;
+    if(h->count < h->num_frames)
+        h->count++;
+
+    return f;
+}
+
+void lagcomp_add(LagCompPose* frame, uint16_t index, const float pos[3], float height)
+{
+    if(frame->count >= frame->cap)
+        return;
+
+    int i = frame->count++;
+    frame->index[i] = index;
+    frame->x[i] = pos[0];
+    frame->y[i] = pos[1];
+    frame->z[i] = pos[2];
+    frame->height[i] = height;
+}
+
+// i-th oldest
+static inline LagCompPose* get_frame(LagCompHistory* h, int i)
+{
+    return &h->frames[(h->head - h->count + i + h->num_frames) % h->num_frames];
+}
+
+bool lagcomp_rewind(LagCompHistory* h, double time, LagCompPose* pose)
+{
+    if(h->count == 0)
+        return false;
+
+    // newest frame at or before time
+    int lo = 0, hi = h->count - 1;
+    if(time <= get_frame(h, 0)->time)
+    {
+        hi = 0;
+    }
+    else
+    {
+        while(lo < hi)
+        {
+            int mid = (lo + hi + 1) / 2;
+            if(get_frame(h, mid)->time <= time)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+    }
+
+    LagCompPose* from = get_frame(h, hi);
+    LagCompPose* to = hi + 1 < h->count ? get_frame(h, hi + 1) : NULL;
+
+    if(!lagcomp_pose_reserve(pose, from->count))
+        return false;
+
+    pose->count = from->count;
+    memcpy(pose->index, from->index, from->count*sizeof(uint16_t));
+    memcpy(pose->x, from->x, from->count*sizeof(float));
+    memcpy(pose->y, from->y, from->count*sizeof(float));
+    memcpy(pose->z, from->z, from->count*sizeof(float));
+    memcpy(pose->height, from->height, from->count*sizeof(float));
+
+    if(!to || time <= from->time)
+    {
+        pose->time = from->time;
+        return true;
+    }
+
+    pose->time = time;
+    float t = (float)((time - from->time) / (to->time - from->time));
+
+    // both sorted by index, walk them together
+    int j = 0;
+    for(int i = 0; i < pose->count; ++i)
+    {
+        while(j < to->count && to->index[j] < pose->index[i])
+            j++;
+        if(j == to->count)
+            break;
+        if(to->index[j] != pose->index[i])
+            continue;
+
+        pose->x[i] += (to->x[j] - pose->x[i])*t;
+        pose->y[i] += (to->y[j] - pose->y[i])*t;
+        pose->z[i] += (to->z[j] - pose->z[i])*t;
+    }
+
+    return true;
+}
+
+// Plain compares rather than fminf()/fmaxf(), which are library calls
+// without -ffast-math; these are single instructions
+static inline float min_f(float a, float b) { return a < b ? a : b; }
+static inline float max_f(float a, float b) { return a > b ? a : b; }
+
+// Slab test against each box, keeping the nearest entry point
+bool lagcomp_raycast(LagCompPose* pose, const float origin[3], const float dir[3], float max_dist, int ignore_index, LagCompHit* hit)
+{
+    const float r = LAGCOMP_HITBOX_RADIUS;
+    float inv[3] = {1.0f/dir[0], 1.0f/dir[1], 1.0f/dir[2]};
+    float best = max_dist;
+    int best_i = -1;
+
+    for(int i = 0; i < pose->count; ++i)
+    {
+        float tx1 = (pose->x[i] - r - origin[0])*inv[0];
+        float tx2 = (pose->x[i] + r - origin[0])*inv[0];
+        float ty1 = (pose->y[i] - origin[1])*inv[1];
+        float ty2 = (pose->y[i] + pose->height[i] - origin[1])*inv[1];
+        float tz1 = (pose->z[i] - r - origin[2])*inv[2];
+        float tz2 = (pose->z[i] + r - origin[2])*inv[2];
+
+        float tnear = max_f(max_f(min_f(tx1, tx2), min_f(ty1, ty2)), max_f(min_f(tz1, tz2), 0.0f));
+        float tfar = min_f(min_f(max_f(tx1, tx2), max_f(ty1, ty2)), min_f(max_f(tz1, tz2), best));
+
+        if(tnear <= tfar && pose->index[i] != ignore_index)
+        {
+            best = tnear;
+            best_i = i;
+        }
+    }
+
+    hit->index = -1;
+    if(best_i < 0)
+        return false;
+
+    hit->index = pose->index[best_i];
+    hit->dist = best;
+    for(int k = 0; k < 3; ++k)
+        hit->point[k] = origin[k] + dir[k]*best;
+    return true;
+}
+
+// Players run in straight lines at different speeds, recorded at 30 Hz.
+// Rewinding to any time in the window must put them exactly on their
+// lines, and a shot aimed at where a player was at that time must hit it
+// (or something in front of it), while the same shot at the present
+// mostly misses the fast ones.
+#define LAGCOMP_TEST_RATE 30.0
+
+static void test_position(int i, double t, float pos[3])
+{
+    float speed = 2.0f + (i % 8);
+    float heading = 0.7f*i;
+    pos[0] = (float)(((i % 16) - 8)*6.0 + cos(heading)*speed*t);
+    pos[1] = 0.0f;
+    pos[2] = (float)(((i / 16) - 8)*6.0 + sin(heading)*speed*t);
+}
+
+static void record_test_ticks(LagCompHistory* h, int num_players, int ticks)
+{
+    for(int tick = 0; tick < ticks; ++tick)
+    {
+        double t = tick / LAGCOMP_TEST_RATE;
+        LagCompPose* f = lagcomp_begin_frame(h, t);
+        for(int i = 0; i < num_players; ++i)
+        {
+            float pos[3];
+            test_position(i, t, pos);
+            lagcomp_add(f, (uint16_t)i, pos, 1.0f);
+        }
+    }
+}
+
+// From a point 20m away at eye height, at the center of player i's box
+static void aim_at(const float target[3], float origin[3], float dir[3], int seed)
+{
+    float a = 0.37f*seed;
+    origin[0] = target[0] + 20.0f*cosf(a);
+    origin[1] = target[1] + 1.5f;
+    origin[2] = target[2] + 20.0f*sinf(a);
+
+    float len = 0.0f;
+    for(int k = 0; k < 3; ++k)
+    {
+        float c = (k == 1) ? target[1] + 0.5f : target[k];
+        dir[k] = c - origin[k];
+        len += dir[k]*dir[k];
+    }
+    len = sqrtf(len);
+    for(int k = 0; k < 3; ++k)
+        dir[k] /= len;
+}
+
+void lagcomp_test()
+{
+    const int num_players = 64;
+    const int ticks = 300;
+
+    LagCompHistory h = {0};
+    LagCompPose pose = {0};
+    lagcomp_init(&h, num_players, LAGCOMP_TEST_RATE);
+    record_test_ticks(&h, num_players, ticks);
+
+    double newest = (ticks - 1) / LAGCOMP_TEST_RATE;
+    double oldest = get_frame(&h, 0)->time;
+
+    srand(3);
+    float err_max = 0.0f;
+    int misses = 0, present_misses = 0, queries = 0;
+
+    for(int q = 0; q < 2000; ++q)
+    {
+        double t = oldest + (newest - oldest)*(rand() / (double)RAND_MAX);
+        lagcomp_rewind(&h, t, &pose);
+
+        for(int i = 0; i < pose.count; ++i)
+        {
+            float pos[3];
+            test_position(pose.index[i], t, pos);
+            err_max = fmaxf(err_max, fabsf(pose.x[i] - pos[0]));
+            err_max = fmaxf(err_max, fabsf(pose.z[i] - pos[2]));
+        }
+
+        int target = rand() % num_players;
+        float pos[3], origin[3], dir[3], dist;
+        test_position(target, t, pos);
+        aim_at(pos, origin, dir, q);
+        dist = sqrtf(20.0f*20.0f + 1.0f);
+
+        LagCompHit hit;
+        if(!lagcomp_raycast(&pose, origin, dir, 100.0f, -1, &hit) || (hit.index != target && hit.dist > dist))
+            misses++;
+
+        // the same shot without rewinding
+        lagcomp_rewind(&h, newest, &pose);
+        if(!lagcomp_raycast(&pose, origin, dir, 100.0f, -1, &hit) || hit.index != target)
+            present_misses++;
+
+        queries++;
+    }
+
+    // clamped to the window at both ends
+    lagcomp_rewind(&h, -10.0, &pose);
+    bool clamp_ok = pose.time == oldest;
+    lagcomp_rewind(&h, newest + 10.0, &pose);
+    clamp_ok &= pose.time == newest;
+
+    printf("Lag compensation test (%d players, %d frames kept)\n", num_players, h.count);
+    printf("  rewound position max error %.6f m\n", err_max);
+    printf("  shots at the rewound target: %d of %d missed\n", misses, queries);
+    printf("  same shots against the present: %d of %d missed\n", present_misses, queries);
+    printf("%s\n", (err_max < 0.001f && misses == 0 && clamp_ok) ? "PASSED" : "FAILED");
+
+    lagcomp_pose_free(&pose);
+    lagcomp_free(&h);
+}
+
+// Cost of a query at a random time in the window against num_players,
+// rewinding each time, and of further ray tests sharing one rewind.
+void lagcomp_bench(int num_players, int num_queries)
+{
+    LagCompHistory h = {0};
+    LagCompPose pose = {0};
+    lagcomp_init(&h, num_players, LAGCOMP_TEST_RATE);
+    record_test_ticks(&h, num_players, 100);
+
+    double newest = 99 / LAGCOMP_TEST_RATE;
+    double oldest = get_frame(&h, 0)->time;
+
+    float* rays = malloc(num_queries*7*sizeof(float));
+    srand(5);
+    for(int q = 0; q < num_queries; ++q)
+    {
+        float* r = &rays[q*7];
+        r[0] = oldest + (newest - oldest)*(rand() / (float)RAND_MAX);
+
+        float pos[3];
+        test_position(rand() % num_players, r[0], pos);
+        aim_at(pos, &r[1], &r[4], q);
+    }
+
+    int hits = 0;
+    LagCompHit hit;
+
+    double t0 = timer_get_time();
+    for(int q = 0; q < num_queries; ++q)
+    {
+        float* r = &rays[q*7];
+        lagcomp_rewind(&h, r[0], &pose);
+        hits += lagcomp_raycast(&pose, &r[1], &r[4], 100.0f, -1, &hit);
+    }
+    double t_rewind = timer_get_time() - t0;
+
+    lagcomp_rewind(&h, oldest + 0.5, &pose);
+    t0 = timer_get_time();
+    for(int q = 0; q < num_queries; ++q)
+    {
+        float* r = &rays[q*7];
+        hits += lagcomp_raycast(&pose, &r[1], &r[4], 100.0f, -1, &hit);
+    }
+    double t_ray = timer_get_time() - t0;
+
+    printf("Lag compensation (%d players, %d queries, %d hits)\n", num_players, num_queries, hits);
+    printf("  rewind + ray: %8.1f ns/query\n", 1e9*t_rewind/num_queries);
+    printf("  ray only:     %8.1f ns/query\n", 1e9*t_ray/num_queries);
+
+    free(rays);
+    lagcomp_pose_free(&pose);
+    lagcomp_free(&h);
+}
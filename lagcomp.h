@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Server-side lag compensation.
+//
+// The server records every player's hitbox once per tick into a ring
+// covering the last LAGCOMP_WINDOW seconds. A query for time T binary
+// searches the ring for the two ticks around T and interpolates between
+// them into a LagCompPose, which ray tests then run against. Hitboxes are
+// vertical boxes LAGCOMP_HITBOX_RADIUS to each side of the player's
+// position, from the feet up to its height.
+//
+// Frames and poses are stored as arrays per field so a ray test is one
+// straight pass over the players. Queries at the same time should share
+// one lagcomp_rewind().
+
+#define LAGCOMP_WINDOW        1.0  // seconds of history kept
+#define LAGCOMP_HITBOX_RADIUS 0.4f // meters
+
+typedef struct
+{
+    double time; // server time the positions are from
+    int count;
+    int cap;
+    uint16_t* index; // client slot, ascending
+    float* x;
+    float* y; // feet
+    float* z;
+    float* height;
+} LagCompPose;
+
+typedef struct
+{
+    LagCompPose* frames; // ring, oldest first from head - count
+    int num_frames;
+    int count; // frames recorded, up to num_frames
+    int head;  // next frame to write
+} LagCompHistory;
+
+typedef struct
+{
+    int index;      // client slot hit, -1 if none
+    float dist;     // along the ray
+    float point[3];
+} LagCompHit;
+
+bool lagcomp_init(LagCompHistory* h, int max_players, double tick_rate);
+void lagcomp_free(LagCompHistory* h);
+
+// Starts the frame for a tick, overwriting the oldest once the ring is
+// full. Players must be added in ascending index.
+LagCompPose* lagcomp_begin_frame(LagCompHistory* h, double time);
+void lagcomp_add(LagCompPose* frame, uint16_t index, const float pos[3], float height);
+
+// Time is clamped to the history. Players are taken from the older of the
+// two frames and moved towards where they are in the newer one.
+bool lagcomp_rewind(LagCompHistory* h, double time, LagCompPose* pose);
+bool lagcomp_pose_reserve(LagCompPose* pose, int count);
+void lagcomp_pose_free(LagCompPose* pose);
+
+// dir must be normalised. Skips ignore_index (the shooter), -1 for none.
+bool lagcomp_raycast(LagCompPose* pose, const float origin[3], const float dir[3], float max_dist, int ignore_index, LagCompHit* hit);
+
+void lagcomp_test();
+void lagcomp_bench(int num_players, int num_queries);
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+
+#include "socket.h"
+#include "metrics.h"
+
+static inline int histogram_bucket(uint64_t value)
+{
+    int b = 0;
+    while(value > 0 && b < METRICS_HISTOGRAM_BUCKETS - 1)
+    {
+        value >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void metrics_histogram_add(MetricsHistogram* h, uint64_t value)
+{
+    h->buckets[histogram_bucket(value)]++;
+    h->count++;
+    h->sum += value;
+    if(value > h->max)
+        h->max = value;
+}
+
+void metrics_histogram_merge(MetricsHistogram* into, const MetricsHistogram* h)
+{
+    for(int i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i)
+        into->buckets[i] += h->buckets[i];
+    into->count += h->count;
+    into->sum += h->sum;
+    if(h->max > into->max)
+        into->max = h->max;
+}
+
+uint64_t metrics_histogram_quantile(const MetricsHistogram* h, double p)
+{
+    if(h->count == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)ceil(p*h->count);
+    if(target < 1) target = 1;
+
+    uint64_t seen = 0;
+    for(int b = 0; b < METRICS_HISTOGRAM_BUCKETS; ++b)
+    {
+        seen += h->buckets[b];
+        if(seen >= target)
+        {
+            uint64_t upper = (b == 0) ? 0 : ((uint64_t)1 << b) - 1;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+//
+// Connections
+
+void metrics_conn_reset(MetricsConn* c)
+{
+    memset(c, 0, sizeof(MetricsConn));
+}
+
+void metrics_conn_sent(MetricsConn* c, uint16_t packet_id, double now)
+{
+    int i = packet_id % METRICS_SENT_PACKETS;
+
+    // far older than any ack bitfield reaches
+    if(c->sent_waiting[i])
+        c->lost++;
+
+    c->sent_id[i] = packet_id;
+    c->sent_waiting[i] = true;
+    c->sent_time[i] = now;
+}
+
+static void conn_rtt_sample(MetricsConn* c, double rtt)
+{
+    if(c->rtt.count == 0 && c->srtt == 0.0)
+    {
+        c->srtt = rtt;
+    }
+    else
+    {
+        c->jitter += (fabs(rtt - c->last_rtt) - c->jitter) / 16.0;
+        c->srtt = 0.875*c->srtt + 0.125*rtt;
+    }
+
+    c->last_rtt = rtt;
+    metrics_histogram_add(&c->rtt, (uint64_t)(rtt*1000000.0));
+}
+
+// Same walk as channel_process_ack()
+void metrics_conn_ack(MetricsConn* c, uint16_t ack, uint32_t ack_bits, double now)
+{
+    for(int i = 0; i <= 32; ++i)
+    {
+        if(i > 0 && !(ack_bits & ((uint32_t)1 << (i - 1))))
+            continue;
+
+        uint16_t packet_id = ack - i;
+        int j = packet_id % METRICS_SENT_PACKETS;
+        if(!c->sent_waiting[j] || c->sent_id[j] != packet_id)
+            continue;
+
+        c->sent_waiting[j] = false;
+        c->acked++;
+        conn_rtt_sample(c, now - c->sent_time[j]);
+    }
+}
+
+void metrics_conn_received(MetricsConn* c, uint16_t packet_id, uint16_t latest)
+{
+    uint16_t gap = packet_id - latest;
+    c->received++;
+    if(gap > 1 && gap <= 32)
+        c->missed += gap - 1;
+}
+
+void metrics_conn_period_reset(MetricsConn* c)
+{
+    memset(&c->rtt, 0, sizeof(c->rtt));
+    c->acked = 0;
+    c->lost = 0;
+    c->received = 0;
+    c->missed = 0;
+    memset(c->in, 0, sizeof(c->in));
+    memset(c->out, 0, sizeof(c->out));
+}
+
+//
+// JSON lines
+
+static void line_printf(MetricsLine* l, const char* fmt, ...)
+{
+    if(l->overflow)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(l->data + l->len, METRICS_LINE_MAX - l->len, fmt, args);
+    va_end(args);
+
+    if(n < 0 || l->len + n >= METRICS_LINE_MAX - 2) // room for the closing "}\n"
+        l->overflow = true;
+    else
+        l->len += n;
+}
+
+static void line_key(MetricsLine* l, const char* key)
+{
+    line_printf(l, "%s\"%s\":", l->comma ? "," : "", key);
+    l->comma = true;
+}
+
+void metrics_line_begin(MetricsLine* l)
+{
+    l->len = 0;
+    l->comma = false;
+    l->overflow = false;
+    line_printf(l, "{");
+}
+
+void metrics_line_end(MetricsLine* l)
+{
+    line_printf(l, "}\n");
+}
+
+void metrics_line_object_begin(MetricsLine* l, const char* key)
+{
+    line_key(l, key);
+    line_printf(l, "{");
+    l->comma = false;
+}
+
+void metrics_line_object_end(MetricsLine* l)
+{
+    line_printf(l, "}");
+    l->comma = true;
+}
+
+void metrics_line_u64(MetricsLine* l, const char* key, uint64_t value)
+{
+    line_key(l, key);
+    line_printf(l, "%llu", (unsigned long long)value);
+}
+
+void metrics_line_f64(MetricsLine* l, const char* key, double value)
+{
+    line_key(l, key);
+    if(isfinite(value))
+        line_printf(l, "%.6g", value);
+    else
+        line_printf(l, "null");
+}
+
+void metrics_line_str(MetricsLine* l, const char* key, const char* value)
+{
+    line_key(l, key);
+    line_printf(l, "\"");
+    for(const char* p = value; *p; ++p)
+    {
+        if(*p == '"' || *p == '\\')
+            line_printf(l, "\\%c", *p);
+        else if((unsigned char)*p < 0x20)
+            line_printf(l, "\\u%04x", *p);
+        else
+            line_printf(l, "%c", *p);
+    }
+    line_printf(l, "\"");
+}
+
+void metrics_line_histogram(MetricsLine* l, const char* key, const MetricsHistogram* h, double scale)
+{
+    metrics_line_object_begin(l, key);
+    metrics_line_u64(l, "count", h->count);
+    metrics_line_f64(l, "mean", h->count ? scale*(double)h->sum/h->count : 0.0);
+    metrics_line_f64(l, "p50", scale*metrics_histogram_quantile(h, 0.50));
+    metrics_line_f64(l, "p99", scale*metrics_histogram_quantile(h, 0.99));
+    metrics_line_f64(l, "max", scale*h->max);
+    metrics_line_object_end(l);
+}
+
+//
+// Output
+
+bool metrics_sink_set_file(MetricsSink* s, const char* path)
+{
+    if(s->file)
+    {
+        fclose(s->file);
+        s->file = NULL;
+    }
+
+    if(!path)
+        return true;
+
+    s->file = fopen(path, "a");
+    if(!s->file)
+    {
+        printf("Failed to open metrics file %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool metrics_sink_set_port(MetricsSink* s, uint16_t port)
+{
+    if(s->port != 0)
+    {
+        socket_close(s->socket);
+        s->port = 0;
+    }
+
+    if(port == 0)
+        return true;
+
+    if(!socket_create(&s->socket))
+    {
+        printf("Failed to create metrics socket\n");
+        return false;
+    }
+    s->port = port;
+    return true;
+}
+
+bool metrics_sink_active(MetricsSink* s)
+{
+    return s->file != NULL || s->port != 0;
+}
+
+void metrics_sink_write(MetricsSink* s, MetricsLine* l)
+{
+    if(l->overflow)
+        return;
+
+    if(s->file)
+        fwrite(l->data, 1, l->len, s->file);
+
+    if(s->port != 0)
+    {
+        Address to = {127, 0, 0, 1, s->port};
+        socket_sendto(s->socket, &to, (uint8_t*)l->data, l->len);
+    }
+}
+
+void metrics_sink_flush(MetricsSink* s)
+{
+    if(s->file)
+        fflush(s->file);
+}
+
+void metrics_sink_close(MetricsSink* s)
+{
+    metrics_sink_set_file(s, NULL);
+    metrics_sink_set_port(s, 0);
+}
+
+//
+// Checks the histogram quantiles, and rtt and loss from acks over a link
+// with a known delay that drops every fifth packet
+
+void metrics_test()
+{
+    bool ok = true;
+
+    MetricsHistogram h = {0};
+    for(int i = 1; i <= 1000; ++i)
+        metrics_histogram_add(&h, i);
+
+    uint64_t p50 = metrics_histogram_quantile(&h, 0.5);
+    uint64_t p99 = metrics_histogram_quantile(&h, 0.99);
+    ok &= (p50 >= 500 && p50 < 1024) && (p99 >= 990 && p99 <= 1000) && h.max == 1000;
+    printf("Metrics test\n  histogram 1..1000: p50 <= %llu, p99 <= %llu, max %llu\n",
+           (unsigned long long)p50, (unsigned long long)p99, (unsigned long long)h.max);
+
+    static MetricsConn c;
+    metrics_conn_reset(&c);
+
+    const double dt = 1.0/30.0;
+    const int delay = 3; // ticks each way
+    const int packets = 3000;
+
+    uint16_t ack = 0;
+    uint32_t ack_bits = 0;
+    bool have_ack = false;
+
+    for(int t = 0; t < packets + 2*delay; ++t)
+    {
+        double now = t*dt;
+
+        if(t < packets)
+            metrics_conn_sent(&c, (uint16_t)t, now);
+
+        // the peer received packet t - delay and its ack arrives now, after
+        // another delay, carrying everything it had then
+        int arrived = t - 2*delay;
+        if(arrived >= 0 && arrived < packets && arrived % 5 != 4)
+        {
+            uint16_t id = (uint16_t)arrived;
+            if(!have_ack)
+            {
+                ack = id;
+                have_ack = true;
+            }
+            else
+            {
+                uint16_t shift = id - ack;
+                ack_bits = (shift >= 32) ? 0 : (ack_bits << shift);
+                if(shift <= 32)
+                    ack_bits |= (uint32_t)1 << (shift - 1);
+                ack = id;
+            }
+            metrics_conn_ack(&c, ack, ack_bits, now);
+        }
+    }
+
+    // the last packets are only counted lost when their slot is reused
+    double loss = (double)c.lost / (c.acked + c.lost);
+    double expect_rtt = 2*delay*dt;
+    ok &= fabs(c.srtt - expect_rtt) < 0.001 && c.jitter < 0.001 && fabs(loss - 0.2) < 0.01;
+
+    printf("  rtt %.1f ms (expected %.1f), jitter %.2f ms, %u acked, %u lost (%.1f%%)\n",
+           1000.0*c.srtt, 1000.0*expect_rtt, 1000.0*c.jitter, c.acked, c.lost, 100.0*loss);
+
+    MetricsLine l;
+    metrics_line_begin(&l);
+    metrics_line_str(&l, "type", "test");
+    metrics_line_histogram(&l, "rtt_ms", &c.rtt, 0.001);
+    metrics_line_object_begin(&l, "loss");
+    metrics_line_u64(&l, "acked", c.acked);
+    metrics_line_u64(&l, "lost", c.lost);
+    metrics_line_object_end(&l);
+    metrics_line_end(&l);
+    ok &= !l.overflow;
+    printf("  %s", l.data);
+
+    printf("%s\n", ok ? "PASSED" : "FAILED");
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Server metrics.
+//
+// Every counter has a single writer, so nothing locks or does atomic
+// read-modify-writes. A connection's MetricsConn is written by whichever
+// thread has the connection at the time (the simulation thread, or the job
+// worker building its packet) and read between ticks. Counters bumped by
+// the receive and send threads go in a MetricsShard each and are summed
+// with relaxed loads when the metrics are dumped.
+//
+// Dumps are JSON lines, one for the server and one per connection, appended
+// to a file and/or sent to a local UDP port a datagram per line.
+
+#define METRICS_HISTOGRAM_BUCKETS 24 // powers of 2, the last takes the rest
+#define METRICS_SENT_PACKETS      64 // remembered per connection for acks, power of 2
+#define METRICS_PACKET_TYPES      16 // types counted per connection
+#define METRICS_LINE_MAX          4096
+
+// Bucket 0 holds 0, bucket b holds [2^(b-1), 2^b)
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+} MetricsHistogram;
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t bytes;
+} MetricsTraffic;
+
+typedef struct
+{
+    _Alignas(64) _Atomic uint64_t datagrams_in;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t invalid_in;
+    _Atomic uint64_t datagrams_out;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t failed_out;
+} MetricsShard;
+
+typedef struct
+{
+    // our packets waiting for an ack, by id % METRICS_SENT_PACKETS
+    uint16_t sent_id[METRICS_SENT_PACKETS];
+    bool sent_waiting[METRICS_SENT_PACKETS];
+    double sent_time[METRICS_SENT_PACKETS];
+
+    double srtt;     // seconds, smoothed
+    double jitter;   // seconds, mean rtt change (RFC 3550)
+    double last_rtt;
+    MetricsHistogram rtt; // microseconds
+
+    // since the last dump
+    uint32_t acked;
+    uint32_t lost; // pushed out of the ack window unacked
+    uint32_t received; // theirs
+    uint32_t missed;   // theirs skipped over by a newer packet id
+    MetricsTraffic in[METRICS_PACKET_TYPES];
+    MetricsTraffic out[METRICS_PACKET_TYPES];
+} MetricsConn;
+
+typedef struct
+{
+    char data[METRICS_LINE_MAX];
+    int len;
+    bool comma;    // a value came before at this level
+    bool overflow; // didn't fit, it won't be written
+} MetricsLine;
+
+typedef struct
+{
+    FILE* file;
+    int socket;
+    uint16_t port; // 0 if not sending
+} MetricsSink;
+
+static inline void metrics_add(_Atomic uint64_t* counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline uint64_t metrics_load(_Atomic uint64_t* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+void metrics_histogram_add(MetricsHistogram* h, uint64_t value);
+void metrics_histogram_merge(MetricsHistogram* into, const MetricsHistogram* h);
+// Upper bound of the bucket holding the p quantile (0-1), clamped to the max
+uint64_t metrics_histogram_quantile(const MetricsHistogram* h, double p);
+
+void metrics_conn_reset(MetricsConn* c);
+void metrics_conn_sent(MetricsConn* c, uint16_t packet_id, double now);
+void metrics_conn_ack(MetricsConn* c, uint16_t ack, uint32_t ack_bits, double now);
+// A packet of theirs, newer than any before it, arrived after latest
+void metrics_conn_received(MetricsConn* c, uint16_t packet_id, uint16_t latest);
+// Clears the counters kept since the last dump
+void metrics_conn_period_reset(MetricsConn* c);
+
+static inline void metrics_traffic_add(MetricsTraffic* t, int type, int bytes)
+{
+    if(type >= 0 && type < METRICS_PACKET_TYPES)
+    {
+        t[type].count++;
+        t[type].bytes += bytes;
+    }
+}
+
+static inline void metrics_traffic_merge(MetricsTraffic* into, const MetricsTraffic* t)
+{
+    for(int i = 0; i < METRICS_PACKET_TYPES; ++i)
+    {
+        into[i].count += t[i].count;
+        into[i].bytes += t[i].bytes;
+    }
+}
+
+void metrics_line_begin(MetricsLine* l);
+void metrics_line_end(MetricsLine* l);
+void metrics_line_object_begin(MetricsLine* l, const char* key);
+void metrics_line_object_end(MetricsLine* l);
+void metrics_line_u64(MetricsLine* l, const char* key, uint64_t value);
+void metrics_line_f64(MetricsLine* l, const char* key, double value);
+void metrics_line_str(MetricsLine* l, const char* key, const char* value);
+// count, mean, p50, p99 and max, each multiplied by scale
+void metrics_line_histogram(MetricsLine* l, const char* key, const MetricsHistogram* h, double scale);
+
+// path NULL or port 0 turns that output off
+bool metrics_sink_set_file(MetricsSink* s, const char* path);
+bool metrics_sink_set_port(MetricsSink* s, uint16_t port);
+bool metrics_sink_active(MetricsSink* s);
+void metrics_sink_write(MetricsSink* s, MetricsLine* l);
+void metrics_sink_flush(MetricsSink* s);
+void metrics_sink_close(MetricsSink* s);
+
+void metrics_test();
@@ -1,21 +1,43 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <math.h>
 #include <errno.h>
+#include <pthread.h> // as jobs.c, winpthreads on Windows
 
 #if _WIN32
 #include <WinSock2.h>
+#define poll WSAPoll
 #else
-#include <sys/select.h>
+#include <poll.h>
+#include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#define HAS_EPOLL 1
+#else
+#define HAS_EPOLL 0
+#endif
+
+#include "common.h"
 #include "timer.h"
 #include "bitpack.h"
-#include "circbuf.h"
 #include "player.h"
+#include "snapshot.h"
+#include "channel.h"
+#include "interp.h"
+#include "spsc.h"
+#include "jobs.h"
+#include "lagcomp.h"
+#include "interest.h"
+#include "metrics.h"
+#include "schema.h"
 #include "net.h"
 
-#define REDUNDANT_INPUTS 1
 
 #define ADDR_FMT "%u.%u.%u.%u:%u"
 #define ADDR_LST(addr) (addr)->a,(addr)->b,(addr)->c,(addr)->d,(addr)->port
@@ -23,10 +45,14 @@
 #define ENABLE_SERVER_LOGGING 0
 #define SERVER_LOG_MODE 1  // (0=SIMPLE, 1=VERBOSE)
 
-#if SERVER_PRINT_MODE==1
+#if ENABLE_SERVER_LOGGING && SERVER_LOG_MODE==1
     #define LOGNV(format, ...) LOGN(format, ##__VA_ARGS__)
 #else
-    #define LOGNV(format, ...) 0
+    #define LOGNV(format, ...) ((void)0)
+#endif
+
+#if !HEADLESS
+void refresh_visible_room_gun_list(); // the game's, not in dedicated server builds
 #endif
 
 #define GAME_ID 0x308B4134
@@ -40,7 +66,116 @@
 #define DISCONNECTION_TIMEOUT 7.0f // seconds
 #define INPUT_QUEUE_MAX 16
 #define MAX_NET_EVENTS 255
-#define INPUTS_PER_PACKET 1
+#define INPUT_REDUNDANCY 8 // newest inputs resent in every input packet until the server has them
+#define PREDICTION_HISTORY 128      // inputs kept for replay, power of 2
+#define PREDICTION_TOLERANCE 0.01f  // meters off the server before rewinding
+#define INPUT_BUFFER_DEPTH 3      // buffered inputs per client before draining two a tick
+#define SERVER_MAX_CATCHUP_TICKS 4 // ticks run back to back after a stall, the rest are skipped
+#define SERVER_STATS_PERIOD 10.0   // seconds between tick stat logs
+#define METRICS_PERIOD 1.0         // seconds between metrics dumps, when there's somewhere to write them
+#define SALT_SIZE 8             // raw salt prefixing client payloads
+#define CONNECT_PACKET_SIZE 1024 // connect request and challenge response are padded out to this
+#define CONNECT_COOKIE_PERIOD 10.0 // seconds per challenge time bucket, the previous one is accepted too
+#define CHANNEL_BUDGET_BITS (8*256) // reliable message bytes per packet
+#define NET_MTU 1200                 // datagram payload size frames are kept under
+#define BUNDLE_ENTRY_HEADER_SIZE 3   // u8 type, u16 len
+#define SEND_ARENA_SIZE (512*1024)   // datagrams built per send batch
+#define SEND_BATCH_SLOTS 256         // datagrams per send batch, sent SOCKET_SEND_BATCH_MAX at a time
+#define SEND_BATCH_POOL 4            // batches being filled or sent, power of 2
+#define ENCODE_GRAIN 4               // clients per state encode job
+#define STATE_BUDGET_BYTES 900       // snapshot bytes per state packet, what's left of NET_MTU after messages
+#define INTEREST_MAX_STALE 16        // snapshots a player may go without an update before it's dropped
+#define INTEREST_SEND_PRIORITY 256   // priority a player the client has needs before it's resent
+
+#define RECV_QUEUE_SIZE 1024         // datagrams waiting for the next tick, power of 2
+#define RECV_WAIT 0.1                // seconds the receive thread waits on the socket before checking for stop, without eventfd
+
+// First byte of every reliable channel message
+typedef enum
+{
+    NET_MESSAGE_TEXT = 0, // to (16 bits), from (16 bits), text
+    NET_MESSAGE_SETTINGS,
+} NetMessageType;
+
+//
+// Payload schemas
+
+typedef struct
+{
+    char name[PLAYER_NAME_MAX+1];
+} ConnectRequestPayload;
+
+typedef struct
+{
+    uint8_t client_salt[8];
+    uint8_t server_salt[8];
+} ConnectChallengePayload;
+
+typedef struct
+{
+    uint8_t client_salt[8];
+    char name[PLAYER_NAME_MAX+1];
+} ConnectResponsePayload; // after the xor salts
+
+typedef struct
+{
+    uint32_t client_id;
+    uint32_t tick_rate; // Hz, inputs are one tick each
+} ConnectAcceptedPayload;
+
+typedef struct
+{
+    uint32_t reason;
+} ReasonPayload; // connect rejected, error
+
+typedef struct
+{
+    uint32_t seq; // of the first input
+    uint32_t count;
+} InputHeaderPayload;
+
+#define CONNECT_REQUEST_SCHEMA(U,F,B,S) \
+    S(name, PLAYER_NAME_MAX)
+
+#define CONNECT_CHALLENGE_SCHEMA(U,F,B,S) \
+    B(client_salt, 8) \
+    B(server_salt, 8)
+
+#define CONNECT_RESPONSE_SCHEMA(U,F,B,S) \
+    B(client_salt, 8) \
+    S(name, PLAYER_NAME_MAX)
+
+#define CONNECT_ACCEPTED_SCHEMA(U,F,B,S) \
+    U(client_id, 12) \
+    U(tick_rate, 8)
+
+#define REASON_SCHEMA(U,F,B,S) \
+    U(reason, 8)
+
+#define INPUT_HEADER_SCHEMA(U,F,B,S) \
+    U(seq, 16) \
+    U(count, 5)
+
+#define NET_PLAYER_INPUT_SCHEMA(U,F,B,S) \
+    U(keys, PLAYER_ACTION_MAX) \
+    F(angle_theta, -360.0f, 360.0f, 16) \
+    F(angle_omega, -90.0f, 90.0f, 12)
+
+SCHEMA_DEFINE(ConnectRequestPayload,   connect_request,   CONNECT_REQUEST_SCHEMA)
+SCHEMA_DEFINE(ConnectChallengePayload, connect_challenge, CONNECT_CHALLENGE_SCHEMA)
+SCHEMA_DEFINE(ConnectResponsePayload,  connect_response,  CONNECT_RESPONSE_SCHEMA)
+SCHEMA_DEFINE(ConnectAcceptedPayload,  connect_accepted,  CONNECT_ACCEPTED_SCHEMA)
+SCHEMA_DEFINE(ReasonPayload,           reason,            REASON_SCHEMA)
+SCHEMA_DEFINE(InputHeaderPayload,      input_header,      INPUT_HEADER_SCHEMA)
+SCHEMA_DEFINE(NetPlayerInput,          net_player_input,  NET_PLAYER_INPUT_SCHEMA)
+
+_Static_assert(INPUT_QUEUE_MAX < (1 << 5), "input count doesn't fit its schema field");
+_Static_assert(INPUT_QUEUE_MAX <= 16, "input_mask is 16 bits");
+_Static_assert(INPUT_REDUNDANCY <= INPUT_QUEUE_MAX, "input packets hold at most INPUT_QUEUE_MAX inputs");
+_Static_assert(2 + CHANNEL_BUDGET_BITS/8 + STATE_BUDGET_BYTES < NET_MTU, "state budget leaves no room for the header and messages");
+_Static_assert(MAX_CLIENTS_LIMIT <= TO_ALL && MAX_CLIENTS_LIMIT <= FROM_SERVER, "message sentinels collide with client slots");
+
+SCHEMA_DEFINE_DELTA(NetPlayerInput, net_player_input, NET_PLAYER_INPUT_SCHEMA)
 
 typedef struct
 {
@@ -49,36 +184,230 @@ typedef struct
     uint16_t remote_latest_packet_id;
 } NodeInfo;
 
-// Info server stores about a client
-typedef struct
+#define CLIENT_SNAPSHOT_COUNT 32
+#define SNAPSHOT_RING_SIZE    CLIENT_SNAPSHOT_COUNT
+
+// Info server stores about a client, touched on every packet.
+// Kept to a cache line plus the input queue.
+typedef struct CACHE_ALIGNED
 {
-    int client_id;
     Address address;
     ConnectionState state;
+    int client_id;
+    uint16_t local_latest_packet_id;
     uint16_t remote_latest_packet_id;
+    uint32_t received_bits; // packets received before remote_latest_packet_id
+    uint16_t remote_ack;    // newest of our packets the client has seen
+    uint32_t remote_ack_bits;
     double  time_of_latest_packet;
+    uint8_t xor_salts[8];
+    uint16_t last_input_seq; // newest input simulated, echoed in state packets
+    uint16_t input_mask;     // buffered inputs, bit per seq % INPUT_QUEUE_MAX
+    uint16_t missed_mask;    // simulated without their input, same bits
+    NetPlayerInput net_player_inputs[INPUT_QUEUE_MAX]; // indexed by seq % INPUT_QUEUE_MAX
+} ClientInfo;
+
+// An entity as the client has it in a snapshot: sent then, or carried
+// over unchanged from the world snapshot it was last sent in
+typedef struct
+{
+    uint16_t index;
+    uint16_t source_id;
+} SentEntity;
+
+// A snapshot sent to a client, kept as a baseline to delta against.
+// Buffers are grown on demand and reused when the slot is recycled.
+typedef struct
+{
+    uint16_t id;
+    uint16_t packet_id; // packet it was sent in
+    bool valid;
+    uint8_t* data;      // SentEntity per entity, by index
+    uint32_t len;
+    uint32_t cap;
+} ClientSnapshot;
+
+// Messages queued for one client during a tick, flushed as a single
+// datagram. A lone message goes out as a plain packet of its own type,
+// otherwise as a PACKET_TYPE_BUNDLE of [type][len][payload] entries.
+// The state payload depends on the datagram's packet id, so it is only
+// built at flush time.
+typedef struct
+{
+    uint8_t data[NET_MTU];
+    int len;
+    int count;
+    uint8_t first_type;
+    bool want_state;
+    bool pending; // in server.pending_frames
+} OutFrame;
+
+typedef struct
+{
+    uint16_t index;
+    uint16_t priority; // 8.8 fixed point
+} InterestPriority;
+
+// Info server stores about a client that is only needed during the
+// handshake or when building state packets
+typedef struct
+{
     uint8_t client_salt[8];
     uint8_t server_salt[8];
-    uint8_t xor_salts[8];
     ConnectionRejectionReason last_reject_reason;
     PacketError last_packet_error;
-    Packet prior_state_pkt;
-    NetPlayerInput net_player_inputs[INPUT_QUEUE_MAX];
-    int input_count;
-} ClientInfo;
+    ClientSnapshot snapshots[CLIENT_SNAPSHOT_COUNT];
+    bool has_baseline;
+    uint16_t baseline_id; // newest snapshot the client has acked
+    Channel channel;      // reliable messages, piggybacked on state packets
+    OutFrame frame;       // messages waiting to go out this tick
+    SocketAddress sockaddr; // address converted once for batched sends
+    InterestPriority* priority; // accumulated for the players in range, by index
+    int priority_count;
+    int priority_cap;
+    MetricsConn metrics;  // rtt, loss and traffic, see server_dump_metrics()
+} ClientInfoCold;
+
+// A player in range of the client being encoded
+typedef struct
+{
+    uint16_t index;
+    uint16_t priority;
+    int16_t base;  // in the baseline view, -1 if the client doesn't have it
+    uint16_t cost; // extra bits to send it rather than carry it
+    bool stale;    // carried too long already
+    bool send;
+} ViewCandidate;
+
+// What a job worker needs to build a state packet
+typedef struct CACHE_ALIGNED
+{
+    BitPack bp;
+    Snapshot base_view; // baseline as the client being encoded has it
+    Snapshot view;      // what it gets this time, with interest management
+    SentEntity* sent;   // where each entity of the view came from
+
+    // interest management
+    uint16_t* candidates;
+    ViewCandidate* order;
+
+    // packets built this flush, back to back
+    uint8_t* out;
+    int out_used;
+    int out_cap;
+
+    Packet spill; // a state that didn't fit next to the frame's messages
+} EncodeScratch;
+
+typedef struct
+{
+    ClientInfo* cli;
+    int worker; // whose out arena the packet is in
+    int offset;
+    int count; // datagrams built, back to back from offset
+} FlushJob;
+
+typedef struct
+{
+    uint64_t key;
+    int index; // -1 if empty
+} ClientTableEntry;
 
 struct
 {
     Address address;
     NodeInfo info;
-    ClientInfo clients[MAX_CLIENTS];
+    ClientInfo* clients;
+    ClientInfoCold* clients_cold;
+    int max_clients;
+
+    // address+port -> client slot lookup (open addressing, linear probing)
+    ClientTableEntry* table;
+    int table_bits;
+
+    // stack of unused client slots
+    int* free_slots;
+    int free_count;
+
+    // slots with queued messages, flushed at the end of the tick
+    int* pending_frames;
+    int pending_count;
+
+    // recent world snapshots, indexed by id % SNAPSHOT_RING_SIZE
+    Snapshot snapshots[SNAPSHOT_RING_SIZE];
+    uint16_t snapshot_id;
+
+    // players bucketed by position for interest management
+    InterestGrid grid;
+    bool interest;
+
+    // one per job worker, state packets are encoded in parallel
+    EncodeScratch* encode_scratch;
+    int encode_scratch_count;
+    FlushJob* flush_jobs; // one per pending frame
+
     NetEvent events[MAX_NET_EVENTS];
     int event_count;
     BitPack bp;
     double start_time;
     int num_clients;
     uint8_t frame_no;
-} server = {0};
+    int epoll_fd;
+    int timer_fd;
+    int recv_fd; // eventfd, signalled by the receive thread when it queues packets
+
+    double tick_rate;
+    int num_workers; // state encode threads, including the simulation thread
+    uint32_t tick;
+    ServerTickStats stats;
+    _Atomic uint64_t states_oversized; // counted from the encode jobs
+    _Atomic bool stop; // see net_server_stop()
+
+    uint64_t cookie_key[2]; // keys the connect challenges, random per start
+
+    LagCompHistory lagcomp; // hitboxes per tick for rewinding shots
+    LagCompPose lag_pose;   // last rewind, reused by queries at the same time
+    uint32_t lag_pose_tick;
+    double lag_pose_time;
+} server = {.interest = true};
+
+typedef enum
+{
+    METRICS_SHARD_SIM, // simulation thread, and sends made straight from it
+    METRICS_SHARD_RECV,
+    METRICS_SHARD_SEND,
+    METRICS_SHARD_COUNT
+} MetricsShardId;
+
+// Server-wide metrics, see server_dump_metrics(). Traffic by packet type is
+// kept per connection and summed at the dump.
+static struct
+{
+    MetricsShard shards[METRICS_SHARD_COUNT];
+    MetricsSink sink;
+    double time_of_last_dump;
+    uint64_t last_bytes_in; // at the last dump
+    uint64_t last_bytes_out;
+
+    // since the last dump
+    MetricsHistogram tick_us;
+    MetricsHistogram recv_queue;     // datagrams waiting each tick
+    MetricsHistogram pending_frames; // frames built per flush
+    MetricsHistogram send_queue;     // batches waiting for the send thread
+    MetricsTraffic departed_in[METRICS_PACKET_TYPES]; // from connections removed since
+    MetricsTraffic departed_out[METRICS_PACKET_TYPES];
+} metrics;
+
+_Static_assert(PACKET_TYPE_MAX <= METRICS_PACKET_TYPES, "packet types don't fit the metrics");
+
+// A local input and the state predicted after applying it
+typedef struct
+{
+    uint16_t seq;
+    bool valid;
+    NetPlayerInput input;
+    WorldState state;
+} PredictionEntry;
 
 struct
 {
@@ -88,7 +417,6 @@ struct
     Address address;
     NodeInfo info;
     ConnectionState state;
-    NetPlayerInput net_player_inputs[INPUT_QUEUE_MAX];
     BitPack bp;
 
     double time_of_connection;
@@ -96,10 +424,9 @@ struct
     double time_of_last_ping;
     double time_of_last_received_ping;
 
-    Packet state_packets[2]; // for jitter compensation
-    int state_packet_count;
+    InterpBuffer interp; // remote players, rendered behind the newest snapshot
 
-    int input_count;
+    int input_count; // added since the last input packet
     uint8_t frame_no;
 
     double rtt;
@@ -115,8 +442,24 @@ struct
     uint8_t client_salt[8];
     uint8_t xor_salts[8];
 
+    uint32_t received_bits;
+    Channel channel;
+    Snapshot snapshots[SNAPSHOT_RING_SIZE]; // decoded, indexed by id % SNAPSHOT_RING_SIZE
+    uint16_t latest_snapshot_id;
+
+    // client-side prediction, indexed by seq % PREDICTION_HISTORY
+    uint16_t input_seq; // seq of the newest input
+    uint16_t server_input_seq; // newest input the server has simulated
+    PredictionEntry history[PREDICTION_HISTORY];
+    uint32_t corrections;
+
 } client = {0};
 
+static inline ClientInfoCold* client_cold(ClientInfo* cli)
+{
+    return &server.clients_cold[cli->client_id];
+}
+
 // ---
 
 #define IMAX_BITS(m) ((m)/((m)%255+1) / 255%255*8 + 7-86/((m)%255+12))
@@ -136,17 +479,99 @@ static uint64_t rand64(void)
 
 static Timer server_timer = {0};
 
+static void* calloc_aligned(size_t count, size_t size)
+{
+    size_t total = count*size;
+    total += (CACHE_LINE_SIZE - total % CACHE_LINE_SIZE) % CACHE_LINE_SIZE;
+#if _WIN32
+    void* p = _aligned_malloc(total, CACHE_LINE_SIZE);
+#else
+    void* p = aligned_alloc(CACHE_LINE_SIZE, total);
+#endif
+    if(p) memset(p, 0, total);
+    return p;
+}
+
+static void free_aligned(void* p)
+{
+#if _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+// Slots of the server's receive queue. The kernel writes each datagram
+// straight into one of these and it is decoded in place, so they are never
+// cleared; only the first len bytes are valid, and len is 0 if the datagram
+// was malformed.
+typedef struct
+{
+    CACHE_ALIGNED Packet pkt;
+    Address address;
+    int len;
+    double time; // received, for rtt
+} RecvPacket;
+
 static inline int get_packet_size(Packet* pkt)
 {
     return (sizeof(pkt->hdr) + pkt->data_len + sizeof(pkt->data_len));
 }
 
+// Copies a serialized payload into pkt at offset. Whole words are copied
+// since the pack stores bits in native word order.
+static bool payload_finish(BitPack* bp, Packet* pkt, int offset)
+{
+    bitpack_flush(bp);
+
+    int len = bp->words_written*4;
+    if(bp->overflow != BITPACK_OK || offset + len > MAX_PACKET_DATA_SIZE)
+        return false;
+
+    memcpy(pkt->data + offset, bp->data, len);
+    pkt->data_len = offset + len;
+    return true;
+}
+
+// Reads a payload in place from a received packet
+static inline void payload_attach(BitPack* bp, Packet* pkt, int offset)
+{
+    int len = (int)pkt->data_len - offset;
+    bitpack_attach(bp, pkt->data + offset, len > 0 ? len : 0);
+}
+
 static inline bool is_packet_id_greater(uint16_t id, uint16_t cmp)
 {
     return ((id >= cmp) && (id - cmp <= 32768)) ||
            ((id <= cmp) && (cmp - id  > 32768));
 }
 
+// Records that packet id arrived, given the newest id seen so far and the
+// bitfield of the 32 ids before it. Returns false if id is older than latest.
+static bool track_received_packet(uint16_t id, uint16_t* latest, uint32_t* bits)
+{
+    if(!is_packet_id_greater(id, *latest))
+        return false;
+
+    uint16_t shift = id - *latest;
+    if(shift == 0)
+        return true;
+
+    *bits = (shift >= 32) ? 0 : (*bits << shift);
+    if(shift <= 32)
+        *bits |= (uint32_t)1 << (shift - 1);
+    *latest = id;
+    return true;
+}
+
+static inline bool is_packet_acked(uint16_t id, uint16_t ack, uint32_t ack_bits)
+{
+    uint16_t diff = ack - id;
+    if(diff == 0)
+        return true;
+    return diff <= 32 && (ack_bits & ((uint32_t)1 << (diff - 1)));
+}
+
 static char* packet_type_to_str(PacketType type)
 {
     switch(type)
@@ -164,17 +589,7 @@ static char* packet_type_to_str(PacketType type)
         case PACKET_TYPE_STATE: return "STATE";
         case PACKET_TYPE_MESSAGE: return "MESSAGE";
         case PACKET_TYPE_ERROR: return "ERROR";
-        default: return "UNKNOWN";
-    }
-}
-
-static char* connect_reject_reason_to_str(ConnectionRejectionReason reason)
-{
-    switch(reason)
-    {
-        case CONNECT_REJECT_REASON_SERVER_FULL: return "SERVER FULL";
-        case CONNECT_REJECT_REASON_INVALID_PACKET: return "INVALID PACKET FORMAT";
-        case CONNECT_REJECT_REASON_FAILED_CHALLENGE: return "FAILED CHALLENGE";
+        case PACKET_TYPE_BUNDLE: return "BUNDLE";
         default: return "UNKNOWN";
     }
 }
@@ -195,32 +610,12 @@ static void store_xor_salts(uint8_t* cli_salt, uint8_t* svr_salt, uint8_t* xor_s
     }
 }
 
-static bool is_local_address(Address* addr)
-{
-    return (addr->a == 127 && addr->b == 0 && addr->c == 0 && addr->d == 1);
-}
-
-static bool is_empty_address(Address* addr)
-{
-    return (addr->a == 0 && addr->b == 0 && addr->c == 0 && addr->d == 0);
-}
-
 static void print_address(Address* addr)
 {
     LOGN("[ADDR] " ADDR_FMT, ADDR_LST(addr));
 }
 
-static bool compare_address(Address* addr1, Address* addr2, bool incl_port)
-{
-    if(incl_port)
-    {
-        return (memcmp(addr1, addr2, sizeof(Address)) == 0);
-    }
-
-    return (addr1->a == addr2->a && addr1->b == addr2->b && addr1->c == addr2->c && addr1->d == addr2->d);
-}
-
-
+#if ENABLE_SERVER_LOGGING
 static void print_packet(Packet* pkt, bool full)
 {
     LOGN("Game ID:      0x%08x",pkt->hdr.game_id);
@@ -262,31 +657,27 @@ static void print_packet_simple(Packet* pkt, const char* hdr)
 {
     LOGN("[%s][ID: %u] %s (%u B)",hdr, pkt->hdr.id, packet_type_to_str(pkt->hdr.type), pkt->data_len);
 }
+#endif
 
-static bool has_data_waiting(int socket)
+// Blocks until data is waiting on the socket, wake_fd is readable or timeout
+// (seconds) elapses. wake_fd is -1 for none, a negative timeout waits for
+// either. poll() rather than select(), which can't take fds past FD_SETSIZE.
+static bool wait_for_data(int socket, int wake_fd, double timeout)
 {
+    struct pollfd fds[2] = {
+        {.fd = socket, .events = POLLIN},
+        {.fd = wake_fd, .events = POLLIN},
+    };
 
-    fd_set readfds;
-
-    //clear the socket set
-    FD_ZERO(&readfds);
-
-    //add client socket to set
-    FD_SET(socket, &readfds);
-
-    int activity;
-
-    struct timeval tv = {0};
-    activity = select(socket + 1 , &readfds , NULL , NULL , &tv);
+    int activity = poll(fds, wake_fd >= 0 ? 2 : 1, timeout < 0.0 ? -1 : (int)(timeout*1000.0));
 
     if ((activity < 0) && (errno!=EINTR))
     {
-        perror("select error");
+        perror("poll error");
         return false;
     }
 
-    bool has_data = FD_ISSET(socket , &readfds);
-    return has_data;
+    return activity > 0 && (fds[0].revents & POLLIN);
 }
 
 static int net_send(NodeInfo* node_info, Address* to, Packet* pkt, int count)
@@ -316,10 +707,19 @@ static int net_send(NodeInfo* node_info, Address* to, Packet* pkt, int count)
 
     node_info->local_latest_packet_id++;
 
+    if(node_info == &server.info)
+    {
+        MetricsShard* shard = &metrics.shards[METRICS_SHARD_SIM];
+        metrics_add(&shard->datagrams_out, count);
+        metrics_add(&shard->bytes_out, sent_bytes);
+        if(sent_bytes < count*pkt_len)
+            metrics_add(&shard->failed_out, 1);
+    }
+
     if(node_info == &client.info)
     {
         client.bytes_sent += sent_bytes;
-        if(sent_bytes > client.largest_packet_size_sent)
+        if((uint32_t)sent_bytes > client.largest_packet_size_sent)
         {
             client.largest_packet_size_sent = sent_bytes;
         }
@@ -328,487 +728,2632 @@ static int net_send(NodeInfo* node_info, Address* to, Packet* pkt, int count)
     return sent_bytes;
 }
 
-static int net_recv(NodeInfo* node_info, Address* from, Packet* pkt)
+// Drains up to max_count pending packets into the caller's slots without blocking
+static int net_recv_batch(NodeInfo* node_info, SocketRecvSlot* slots, int max_count)
 {
-    int recv_bytes = socket_recvfrom(node_info->socket, from, (uint8_t*)pkt);
+    int count = socket_recvfrom_batch(node_info->socket, slots, max_count);
 
 #if ENABLE_SERVER_LOGGING
+    for(int i = 0; i < count; ++i)
+    {
+        Packet* pkt = (Packet*)slots[i].data;
 #if SERVER_LOG_MODE==0
-    print_packet_simple(pkt,"RECV");
+        print_packet_simple(pkt,"RECV");
 #else
-    LOGN("[RECV] Packet %d (%u B)",pkt->hdr.id,recv_bytes);
-    print_address(from);
-    print_packet(pkt, false);
+        LOGN("[RECV] Packet %d (%u B)",pkt->hdr.id,slots[i].len);
+        print_address(&slots[i].address);
+        print_packet(pkt, false);
 #endif
-#endif
-
-    if(node_info == &client.info)
-    {
-        client.bytes_received += recv_bytes;
-        if(recv_bytes > client.largest_packet_size_recv)
-        {
-            client.largest_packet_size_recv = recv_bytes;
-        }
     }
+#endif
 
-    return recv_bytes;
+    return count;
 }
 
-static bool validate_packet_format(Packet* pkt)
+static bool validate_packet_format(Packet* pkt, int len)
 {
+    // buffers aren't cleared between packets, so never trust data_len beyond what was received
+    if(len < (int)PACKET_HEADER_SIZE || pkt->data_len > (uint32_t)(len - PACKET_HEADER_SIZE))
+    {
+        LOGNV("Packet size doesn't match received bytes (%d B)", len);
+        return false;
+    }
+
     if(pkt->hdr.game_id != GAME_ID)
     {
-        LOGN("Game ID of packet doesn't match, %08X != %08X",pkt->hdr.game_id, GAME_ID);
+        LOGNV("Game ID of packet doesn't match, %08X != %08X",pkt->hdr.game_id, GAME_ID);
         return false;
     }
 
-    if(pkt->hdr.type < 0 || pkt->hdr.type >= PACKET_TYPE_MAX)
+    if(pkt->hdr.type >= PACKET_TYPE_MAX)
     {
-        LOGN("Invalid Packet Type: %d", pkt->hdr.type);
+        LOGNV("Invalid Packet Type: %d", pkt->hdr.type);
         return false;
     }
 
     return true;
 }
 
+// Connect packets are checked statelessly, see connect_cookie_check()
 static bool authenticate_client(Packet* pkt, ClientInfo* cli)
 {
-    bool valid = true;
+    return memcmp(&pkt->data[0], cli->xor_salts, 8) == 0;
+}
+
+static inline uint64_t address_key(Address* addr)
+{
+    return ((uint64_t)addr->a << 40) | ((uint64_t)addr->b << 32) |
+           ((uint64_t)addr->c << 24) | ((uint64_t)addr->d << 16) | addr->port;
+}
+
+//
+// Connect challenges
+//
+// The server salt sent in a challenge is a keyed hash of the requester's
+// address, its salt and the current time bucket, so nothing is stored until
+// a response comes back whose xor salts match the hash. A response is good
+// for one to two CONNECT_COOKIE_PERIODs after the challenge.
+
+#define SIPROUND \
+    v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+    v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+    v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+    v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32)
+
+// SipHash-2-4 (Aumasson and Bernstein, 2012) of count 64-bit words
+static uint64_t siphash24(const uint64_t key[2], const uint64_t* in, int count)
+{
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
 
-    switch(pkt->hdr.type)
+    for(int i = 0; i < count; ++i)
     {
-        case PACKET_TYPE_CONNECT_REQUEST:
-            valid &= (pkt->data_len == 1024); // must be padded out to 1024
-            valid &= (memcmp(&pkt->data[0],cli->client_salt, 8) == 0);
-            break;
-        case PACKET_TYPE_CONNECT_CHALLENGE_RESP:
-            valid &= (pkt->data_len == 1024); // must be padded out to 1024
-            valid &= (memcmp(&pkt->data[0],cli->xor_salts, 8) == 0);
-           break;
-        default:
-            valid &= (memcmp(&pkt->data[0],cli->xor_salts, 8) == 0);
-            break;
+        v3 ^= in[i];
+        SIPROUND; SIPROUND;
+        v0 ^= in[i];
     }
 
-    return valid;
+    uint64_t last = (uint64_t)(count*8) << 56;
+    v3 ^= last;
+    SIPROUND; SIPROUND;
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
-static int server_get_client(Address* addr, ClientInfo** cli)
+#undef SIPROUND
+
+static void connect_cookie_init_key()
 {
-    for(int i = 0; i < MAX_CLIENTS; ++i)
-    {
-        bool addr_check = compare_address(&server.clients[i].address, addr, true);
-        bool conn = server.clients[i].state != DISCONNECTED;
+    FILE* f = fopen("/dev/urandom", "rb");
+    bool ok = f && fread(server.cookie_key, sizeof(server.cookie_key), 1, f) == 1;
+    if(f) fclose(f);
 
-        if(addr_check && conn)
-        {
-            *cli = &server.clients[i];
-            return i;
-        }
+    if(!ok)
+    {
+        LOGN("No /dev/urandom, connect challenges are keyed from rand()");
+        server.cookie_key[0] = rand64() ^ (uint64_t)(timer_get_time()*1000000.0);
+        server.cookie_key[1] = rand64();
     }
+}
 
-    return -1;
+static void connect_cookie(Address* addr, const uint8_t client_salt[8], uint64_t bucket, uint8_t server_salt[8])
+{
+    uint64_t in[3];
+    in[0] = address_key(addr);
+    memcpy(&in[1], client_salt, 8);
+    in[2] = bucket;
+
+    uint64_t h = siphash24(server.cookie_key, in, 3);
+    memcpy(server_salt, &h, 8);
 }
 
-// 0: unable to assign new client
-// 1: assigned new client
-// 2: assigned new client and assigned them to their previous spot
-static int server_assign_new_client(Address* addr, ClientInfo** cli, char* name)
+static inline uint64_t connect_cookie_bucket()
 {
-    LOGN("server_assign_new_client()");
-    print_address(addr);
+    return (uint64_t)(timer_get_time() / CONNECT_COOKIE_PERIOD);
+}
 
-    // new client
-    for(int i = 0; i < MAX_CLIENTS; ++i)
+// Finds the server salt the challenge answered by xor_salts was sent with
+static bool connect_cookie_check(Address* addr, const uint8_t client_salt[8], const uint8_t xor_salts[8], uint8_t server_salt[8])
+{
+    uint64_t bucket = connect_cookie_bucket();
+
+    for(int i = 0; i < 2 && bucket >= (uint64_t)i; ++i)
     {
-        if(server.clients[i].state == DISCONNECTED)
-        {
-            *cli = &server.clients[i];
-            (*cli)->client_id = i;
-            LOGN("Assigning new client: %d", (*cli)->client_id);
-            return 1;
-        }
+        uint8_t expect[8];
+        connect_cookie(addr, client_salt, bucket - i, server_salt);
+        store_xor_salts((uint8_t*)client_salt, server_salt, expect);
+        if(memcmp(expect, xor_salts, 8) == 0)
+            return true;
     }
 
-    LOGN("Server is full and can't accept new clients.");
-    return 0;
+    return false;
 }
 
-static void update_server_num_clients()
+static inline uint32_t client_table_hash(uint64_t key)
 {
-    int num_clients = 0;
-    for(int i = 0; i < MAX_CLIENTS; ++i)
-    {
-        if(server.clients[i].state != DISCONNECTED)
-        {
-            num_clients++;
-        }
-    }
-    server.num_clients = num_clients;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - server.table_bits));
+}
 
-    if(server.num_clients == 0)
+static int client_table_find(Address* addr)
+{
+    uint64_t key = address_key(addr);
+    uint32_t mask = (1u << server.table_bits) - 1;
+
+    for(uint32_t i = client_table_hash(key);; i = (i + 1) & mask)
     {
-        LOGN("Everyone left!");
+        ClientTableEntry* e = &server.table[i];
+        if(e->index == -1) return -1;
+        if(e->key == key) return e->index;
     }
 }
 
-static void remove_client(ClientInfo* cli)
+static void client_table_insert(Address* addr, int index)
 {
-    LOGN("Remove client: %d", cli->client_id);
-    cli->state = DISCONNECTED;
-    cli->remote_latest_packet_id = 0;
-    player_set_active(&players[cli->client_id],false);
-    memset(cli,0, sizeof(ClientInfo));
+    uint64_t key = address_key(addr);
+    uint32_t mask = (1u << server.table_bits) - 1;
 
-    update_server_num_clients();
+    uint32_t i = client_table_hash(key);
+    while(server.table[i].index != -1 && server.table[i].key != key)
+        i = (i + 1) & mask;
+
+    server.table[i].key = key;
+    server.table[i].index = index;
 }
 
-static void server_send(PacketType type, ClientInfo* cli)
+static void client_table_remove(Address* addr)
 {
-    Packet pkt = {
-        .hdr.game_id = GAME_ID,
-        .hdr.id = server.info.local_latest_packet_id,
-        .hdr.ack = cli->remote_latest_packet_id,
-        .hdr.frame_no = server.frame_no,
-        .hdr.type = type
-    };
+    uint64_t key = address_key(addr);
+    uint32_t mask = (1u << server.table_bits) - 1;
 
-    LOGNV("%s() : %s", __func__, packet_type_to_str(type));
+    uint32_t i = client_table_hash(key);
+    for(;; i = (i + 1) & mask)
+    {
+        if(server.table[i].index == -1) return;
+        if(server.table[i].key == key) break;
+    }
 
-    switch(type)
+    // backward-shift the rest of the probe run so lookups never need tombstones
+    uint32_t j = i;
+    for(;;)
     {
-        case PACKET_TYPE_INIT:
-        {
-        } break;
+        server.table[i].index = -1;
 
-        case PACKET_TYPE_CONNECT_CHALLENGE:
+        for(;;)
         {
-            uint64_t salt = rand64();
-            memcpy(cli->server_salt, (uint8_t*)&salt,8);
+            j = (j + 1) & mask;
+            if(server.table[j].index == -1) return;
 
-            // store xor salts
-            store_xor_salts(cli->client_salt, cli->server_salt, cli->xor_salts);
-            print_salt(cli->xor_salts);
+            uint32_t home = client_table_hash(server.table[j].key);
 
-            pack_bytes(&pkt, cli->client_salt, 8);
-            pack_bytes(&pkt, cli->server_salt, 8);
+            // entry at j can fill the hole at i unless its home lies cyclically in (i, j]
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if(!stays) break;
+        }
 
-            net_send(&server.info,&cli->address,&pkt, 1);
-        } break;
+        server.table[i] = server.table[j];
+        i = j;
+    }
+}
 
-        case PACKET_TYPE_CONNECT_ACCEPTED:
+static bool server_clients_create(int max_clients)
+{
+    server.max_clients = max_clients;
+
+    server.table_bits = 1;
+    while((1 << server.table_bits) < 2*max_clients) // keep load factor <= 0.5
+        server.table_bits++;
+
+    int table_size = 1 << server.table_bits;
+
+    server.clients = calloc_aligned(max_clients, sizeof(ClientInfo));
+    server.clients_cold = calloc(max_clients, sizeof(ClientInfoCold));
+    server.free_slots = malloc(max_clients*sizeof(int));
+    server.pending_frames = malloc(max_clients*sizeof(int));
+    server.table = malloc(table_size*sizeof(ClientTableEntry));
+    players = calloc(max_clients, sizeof(Player));
+    server.encode_scratch_count = jobs_worker_count();
+    server.encode_scratch = calloc(server.encode_scratch_count, sizeof(EncodeScratch));
+    server.flush_jobs = malloc(max_clients*sizeof(FlushJob));
+
+    // set from the terrain before this, see net_server_start()
+    float bounds_min[3], bounds_max[3];
+    snapshot_get_bounds(bounds_min, bounds_max);
+
+    if(!server.clients || !server.clients_cold || !server.free_slots || !server.pending_frames || !server.table || !players || !server.encode_scratch || !server.flush_jobs
+       || !interest_grid_init(&server.grid, bounds_min, bounds_max, INTEREST_CELL_SIZE, max_clients))
+    {
+        LOGN("Failed to allocate %d client slots", max_clients);
+        return false;
+    }
+
+    for(int i = 0; i < server.encode_scratch_count; ++i)
+    {
+        EncodeScratch* es = &server.encode_scratch[i];
+        es->sent = malloc(max_clients*sizeof(SentEntity));
+        es->candidates = malloc(max_clients*sizeof(uint16_t));
+        es->order = malloc(max_clients*sizeof(*es->order));
+        bitpack_create(&es->bp, BITPACK_SIZE);
+        if(!es->sent || !es->candidates || !es->order || !es->bp.data || !snapshot_reserve(&es->view, max_clients))
         {
-            cli->state = CONNECTED;
-            pack_u8(&pkt, (uint8_t)cli->client_id);
-            net_send(&server.info,&cli->address,&pkt, 1);
+            LOGN("Failed to allocate encode scratch");
+            return false;
+        }
+    }
 
-            refresh_visible_room_gun_list();
-            server_send_message(TO_ALL, FROM_SERVER, "client added %u", cli->client_id);
-        } break;
+    for(int i = 0; i < table_size; ++i)
+        server.table[i].index = -1;
 
-        case PACKET_TYPE_CONNECT_REJECTED:
-        {
-            pack_u8(&pkt, (uint8_t)cli->last_reject_reason);
-            net_send(&server.info,&cli->address,&pkt, 1);
-        } break;
+    // lowest slots get handed out first
+    server.free_count = max_clients;
+    for(int i = 0; i < max_clients; ++i)
+        server.free_slots[i] = max_clients - 1 - i;
 
-        case PACKET_TYPE_PING:
-            pkt.data_len = 0;
-            net_send(&server.info,&cli->address,&pkt, 1);
-            break;
+    server.pending_count = 0;
+
+    server.num_clients = 0;
+    return true;
+}
+
+static void server_clients_destroy()
+{
+    for(int i = 0; i < server.max_clients; ++i)
+    {
+        for(int j = 0; j < CLIENT_SNAPSHOT_COUNT; ++j)
+            free(server.clients_cold[i].snapshots[j].data);
+        free(server.clients_cold[i].priority);
+    }
+
+    free_aligned(server.clients); server.clients = NULL;
+    free(server.clients_cold); server.clients_cold = NULL;
+    free(server.free_slots); server.free_slots = NULL;
+    free(server.pending_frames); server.pending_frames = NULL;
+    free(server.table); server.table = NULL;
+    free(players); players = NULL;
+
+    for(int i = 0; i < server.encode_scratch_count; ++i)
+    {
+        EncodeScratch* es = &server.encode_scratch[i];
+        free(es->sent);
+        free(es->candidates);
+        free(es->order);
+        bitpack_delete(&es->bp);
+        snapshot_free(&es->base_view);
+        snapshot_free(&es->view);
+        free(es->out);
+    }
+    free(server.encode_scratch); server.encode_scratch = NULL;
+    free(server.flush_jobs); server.flush_jobs = NULL;
+    interest_grid_free(&server.grid);
+    server.encode_scratch_count = 0;
+
+    for(int i = 0; i < SNAPSHOT_RING_SIZE; ++i)
+        snapshot_free(&server.snapshots[i]);
+    server.max_clients = 0;
+    server.free_count = 0;
+}
+
+static bool client_snapshot_store(ClientInfo* cli, uint16_t id, void* data, uint32_t len)
+{
+    ClientSnapshot* snap = &client_cold(cli)->snapshots[id % CLIENT_SNAPSHOT_COUNT];
+
+    if(len > snap->cap)
+    {
+        uint32_t cap = snap->cap > 0 ? snap->cap : 64;
+        while(cap < len) cap *= 2;
+
+        uint8_t* p = realloc(snap->data, cap);
+        if(!p)
+        {
+            snap->valid = false;
+            return false;
+        }
+
+        snap->data = p;
+        snap->cap = cap;
+    }
+
+    memcpy(snap->data, data, len);
+    snap->len = len;
+    snap->id = id;
+    snap->valid = true;
+    return true;
+}
+
+static ClientSnapshot* client_snapshot_get(ClientInfo* cli, uint16_t id)
+{
+    ClientSnapshot* snap = &client_cold(cli)->snapshots[id % CLIENT_SNAPSHOT_COUNT];
+    if(!snap->valid || snap->id != id)
+        return NULL;
+    return snap;
+}
+
+static ClientInfo* server_alloc_client(Address* addr)
+{
+    if(server.free_count == 0)
+        return NULL;
+
+    int i = server.free_slots[--server.free_count];
+
+    ClientInfo* cli = &server.clients[i];
+    cli->client_id = i;
+    cli->local_latest_packet_id = 1; // so a client that hasn't received anything yet (ack 0) acks nothing
+    memcpy(&cli->address, addr, sizeof(Address));
+    client_table_insert(addr, i);
+    channel_reset(&server.clients_cold[i].channel);
+    socket_address_convert(addr, &server.clients_cold[i].sockaddr);
+    server.clients_cold[i].priority_count = 0;
+    metrics_conn_reset(&server.clients_cold[i].metrics);
+
+    return cli;
+}
+
+static int server_get_client(Address* addr, ClientInfo** cli)
+{
+    int i = client_table_find(addr);
+    if(i == -1)
+        return -1;
+
+    *cli = &server.clients[i];
+    return i;
+}
+
+// 0: unable to assign new client
+// 1: assigned new client
+// 2: assigned new client and assigned them to their previous spot
+static int server_assign_new_client(Address* addr, ClientInfo** cli, char* name)
+{
+    LOGN("server_assign_new_client()");
+    print_address(addr);
+
+    // a resent challenge response
+    int i = client_table_find(addr);
+    if(i != -1)
+    {
+        *cli = &server.clients[i];
+        LOGN("Reassigning client: %d", (*cli)->client_id);
+        return 2;
+    }
+
+    // new client
+    *cli = server_alloc_client(addr);
+    if(*cli == NULL)
+    {
+        LOGN("Server is full and can't accept new clients.");
+        return 0;
+    }
+
+    LOGN("Assigning new client: %d (%s)", (*cli)->client_id, name);
+    return 1;
+}
+
+static void update_server_num_clients()
+{
+    server.num_clients = server.max_clients - server.free_count;
+
+    if(server.num_clients == 0)
+    {
+        LOGN("Everyone left!");
+    }
+}
+
+static void remove_client(ClientInfo* cli)
+{
+    int i = (int)(cli - server.clients);
+
+    LOGN("Remove client: %d", i);
+    client_table_remove(&cli->address);
+    server.free_slots[server.free_count++] = i;
+
+    player_set_active(&players[i],false);
+    memset(cli,0, sizeof(ClientInfo));
+
+    ClientInfoCold* cold = &server.clients_cold[i];
+    metrics_traffic_merge(metrics.departed_in, cold->metrics.in);
+    metrics_traffic_merge(metrics.departed_out, cold->metrics.out);
+    memset(cold->client_salt, 0, 8);
+    memset(cold->server_salt, 0, 8);
+    cold->last_reject_reason = 0;
+    cold->last_packet_error = PACKET_ERROR_NONE;
+    cold->has_baseline = false;
+    for(int j = 0; j < CLIENT_SNAPSHOT_COUNT; ++j)
+        cold->snapshots[j].valid = false;
+
+    // drop anything queued; the slot may still be on the pending list
+    cold->frame.len = 0;
+    cold->frame.count = 0;
+    cold->frame.want_state = false;
+
+    update_server_num_clients();
+}
+
+static void player_get_net_state(Player* p, NetPlayerState* state)
+{
+    *state = (NetPlayerState){
+        .pos = {p->pos.x, p->pos.y, p->pos.z},
+        .vel = {p->vel.x, p->vel.y, p->vel.z},
+        .angle_theta = p->angle_theta,
+        .angle_omega = p->angle_omega
+    };
+}
+
+static void player_to_net_state(Player* p, QuantizedPlayerState* q)
+{
+    NetPlayerState state;
+    player_get_net_state(p, &state);
+    player_state_quantize(&state, q);
+}
+
+// Records the state of every connected player as the next world snapshot
+static void server_capture_snapshot()
+{
+    uint16_t id = ++server.snapshot_id;
+    Snapshot* snap = &server.snapshots[id % SNAPSHOT_RING_SIZE];
+
+    snap->valid = false;
+    if(!snapshot_reserve(snap, server.max_clients))
+        return;
+
+    snap->id = id;
+    snap->count = 0;
+
+    for(int i = 0; i < server.max_clients; ++i)
+    {
+        if(server.clients[i].state != CONNECTED)
+            continue;
+
+        SnapshotEntity* e = &snap->entities[snap->count++];
+        e->index = i;
+        player_to_net_state(&players[i], &e->state);
+    }
+
+    snap->valid = true;
+
+    if(server.interest)
+    {
+        interest_grid_begin(&server.grid);
+        for(int i = 0; i < snap->count; ++i)
+        {
+            Player* p = &players[snap->entities[i].index];
+            interest_grid_add(&server.grid, snap->entities[i].index, p->pos.x, p->pos.z);
+        }
+        interest_grid_end(&server.grid);
+    }
+}
+
+static Snapshot* server_get_snapshot(uint16_t id)
+{
+    Snapshot* snap = &server.snapshots[id % SNAPSHOT_RING_SIZE];
+    if(!snap->valid || snap->id != id)
+        return NULL;
+    return snap;
+}
+
+// Moves the client's baseline forward to the newest snapshot it has acked
+static void server_update_baseline(ClientInfo* cli)
+{
+    ClientInfoCold* cold = client_cold(cli);
+
+    for(int i = 0; i < CLIENT_SNAPSHOT_COUNT; ++i)
+    {
+        ClientSnapshot* cs = &cold->snapshots[i];
+        if(!cs->valid)
+            continue;
+
+        if(cold->has_baseline && !is_packet_id_greater(cs->id, cold->baseline_id))
+            continue;
+
+        if(is_packet_acked(cs->packet_id, cli->remote_ack, cli->remote_ack_bits))
+        {
+            cold->baseline_id = cs->id;
+            cold->has_baseline = true;
+        }
+    }
+}
+
+// Rebuilds a snapshot the client has from the world snapshots its
+// entities came from, false if any of those is gone
+static bool server_build_client_view(Snapshot* out, ClientSnapshot* cs)
+{
+    SentEntity* sent = (SentEntity*)cs->data;
+    int count = cs->len/sizeof(SentEntity);
+
+    if(!snapshot_reserve(out, count))
+        return false;
+
+    out->count = 0;
+    out->id = cs->id;
+    out->valid = true;
+
+    Snapshot* world = NULL;
+    for(int i = 0; i < count; ++i)
+    {
+        if(!world || world->id != sent[i].source_id)
+        {
+            world = server_get_snapshot(sent[i].source_id);
+            if(!world)
+                return false;
+        }
+
+        SnapshotEntity* e = snapshot_find(world, sent[i].index);
+        if(!e)
+            return false;
+        out->entities[out->count++] = *e;
+    }
+
+    return true;
+}
+
+static int cmp_view_priority(const void* a, const void* b)
+{
+    return (int)((const ViewCandidate*)b)->priority - (int)((const ViewCandidate*)a)->priority;
+}
+
+static int cmp_view_index(const void* a, const void* b)
+{
+    return (int)((const ViewCandidate*)a)->index - (int)((const ViewCandidate*)b)->index;
+}
+
+// Picks the players the client gets this time, from those in range or
+// from everyone without interest management. Everyone in range gains
+// priority by their interest weight each snapshot, so a player is due
+// again at a rate proportional to its weight. Within the byte budget the
+// highest due ones are sent and start over; the rest stay as the client
+// last had them, which costs a couple of bits each. Players new to the
+// client are due straight away, its own player always goes, and anyone
+// left stale too long is sent or dropped. Priorities are only kept for the
+// players in range, so they take memory by the crowd around the client
+// rather than by max_clients; one that leaves range starts over at 0.
+static void server_select_view(ClientInfo* cli, Snapshot* snap, Snapshot* baseline, SentEntity* base_sent, EncodeScratch* es)
+{
+    ClientInfoCold* cold = client_cold(cli);
+    Player* me = &players[cli->client_id];
+    float pos[3] = {me->pos.x, me->pos.y, me->pos.z};
+
+    // without interest management everyone is a candidate at full weight,
+    // which still keeps the state within the budget
+    int n = 0;
+    if(server.interest)
+    {
+        n = interest_grid_query(&server.grid, pos[0], pos[2], INTEREST_RADIUS, es->candidates, server.max_clients);
+    }
+    else
+    {
+        for(int i = 0; i < snap->count; ++i)
+            es->candidates[n++] = snap->entities[i].index;
+    }
+
+    if(n > cold->priority_cap)
+    {
+        int cap = MIN(MAX(n, 2*cold->priority_cap), server.max_clients);
+        InterestPriority* p = realloc(cold->priority, cap*sizeof(InterestPriority));
+        if(p)
+        {
+            cold->priority = p;
+            cold->priority_cap = cap;
+        }
+        else
+        {
+            n = cold->priority_cap; // the rest wait for memory
+        }
+    }
+
+    const int index_bits = 1 + SNAPSHOT_INDEX_BITS;
+    int budget = 8*STATE_BUDGET_BYTES;
+    int b = 0;
+    int p = 0;
+
+    for(int i = 0; i < n; ++i)
+    {
+        ViewCandidate* c = &es->order[i];
+        c->index = es->candidates[i];
+        c->send = false;
+        c->stale = false;
+        c->base = -1;
+
+        while(baseline && b < baseline->count && baseline->entities[b].index < c->index)
+            b++;
+        if(baseline && b < baseline->count && baseline->entities[b].index == c->index)
+            c->base = b;
+
+        SnapshotEntity* cur = snapshot_find(snap, c->index);
+        QuantizedPlayerState* base_state = c->base >= 0 ? &baseline->entities[c->base].state : NULL;
+
+        c->cost = snapshot_state_bits(&cur->state, base_state);
+        if(c->base >= 0)
+        {
+            budget -= index_bits + 1; // in the view either way
+            c->cost -= 1;
+        }
+        else
+        {
+            c->cost += index_bits;
+        }
+
+        if(c->base >= 0)
+            c->stale = (uint16_t)(snap->id - base_sent[c->base].source_id) >= INTEREST_MAX_STALE;
+
+        uint32_t priority;
+        if(c->index == cli->client_id || c->stale)
+        {
+            priority = UINT16_MAX;
+        }
+        else
+        {
+            // both sorted by index
+            while(p < cold->priority_count && cold->priority[p].index < c->index)
+                p++;
+            uint32_t accum = (p < cold->priority_count && cold->priority[p].index == c->index) ? cold->priority[p].priority : 0;
+
+            Player* pl = &players[c->index];
+            float w = server.interest ? interest_weight(pos, me->angle_theta, (float[3]){pl->pos.x, pl->pos.y, pl->pos.z}, INTEREST_RADIUS) : 1.0f;
+            priority = MIN(UINT16_MAX, accum + (uint32_t)(w*INTEREST_SEND_PRIORITY) + 1);
+        }
+        c->priority = (uint16_t)priority;
+    }
+
+    qsort(es->order, n, sizeof(ViewCandidate), cmp_view_priority);
+
+    for(int i = 0; i < n; ++i)
+    {
+        ViewCandidate* c = &es->order[i];
+        if(c->index != cli->client_id && (c->cost > budget || (c->base >= 0 && c->priority < INTEREST_SEND_PRIORITY)))
+            continue;
+
+        c->send = true;
+        budget -= c->cost;
+    }
+
+    qsort(es->order, n, sizeof(ViewCandidate), cmp_view_index);
+
+    for(int i = 0; i < n; ++i)
+    {
+        ViewCandidate* c = &es->order[i];
+        cold->priority[i] = (InterestPriority){c->index, c->send ? 0 : c->priority};
+    }
+    cold->priority_count = n;
+
+    Snapshot* view = &es->view;
+    view->id = snap->id;
+    view->valid = true;
+    view->count = 0;
+
+    for(int i = 0; i < n; ++i)
+    {
+        ViewCandidate* c = &es->order[i];
+
+        if(c->send)
+        {
+            view->entities[view->count] = *snapshot_find(snap, c->index);
+            es->sent[view->count++] = (SentEntity){c->index, snap->id};
+        }
+        else if(c->base >= 0 && !c->stale)
+        {
+            view->entities[view->count] = baseline->entities[c->base];
+            es->sent[view->count++] = base_sent[c->base];
+        }
+    }
+}
+
+// Encodes the latest world snapshot as a delta against the client's acked
+// baseline (or in full if it has none) and records what was sent. Only
+// touches cli's own state, so clients can be encoded in parallel given
+// separate scratch. Fails if the state alone is over NET_MTU, which
+// without interest management happens once there are enough players.
+static bool server_build_state_packet(ClientInfo* cli, Packet* pkt, int offset, EncodeScratch* es)
+{
+    Snapshot* snap = server_get_snapshot(server.snapshot_id);
+    if(!snap)
+        return false;
+
+    server_update_baseline(cli);
+
+    ClientInfoCold* cold = client_cold(cli);
+    Snapshot* baseline = NULL;
+    SentEntity* base_sent = NULL;
+
+    if(cold->has_baseline)
+    {
+        ClientSnapshot* cs = client_snapshot_get(cli, cold->baseline_id);
+
+        // only what this client actually has
+        if(cs && server_get_snapshot(cold->baseline_id) && server_build_client_view(&es->base_view, cs))
+        {
+            baseline = &es->base_view;
+            base_sent = (SentEntity*)cs->data;
+        }
+        else
+        {
+            cold->has_baseline = false; // too old, start over from a full snapshot
+        }
+    }
+
+    server_select_view(cli, snap, baseline, base_sent, es);
+    Snapshot* view = &es->view;
+
+    // reliable messages go first so the client can take them even if it
+    // can't decode the snapshot
+    bitpack_reset(&es->bp);
+    bitpack_write_fast(&es->bp, 16, cli->last_input_seq); // for client reconciliation
+    channel_write(&cold->channel, &es->bp, pkt->hdr.id, timer_get_time(), CHANNEL_BUDGET_BITS);
+    snapshot_write(&es->bp, view, baseline);
+    bitpack_flush(&es->bp);
+
+    int len = es->bp.words_written*4;
+    if(es->bp.overflow != BITPACK_OK || len > NET_MTU)
+    {
+        atomic_fetch_add_explicit(&server.states_oversized, 1, memory_order_relaxed);
+        LOGNV("Snapshot %u doesn't fit in a packet", snap->id);
+        return false;
+    }
+
+    memcpy(pkt->data + offset, es->bp.data, len);
+    pkt->data_len = offset + len;
+
+    client_snapshot_store(cli, snap->id, es->sent, view->count*sizeof(SentEntity));
+    client_cold(cli)->snapshots[snap->id % CLIENT_SNAPSHOT_COUNT].packet_id = pkt->hdr.id;
+
+    return true;
+}
+
+// Rewinds the local player to the server's state for the newest input it
+// has applied and replays the inputs it hasn't seen yet. Skipped when the
+// prediction for that input was already close enough.
+static void client_reconcile(uint16_t acked_seq, QuantizedPlayerState* q)
+{
+    NetPlayerState auth;
+    player_state_dequantize(q, &auth);
+
+    PredictionEntry* acked = &client.history[acked_seq % PREDICTION_HISTORY];
+    if(acked->valid && acked->seq == acked_seq)
+    {
+        float* a = acked->state.player.pos;
+        float dx = a[0] - auth.pos[0], dy = a[1] - auth.pos[1], dz = a[2] - auth.pos[2];
+        if(dx*dx + dy*dy + dz*dz <= PREDICTION_TOLERANCE*PREDICTION_TOLERANCE)
+            return;
+    }
+
+    client.corrections++;
+
+    // view angles are the client's own, only the physics state is taken
+    player.pos = (Vector3){auth.pos[0], auth.pos[1], auth.pos[2]};
+    player.vel = (Vector3){auth.vel[0], auth.vel[1], auth.vel[2]};
+
+    for(uint16_t seq = acked_seq + 1; seq != (uint16_t)(client.input_seq + 1); ++seq)
+    {
+        PredictionEntry* e = &client.history[seq % PREDICTION_HISTORY];
+        if(!e->valid || e->seq != seq)
+            continue;
+
+        player_apply_input(&player, &e->input);
+        player_get_net_state(&player, &e->state.player);
+    }
+}
+
+// Decodes a state packet against the baseline it names and stores the result
+static bool client_process_state_packet(Packet* pkt)
+{
+    bool is_latest = track_received_packet(pkt->hdr.id, &client.info.remote_latest_packet_id, &client.received_bits);
+    channel_process_ack(&client.channel, pkt->hdr.ack, pkt->hdr.ack_bitfield, timer_get_time());
+
+    // read in place, bounded by the datagram so a truncated one overflows
+    BitPack bp;
+    payload_attach(&bp, pkt, 0);
+
+    uint16_t acked_input_seq = (uint16_t)bitpack_read(&bp, 16);
+
+    if(!channel_read(&client.channel, &bp))
+        return false;
+
+    uint16_t id, baseline_id;
+    bool has_baseline;
+    snapshot_read_header(&bp, &id, &has_baseline, &baseline_id);
+    if(bp.overflow != BITPACK_OK)
+        return false;
+
+    Snapshot* baseline = NULL;
+    if(has_baseline)
+    {
+        baseline = &client.snapshots[baseline_id % SNAPSHOT_RING_SIZE];
+        if(!baseline->valid || baseline->id != baseline_id)
+        {
+            LOGN("Missing baseline %u for snapshot %u", baseline_id, id);
+            return false;
+        }
+    }
+
+    Snapshot* snap = &client.snapshots[id % SNAPSHOT_RING_SIZE];
+    if(snap == baseline)
+        return false;
+
+    snap->valid = false;
+    if(!snapshot_read(&bp, snap, baseline))
+        return false;
+
+    snap->id = id;
+
+    if(is_packet_id_greater(id, client.latest_snapshot_id))
+        client.latest_snapshot_id = id;
+
+    if(client.interp.tick_interval == 0.0)
+        interp_init(&client.interp, 1.0/TICK_RATE);
+    interp_push(&client.interp, snap, timer_get_time());
+
+    if(is_latest && acked_input_seq != 0)
+    {
+        client.server_input_seq = acked_input_seq;
+
+        for(int i = 0; i < snap->count; ++i)
+        {
+            if(snap->entities[i].index == client.id)
+            {
+                client_reconcile(acked_input_seq, &snap->entities[i].state);
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Call once per rendered frame before net_client_get_remote_player()
+void net_client_interpolate(double dt)
+{
+    interp_update(&client.interp, timer_get_time(), dt);
+}
+
+// Interpolated state of another player, false if it isn't in the buffer
+bool net_client_get_remote_player(int index, NetPlayerState* state)
+{
+    if(index == client.id)
+        return false; // predicted locally
+    return interp_sample(&client.interp, (uint16_t)index, state);
+}
+
+// Rounds an input to what the server will decode, so the prediction steps
+// with exactly the values the server does
+static void client_quantize_input(NetPlayerInput* input)
+{
+    uint32_t words[4];
+    BitPack bp;
+    bitpack_attach(&bp, words, sizeof(words));
+    bitpack_reset(&bp);
+
+    net_player_input_write(&bp, input);
+    bitpack_flush(&bp);
+    bitpack_seek_begin(&bp);
+    net_player_input_read(&bp, input);
+}
+
+// Queues an input to send and opens its prediction history entry. Call
+// once per tick: the server steps each input by exactly one tick, so the
+// input's delta_t is set to that. The input is quantised in place; apply it
+// to the local player afterwards and record the result with
+// net_client_record_player_state().
+bool net_client_add_player_input(NetPlayerInput* input)
+{
+    if(client.input_count >= INPUT_QUEUE_MAX)
+        return false;
+
+    input->delta_t = 1.0f/TICK_RATE;
+    client_quantize_input(input);
+
+    client.input_seq++;
+    client.input_count++;
+
+    PredictionEntry* e = &client.history[client.input_seq % PREDICTION_HISTORY];
+    e->seq = client.input_seq;
+    e->valid = true;
+    e->input = *input;
+    memset(&e->state, 0, sizeof(WorldState));
+    return true;
+}
+
+bool net_client_record_player_state(NetPlayerInput* input, WorldState* state)
+{
+    (void)input; // the entry already holds the quantised copy
+    PredictionEntry* e = &client.history[client.input_seq % PREDICTION_HISTORY];
+    if(!e->valid || e->seq != client.input_seq)
+        return false;
+
+    e->state = *state;
+    return true;
+}
+
+// Input packets carry every input added since the last one plus the ones
+// before it the server hasn't acked, up to INPUT_REDUNDANCY, so a lost
+// packet is repaired by the next one. Header, then the oldest input in
+// full and each later one as a delta against the one before:
+//   16 bits  seq of the first input
+//    5 bits  count
+static void client_write_inputs(BitPack* bp)
+{
+    int unacked = (uint16_t)(client.input_seq - client.server_input_seq);
+    int max_count = MIN(MAX(client.input_count, INPUT_REDUNDANCY), unacked);
+
+    // inputs come from the prediction history, back to the first gap in it
+    int count = 0;
+    while(count < max_count)
+    {
+        uint16_t seq = (uint16_t)(client.input_seq - count);
+        PredictionEntry* e = &client.history[seq % PREDICTION_HISTORY];
+        if(!e->valid || e->seq != seq)
+            break;
+        count++;
+    }
+
+    InputHeaderPayload hdr = {
+        .seq = (uint16_t)(client.input_seq - count + 1),
+        .count = count
+    };
+    input_header_write(bp, &hdr);
+
+    NetPlayerInput* prior = NULL;
+    for(int i = 0; i < count; ++i)
+    {
+        NetPlayerInput* input = &client.history[(uint16_t)(hdr.seq + i) % PREDICTION_HISTORY].input;
+        if(prior)
+            net_player_input_write_delta(bp, input, prior);
+        else
+            net_player_input_write(bp, input);
+        prior = input;
+    }
+
+    client.input_count = 0;
+}
+
+void net_client_send_inputs()
+{
+    if(client.input_count == 0 && !channel_has_pending(&client.channel, timer_get_time()))
+        return;
+
+    Packet pkt = {
+        .hdr.game_id = GAME_ID,
+        .hdr.id = client.info.local_latest_packet_id,
+        .hdr.ack = client.info.remote_latest_packet_id,
+        .hdr.ack_bitfield = client.received_bits,
+        .hdr.frame_no = client.frame_no,
+        .hdr.type = PACKET_TYPE_INPUT
+    };
+
+    if(!client.bp.data)
+        bitpack_create(&client.bp, BITPACK_SIZE);
+
+    bitpack_reset(&client.bp);
+    client_write_inputs(&client.bp);
+    channel_write(&client.channel, &client.bp, pkt.hdr.id, timer_get_time(), CHANNEL_BUDGET_BITS);
+
+    memcpy(pkt.data, client.xor_salts, SALT_SIZE);
+    if(!payload_finish(&client.bp, &pkt, SALT_SIZE))
+        return;
+
+    net_send(&client.info, &server.address, &pkt, 1);
+}
+
+static bool server_queue_message(ClientInfo* cli, uint8_t* data, int len)
+{
+    if(!channel_send(&client_cold(cli)->channel, data, len))
+    {
+        LOGN("Message queue full for client %d", cli->client_id);
+        return false;
+    }
+    return true;
+}
+
+// Queued on the reliable channel, delivered with the next state packets
+void server_send_message(uint16_t to, uint16_t from, char* fmt, ...)
+{
+    uint8_t msg[CHANNEL_MESSAGE_MAX];
+    msg[0] = NET_MESSAGE_TEXT;
+    msg[1] = to & 0xFF;
+    msg[2] = to >> 8;
+    msg[3] = from & 0xFF;
+    msg[4] = from >> 8;
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf((char*)&msg[5], sizeof(msg) - 5, fmt, args);
+    va_end(args);
+
+    if(n < 0) return;
+    int len = 5 + MIN(n, (int)sizeof(msg) - 6);
+
+    if(to == TO_ALL)
+    {
+        for(int i = 0; i < server.max_clients; ++i)
+        {
+            ClientInfo* cli = &server.clients[i];
+            if(cli->state == CONNECTED || cli->state == SENDING_CHALLENGE_RESPONSE)
+                server_queue_message(cli, msg, len);
+        }
+    }
+    else if(to < server.max_clients && server.clients[to].state != DISCONNECTED)
+    {
+        server_queue_message(&server.clients[to], msg, len);
+    }
+}
+
+// Handles reliable messages from a client, in the order they were sent
+static void server_process_messages(ClientInfo* cli)
+{
+    uint8_t msg[CHANNEL_MESSAGE_MAX+1];
+    int len;
+
+    while((len = channel_receive(&client_cold(cli)->channel, msg, CHANNEL_MESSAGE_MAX)) > 0)
+    {
+        switch(msg[0])
+        {
+            case NET_MESSAGE_TEXT:
+            {
+                if(len < 5) break;
+                msg[len] = '\0';
+                uint16_t to = msg[1] | (msg[2] << 8);
+                LOGN("[Client %d] %s", cli->client_id, (char*)&msg[5]);
+                server_send_message(to, cli->client_id, "%s", (char*)&msg[5]);
+            } break;
+
+            case NET_MESSAGE_SETTINGS:
+            {
+            } break;
+
+            default:
+                break;
+        }
+    }
+}
+
+// Rejections can go to peers that were never given a client slot
+static void server_send_rejected(Address* to, ConnectionRejectionReason reason)
+{
+    Packet pkt = {
+        .hdr.game_id = GAME_ID,
+        .hdr.id = server.info.local_latest_packet_id,
+        .hdr.frame_no = server.frame_no,
+        .hdr.type = PACKET_TYPE_CONNECT_REJECTED
+    };
+
+    ReasonPayload payload = {.reason = reason};
+    bitpack_reset(&server.bp);
+    reason_write(&server.bp, &payload);
+    payload_finish(&server.bp, &pkt, 0);
+
+    net_send(&server.info,to,&pkt, 1);
+}
+
+// Sent straight back without a client slot, see connect_cookie_check()
+static void server_send_challenge(Address* to, uint8_t* client_salt)
+{
+    Packet pkt = {
+        .hdr.game_id = GAME_ID,
+        .hdr.id = server.info.local_latest_packet_id,
+        .hdr.frame_no = server.frame_no,
+        .hdr.type = PACKET_TYPE_CONNECT_CHALLENGE
+    };
+
+    ConnectChallengePayload payload;
+    memcpy(payload.client_salt, client_salt, 8);
+    connect_cookie(to, client_salt, connect_cookie_bucket(), payload.server_salt);
+
+    bitpack_reset(&server.bp);
+    connect_challenge_write(&server.bp, &payload);
+    payload_finish(&server.bp, &pkt, 0);
+
+    net_send(&server.info,to,&pkt, 1);
+}
+
+// Datagrams built by frame flushes, packed back to back and handed to the
+// kernel in one batch
+typedef struct
+{
+    uint64_t arena[SEND_ARENA_SIZE/8];
+    int used;
+    SocketSendSlot slots[SEND_BATCH_SLOTS];
+    SocketAddress addresses[SEND_BATCH_SLOTS]; // copied, the client slot may be reused before the send
+    int count;
+} SendBatch;
+
+// Once the server is running, receiving and sending each get a thread so
+// neither waits on the simulation. The receive thread validates datagrams
+// into recv_queue for the simulation thread to process at the next tick.
+// Filled send batches go to the send thread through send_queue and come
+// back empty through free_queue. Either side sleeps on a condvar while its
+// queue is empty; lock is only for those.
+static struct
+{
+    SPSCQueue recv_queue;         // RecvPacket
+    _Atomic uint64_t recv_stalls; // times the queue was full
+    pthread_t recv_thread;
+    int stop_fd; // eventfd the receive thread waits on with the socket, -1 without
+
+    SendBatch batches[SEND_BATCH_POOL];
+    SPSCQueue send_queue; // SendBatch*
+    SPSCQueue free_queue; // SendBatch*
+    pthread_t send_thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t send_ready; // a batch is queued, or stopping
+    pthread_cond_t batch_free; // a batch came back
+
+    _Atomic bool running; // and the socket is bound
+    _Atomic bool stopping; // threads exit, the send thread once its queue is empty
+} pipeline = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .send_ready = PTHREAD_COND_INITIALIZER,
+    .batch_free = PTHREAD_COND_INITIALIZER,
+};
+
+// Wakes the other side after a push to its queue. Taking the lock means it's
+// either still to check the queue or already waiting.
+static void pipeline_signal(pthread_cond_t* cond)
+{
+    pthread_mutex_lock(&pipeline.lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+static SendBatch* send_batch = &pipeline.batches[0]; // being filled
+
+static void send_batch_send(SendBatch* batch)
+{
+    int sent = 0;
+    for(int i = 0; i < batch->count; i += SOCKET_SEND_BATCH_MAX)
+        sent += socket_sendto_batch(server.info.socket, &batch->slots[i], MIN(SOCKET_SEND_BATCH_MAX, batch->count - i));
+
+    if(sent < batch->count)
+        LOGN("Sent %d of %d packets", sent, batch->count);
+
+    uint64_t bytes = 0;
+    for(int i = 0; i < sent; ++i)
+        bytes += batch->slots[i].len;
+
+    // sent from the simulation thread until the send thread is running
+    MetricsShard* shard = &metrics.shards[pipeline.running ? METRICS_SHARD_SEND : METRICS_SHARD_SIM];
+    metrics_add(&shard->datagrams_out, sent);
+    metrics_add(&shard->bytes_out, bytes);
+    metrics_add(&shard->failed_out, batch->count - sent);
+
+#if ENABLE_SERVER_LOGGING
+    for(int i = 0; i < batch->count; ++i)
+    {
+        Packet* pkt = (Packet*)batch->slots[i].data;
+#if SERVER_LOG_MODE==0
+        print_packet_simple(pkt,"SEND");
+#elif SERVER_LOG_MODE==1
+        LOGN("[SENT] Packet %d (%u B)",pkt->hdr.id,batch->slots[i].len);
+        print_packet(pkt, false);
+#endif
+    }
+#endif
+
+    batch->count = 0;
+    batch->used = 0;
+}
+
+static void send_batch_submit()
+{
+    if(send_batch->count == 0)
+        return;
+
+    if(!pipeline.running)
+    {
+        send_batch_send(send_batch);
+        return;
+    }
+
+    spsc_push(&pipeline.send_queue, &send_batch);
+    pipeline_signal(&pipeline.send_ready);
+    metrics_histogram_add(&metrics.send_queue, spsc_count(&pipeline.send_queue));
+
+    // all batches in flight means the send thread is behind, wait for it
+    if(spsc_pop(&pipeline.free_queue, &send_batch))
+        return;
+
+    pthread_mutex_lock(&pipeline.lock);
+    while(!spsc_pop(&pipeline.free_queue, &send_batch))
+        pthread_cond_wait(&pipeline.batch_free, &pipeline.lock);
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+// Space for the next datagram, submitting the batch first if it is full
+static Packet* send_batch_alloc()
+{
+    if(send_batch->count == SEND_BATCH_SLOTS || send_batch->used + (int)sizeof(Packet) > SEND_ARENA_SIZE)
+        send_batch_submit();
+
+    return (Packet*)((uint8_t*)send_batch->arena + send_batch->used);
+}
+
+static void send_batch_push(Packet* pkt, SocketAddress* to)
+{
+    int len = get_packet_size(pkt);
+
+    int i = send_batch->count++;
+    send_batch->addresses[i] = *to;
+
+    SocketSendSlot* slot = &send_batch->slots[i];
+    slot->to = &send_batch->addresses[i];
+    slot->data = (uint8_t*)pkt;
+    slot->len = len;
+
+    send_batch->used += (len + 7) & ~7;
+}
+
+static inline void bundle_put_entry_header(uint8_t* p, uint8_t type, int len)
+{
+    p[0] = type;
+    p[1] = (uint8_t)(len & 0xFF);
+    p[2] = (uint8_t)(len >> 8);
+}
+
+// Iterates the entries of a PACKET_TYPE_BUNDLE, filling out with the
+// bundle's header and the entry's type and payload. offset starts at 0.
+static bool bundle_next(Packet* bundle, int* offset, Packet* out)
+{
+    if(*offset + BUNDLE_ENTRY_HEADER_SIZE > (int)bundle->data_len)
+        return false;
+
+    uint8_t* p = &bundle->data[*offset];
+    int len = p[1] | (p[2] << 8);
+    if(*offset + BUNDLE_ENTRY_HEADER_SIZE + len > (int)bundle->data_len)
+        return false;
+
+    out->hdr = bundle->hdr;
+    out->hdr.type = p[0];
+    out->data_len = len;
+    memcpy(out->data, p + BUNDLE_ENTRY_HEADER_SIZE, len);
+
+    *offset += BUNDLE_ENTRY_HEADER_SIZE + len;
+    return true;
+}
+
+// Takes a datagram from the server, len as received. State packets are
+// decoded whether they come alone or in a bundle; nothing else has a client
+// side yet.
+bool net_client_process_packet(Packet* pkt, int len)
+{
+    if(!validate_packet_format(pkt, len))
+        return false;
+
+    if(pkt->hdr.type == PACKET_TYPE_STATE)
+        return client_process_state_packet(pkt);
+
+    if(pkt->hdr.type != PACKET_TYPE_BUNDLE)
+        return false;
+
+    Packet entry;
+    int offset = 0;
+    bool ok = true;
+    while(bundle_next(pkt, &offset, &entry))
+    {
+        if(entry.hdr.type == PACKET_TYPE_STATE)
+            ok &= client_process_state_packet(&entry);
+    }
+    return ok;
+}
+
+// Counts a datagram to cli under each type it carries
+static void server_frame_metrics(ClientInfo* cli, Packet* pkt)
+{
+    MetricsConn* m = &client_cold(cli)->metrics;
+    metrics_conn_sent(m, pkt->hdr.id, timer_get_time());
+
+    if(pkt->hdr.type != PACKET_TYPE_BUNDLE)
+    {
+        metrics_traffic_add(m->out, pkt->hdr.type, get_packet_size(pkt));
+        return;
+    }
+
+    metrics_traffic_add(m->out, PACKET_TYPE_BUNDLE, PACKET_HEADER_SIZE);
+    for(int offset = 0; offset + BUNDLE_ENTRY_HEADER_SIZE <= (int)pkt->data_len;)
+    {
+        uint8_t* p = &pkt->data[offset];
+        int len = BUNDLE_ENTRY_HEADER_SIZE + (p[1] | (p[2] << 8));
+        metrics_traffic_add(m->out, p[0], len);
+        offset += len;
+    }
+}
+
+// A state built for packet_id that goes out as new_packet_id instead
+static void server_renumber_state(ClientInfo* cli, uint16_t packet_id, uint16_t new_packet_id)
+{
+    ClientInfoCold* cold = client_cold(cli);
+    channel_renumber_sent(&cold->channel, packet_id, new_packet_id);
+
+    ClientSnapshot* cs = &cold->snapshots[server.snapshot_id % CLIENT_SNAPSHOT_COUNT];
+    if(cs->packet_id == packet_id)
+        cs->packet_id = new_packet_id;
+}
+
+// Builds everything queued for cli into a datagram at pkt, each kept under
+// NET_MTU. Returns how many were built: 0 if there's nothing to send, 2 if
+// the state didn't fit next to the messages, in which case it follows them
+// alone in es->spill.
+static int server_build_frame(ClientInfo* cli, Packet* pkt, EncodeScratch* es)
+{
+    OutFrame* frame = &client_cold(cli)->frame;
+    if(frame->count == 0 && !frame->want_state)
+        return 0;
+
+    pkt->hdr = (PacketHeader){
+        .game_id = GAME_ID,
+        .id = cli->local_latest_packet_id,
+        .ack = cli->remote_latest_packet_id,
+        .ack_bitfield = cli->received_bits,
+        .frame_no = server.frame_no,
+    };
+
+    int count = 1;
+
+    if(frame->count == 0)
+    {
+        pkt->hdr.type = PACKET_TYPE_STATE;
+        count = server_build_state_packet(cli, pkt, 0, es) ? 1 : 0;
+    }
+    else if(frame->count == 1 && !frame->want_state)
+    {
+        pkt->hdr.type = frame->first_type;
+        pkt->data_len = frame->len - BUNDLE_ENTRY_HEADER_SIZE;
+        memcpy(pkt->data, frame->data + BUNDLE_ENTRY_HEADER_SIZE, pkt->data_len);
+    }
+    else
+    {
+        pkt->hdr.type = PACKET_TYPE_BUNDLE;
+        memcpy(pkt->data, frame->data, frame->len);
+        pkt->data_len = frame->len;
+
+        if(frame->want_state)
+        {
+            int offset = frame->len + BUNDLE_ENTRY_HEADER_SIZE;
+            if(!server_build_state_packet(cli, pkt, offset, es))
+            {
+                pkt->data_len = frame->len;
+            }
+            else if((int)pkt->data_len <= NET_MTU)
+            {
+                bundle_put_entry_header(&pkt->data[frame->len], PACKET_TYPE_STATE, pkt->data_len - offset);
+            }
+            else
+            {
+                // the messages go first, then the state alone in the next packet
+                Packet* state = &es->spill;
+                state->hdr = pkt->hdr;
+                state->hdr.id = pkt->hdr.id + 1;
+                state->hdr.type = PACKET_TYPE_STATE;
+                state->data_len = pkt->data_len - offset;
+                memcpy(state->data, &pkt->data[offset], state->data_len);
+                server_renumber_state(cli, pkt->hdr.id, state->hdr.id);
+
+                pkt->data_len = frame->len;
+                count = 2;
+            }
+        }
+
+        // a lone message left after all goes out as itself
+        if(pkt->data_len == (uint32_t)frame->len && frame->count == 1)
+        {
+            pkt->hdr.type = frame->first_type;
+            pkt->data_len = frame->len - BUNDLE_ENTRY_HEADER_SIZE;
+            memmove(pkt->data, frame->data + BUNDLE_ENTRY_HEADER_SIZE, pkt->data_len);
+        }
+    }
+
+    for(int i = 0; i < count; ++i)
+    {
+        server_frame_metrics(cli, i == 0 ? pkt : &es->spill);
+        cli->local_latest_packet_id++;
+    }
+
+    frame->len = 0;
+    frame->count = 0;
+    frame->want_state = false;
+    return count;
+}
+
+static void server_flush_frame(ClientInfo* cli)
+{
+    EncodeScratch* es = &server.encode_scratch[0];
+    Packet* pkt = send_batch_alloc();
+
+    int count = server_build_frame(cli, pkt, es);
+    if(count > 0)
+        send_batch_push(pkt, &client_cold(cli)->sockaddr);
+
+    if(count > 1)
+    {
+        pkt = send_batch_alloc();
+        memcpy(pkt, &es->spill, get_packet_size(&es->spill));
+        send_batch_push(pkt, &client_cold(cli)->sockaddr);
+    }
+}
+
+// Builds into the worker's own arena; by offset, since the arena may grow
+static void server_flush_job(void* data, int index, int worker)
+{
+    FlushJob* job = &((FlushJob*)data)[index];
+    EncodeScratch* es = &server.encode_scratch[worker];
+
+    if(es->out_cap - es->out_used < (int)sizeof(Packet))
+    {
+        int cap = MAX(2*es->out_cap, es->out_used + (int)sizeof(Packet));
+        uint8_t* out = realloc(es->out, cap);
+        if(!out)
+        {
+            job->count = 0;
+            return;
+        }
+        es->out = out;
+        es->out_cap = cap;
+    }
+
+    // datagrams are under NET_MTU, so a spilled state fits after the first
+    Packet* pkt = (Packet*)(es->out + es->out_used);
+    job->count = server_build_frame(job->cli, pkt, es);
+    job->worker = worker;
+    job->offset = es->out_used;
+
+    if(job->count > 0)
+        es->out_used += (get_packet_size(pkt) + 7) & ~7;
+
+    if(job->count > 1)
+    {
+        memcpy(es->out + es->out_used, &es->spill, get_packet_size(&es->spill));
+        es->out_used += (get_packet_size(&es->spill) + 7) & ~7;
+    }
+}
+
+// Builds the pending frames across the job workers, then copies them into
+// the send batch in order
+static void server_flush_frames()
+{
+    int count = 0;
+    for(int i = 0; i < server.pending_count; ++i)
+    {
+        ClientInfo* cli = &server.clients[server.pending_frames[i]];
+        client_cold(cli)->frame.pending = false;
+        if(cli->state != DISCONNECTED)
+            server.flush_jobs[count++].cli = cli;
+    }
+    server.pending_count = 0;
+
+    if(count > 0)
+        metrics_histogram_add(&metrics.pending_frames, count);
+
+    jobs_parallel_for(server_flush_job, server.flush_jobs, count, ENCODE_GRAIN);
+
+    for(int i = 0; i < count; ++i)
+    {
+        FlushJob* job = &server.flush_jobs[i];
+        uint8_t* src = server.encode_scratch[job->worker].out + job->offset;
+
+        for(int j = 0; j < job->count; ++j)
+        {
+            int len = get_packet_size((Packet*)src);
+            Packet* pkt = send_batch_alloc();
+            memcpy(pkt, src, len);
+            send_batch_push(pkt, &client_cold(job->cli)->sockaddr);
+            src += (len + 7) & ~7;
+        }
+    }
+
+    for(int i = 0; i < server.encode_scratch_count; ++i)
+        server.encode_scratch[i].out_used = 0;
+
+    send_batch_submit();
+}
+
+static void server_frame_mark_pending(ClientInfo* cli)
+{
+    OutFrame* frame = &client_cold(cli)->frame;
+    if(!frame->pending)
+    {
+        frame->pending = true;
+        server.pending_frames[server.pending_count++] = cli->client_id;
+    }
+}
+
+// Queues a message for the end of tick flush, flushing early if the frame
+// would grow past NET_MTU
+static void server_frame_append(ClientInfo* cli, PacketType type, uint8_t* data, int len)
+{
+    OutFrame* frame = &client_cold(cli)->frame;
+
+    if(frame->len + BUNDLE_ENTRY_HEADER_SIZE + len > NET_MTU)
+        server_flush_frame(cli);
+
+    if(BUNDLE_ENTRY_HEADER_SIZE + len > NET_MTU)
+    {
+        LOGN("%s payload too large to queue (%d B)", packet_type_to_str(type), len);
+        return;
+    }
+
+    bundle_put_entry_header(&frame->data[frame->len], type, len);
+    memcpy(&frame->data[frame->len + BUNDLE_ENTRY_HEADER_SIZE], data, len);
+
+    if(frame->count == 0)
+        frame->first_type = type;
+
+    frame->len += BUNDLE_ENTRY_HEADER_SIZE + len;
+    frame->count++;
+    server_frame_mark_pending(cli);
+}
+
+// Queues a message for cli; nothing is sent until server_flush_frame().
+// Disconnects are the exception since the slot is freed right after.
+static void server_send(PacketType type, ClientInfo* cli)
+{
+    Packet pkt = {
+        .hdr.game_id = GAME_ID,
+        .hdr.frame_no = server.frame_no,
+        .hdr.type = type
+    };
+
+    LOGNV("%s() : %s", __func__, packet_type_to_str(type));
+
+    switch(type)
+    {
+        case PACKET_TYPE_INIT:
+        {
+        } break;
+
+        case PACKET_TYPE_CONNECT_ACCEPTED:
+        {
+            cli->state = CONNECTED;
+            ConnectAcceptedPayload payload = {
+                .client_id = cli->client_id,
+                .tick_rate = (uint32_t)server.tick_rate
+            };
+            bitpack_reset(&server.bp);
+            connect_accepted_write(&server.bp, &payload);
+            payload_finish(&server.bp, &pkt, 0);
+
+            server_frame_append(cli, type, pkt.data, pkt.data_len);
+
+#if !HEADLESS
+            refresh_visible_room_gun_list();
+#endif
+            server_send_message(TO_ALL, FROM_SERVER, "client added %u", cli->client_id);
+        } break;
+
+        case PACKET_TYPE_CONNECT_REJECTED:
+        {
+            server_send_rejected(&cli->address, client_cold(cli)->last_reject_reason);
+        } break;
+
+        case PACKET_TYPE_PING:
+            server_frame_append(cli, type, NULL, 0);
+            break;
 
         case PACKET_TYPE_SETTINGS:
         {
         } break;
 
-        case PACKET_TYPE_STATE:
-        {
+        case PACKET_TYPE_STATE:
+        {
+            client_cold(cli)->frame.want_state = true;
+            server_frame_mark_pending(cli);
+        } break;
+
+        case PACKET_TYPE_ERROR:
+        {
+            ReasonPayload payload = {.reason = client_cold(cli)->last_packet_error};
+            bitpack_reset(&server.bp);
+            reason_write(&server.bp, &payload);
+            payload_finish(&server.bp, &pkt, 0);
+
+            server_frame_append(cli, type, pkt.data, pkt.data_len);
+        } break;
+
+        case PACKET_TYPE_DISCONNECT:
+        {
+            cli->state = DISCONNECTED;
+            pkt.hdr.id = cli->local_latest_packet_id++;
+            pkt.hdr.ack = cli->remote_latest_packet_id;
+            pkt.hdr.ack_bitfield = cli->received_bits;
+            pkt.data_len = 0;
+            // redundantly send so packet is guaranteed to get through
+            for(int i = 0; i < 3; ++i)
+                net_send(&server.info,&cli->address,&pkt, 1);
+        } break;
+
+        default:
+            break;
+    }
+}
+
+// Takes the input for the client's next tick. Inputs are keyed by the
+// client's tick number, so each one is simulated exactly once and in order
+// no matter how they were bunched up on the way here.
+static NetPlayerInput* server_next_input(ClientInfo* cli)
+{
+    if(cli->input_mask == 0)
+    {
+        server.stats.inputs_missing++;
+        return NULL; // wait, it may just be late
+    }
+
+    for(int n = 1; n <= INPUT_QUEUE_MAX; ++n)
+    {
+        uint16_t seq = cli->last_input_seq + n;
+        uint16_t bit = 1 << (seq % INPUT_QUEUE_MAX);
+
+        if(!(cli->input_mask & bit))
+        {
+            // later ones are here, this one was lost
+            server.stats.inputs_lost++;
+            cli->missed_mask |= bit;
+            continue;
+        }
+
+        cli->input_mask &= ~bit;
+        cli->missed_mask &= ~bit;
+        cli->last_input_seq = seq;
+        return &cli->net_player_inputs[seq % INPUT_QUEUE_MAX];
+    }
+
+    return NULL;
+}
+
+// Buffers the inputs of an input packet by seq, dropping copies of ones
+// already received. See client_write_inputs() for the format.
+static bool server_read_inputs(ClientInfo* cli, BitPack* bp)
+{
+    InputHeaderPayload hdr;
+    NetPlayerInput inputs[INPUT_QUEUE_MAX];
+    input_header_read(bp, &hdr);
+
+    if(hdr.count > INPUT_QUEUE_MAX)
+    {
+        LOGN("Too many inputs from client %d", cli->client_id);
+        return false;
+    }
+
+    for(int i = 0; i < (int)hdr.count; ++i)
+    {
+        if(i == 0)
+            net_player_input_read(bp, &inputs[i]);
+        else
+            net_player_input_read_delta(bp, &inputs[i], &inputs[i-1]);
+    }
+
+    if(bp->overflow != BITPACK_OK)
+    {
+        LOGN("Input count exceeds packet length");
+        return false;
+    }
+
+    // most are copies resent in case an earlier packet was lost
+    for(int i = 0; i < (int)hdr.count; ++i)
+    {
+        uint16_t seq = (uint16_t)(hdr.seq + i);
+        uint16_t ahead = seq - cli->last_input_seq;
+        uint16_t bit = 1 << (seq % INPUT_QUEUE_MAX);
+
+        if(ahead == 0 || ahead >= 32768)
+        {
+            uint16_t behind = cli->last_input_seq - seq;
+            if(behind < INPUT_QUEUE_MAX && (cli->missed_mask & bit))
+            {
+                server.stats.inputs_late++; // its tick went ahead without it
+                cli->missed_mask &= ~bit;
+            }
+            else
+            {
+                server.stats.inputs_redundant++;
+            }
+            continue;
+        }
+
+        if(ahead <= INPUT_QUEUE_MAX && (cli->input_mask & bit))
+        {
+            server.stats.inputs_redundant++;
+            continue;
+        }
+
+        if(ahead > INPUT_QUEUE_MAX)
+        {
+            if(cli->input_mask != 0)
+                break; // left unacked, the client corrects its prediction
+
+            // too far behind to wait for the gap, start again from here
+            server.stats.inputs_lost += ahead - 1;
+            cli->last_input_seq = seq - 1;
+            cli->missed_mask = 0;
+        }
+
+        cli->net_player_inputs[seq % INPUT_QUEUE_MAX] = inputs[i];
+        cli->input_mask |= bit;
+    }
+
+    return true;
+}
+
+static void server_simulate(double dt)
+{
+    for(int i = 0; i < server.max_clients; ++i)
+    {
+        ClientInfo* cli = &server.clients[i];
+        if(cli->state != CONNECTED)
+            continue;
+
+        Player* p = &players[cli->client_id];
+
+        // one client tick per server tick, two if the buffer has grown
+        // (the client's clock runs fast or packets came in a burst)
+        int steps = __builtin_popcount(cli->input_mask) > INPUT_BUFFER_DEPTH ? 2 : 1;
+
+        for(int j = 0; j < steps; ++j)
+        {
+            NetPlayerInput* input = server_next_input(cli);
+            if(!input)
+                break;
+
+            // the step length is the tick, not what the client measured
+            input->delta_t = (float)dt;
+            player_apply_input(p, input);
+        }
+    }
+
+    server.tick++;
+
+    if(server.lagcomp.frames)
+    {
+        LagCompPose* frame = lagcomp_begin_frame(&server.lagcomp, server.tick / server.tick_rate);
+        for(int i = 0; i < server.max_clients; ++i)
+        {
+            if(server.clients[i].state != CONNECTED)
+                continue;
+
+            Player* p = &players[i];
+            lagcomp_add(frame, (uint16_t)i, (float[3]){p->pos.x, p->pos.y, p->pos.z}, p->height);
+        }
+    }
+
+    server.frame_no++;
+}
+
+static void server_update_tick_stats(double work_time, int ticks)
+{
+    ServerTickStats* st = &server.stats;
+
+    double per_tick = work_time / ticks;
+    metrics_histogram_add(&metrics.tick_us, (uint64_t)(per_tick*1000000.0));
+    st->tick_time_avg = st->ticks == 0 ? per_tick : st->tick_time_avg + (per_tick - st->tick_time_avg) / 32.0;
+    if(per_tick > st->tick_time_max)
+        st->tick_time_max = per_tick;
+    if(work_time > ticks/server.tick_rate)
+        st->overruns++;
+
+    st->ticks += ticks;
+    if(ticks > 1)
+        st->catchup_ticks += ticks - 1;
+}
+
+static void server_log_tick_stats()
+{
+    ServerTickStats* st = &server.stats;
+    st->recv_stalls = atomic_load_explicit(&pipeline.recv_stalls, memory_order_relaxed);
+    st->states_oversized = atomic_load_explicit(&server.states_oversized, memory_order_relaxed);
+    LOGN("Ticks: %llu (%llu caught up, %llu skipped, %llu overruns), tick time avg %.3f ms max %.3f ms",
+         (unsigned long long)st->ticks, (unsigned long long)st->catchup_ticks,
+         (unsigned long long)st->skipped_ticks, (unsigned long long)st->overruns,
+         1000.0*st->tick_time_avg, 1000.0*st->tick_time_max);
+    LOGN("Inputs: %llu missing, %llu lost, %llu late, %llu redundant, receive queue full %llu times",
+         (unsigned long long)st->inputs_missing, (unsigned long long)st->inputs_lost,
+         (unsigned long long)st->inputs_late, (unsigned long long)st->inputs_redundant,
+         (unsigned long long)st->recv_stalls);
+    LOGN("Connects: %llu challenged, %llu failed the challenge",
+         (unsigned long long)st->connect_challenges, (unsigned long long)st->connect_failed_challenges);
+    LOGN("States: %llu over NET_MTU, not sent", (unsigned long long)st->states_oversized);
+    st->tick_time_max = 0.0;
+}
+
+static void metrics_line_traffic(MetricsLine* l, const char* key, MetricsTraffic* t, double period)
+{
+    metrics_line_object_begin(l, key);
+    for(int i = 0; i < PACKET_TYPE_MAX; ++i)
+    {
+        if(t[i].count == 0)
+            continue;
+
+        metrics_line_object_begin(l, packet_type_to_str(i));
+        metrics_line_f64(l, "per_s", t[i].count / period);
+        metrics_line_f64(l, "bytes_per_s", t[i].bytes / period);
+        metrics_line_object_end(l);
+    }
+    metrics_line_object_end(l);
+}
+
+static void metrics_line_shard_totals(MetricsLine* l, uint64_t* bytes_in, uint64_t* bytes_out)
+{
+    uint64_t totals[6] = {0};
+    for(int i = 0; i < METRICS_SHARD_COUNT; ++i)
+    {
+        MetricsShard* shard = &metrics.shards[i];
+        totals[0] += metrics_load(&shard->datagrams_in);
+        totals[1] += metrics_load(&shard->bytes_in);
+        totals[2] += metrics_load(&shard->invalid_in);
+        totals[3] += metrics_load(&shard->datagrams_out);
+        totals[4] += metrics_load(&shard->bytes_out);
+        totals[5] += metrics_load(&shard->failed_out);
+    }
+
+    metrics_line_object_begin(l, "recv");
+    metrics_line_u64(l, "datagrams", totals[0]);
+    metrics_line_u64(l, "bytes", totals[1]);
+    metrics_line_u64(l, "invalid", totals[2]);
+    metrics_line_u64(l, "queue_full", atomic_load_explicit(&pipeline.recv_stalls, memory_order_relaxed));
+    metrics_line_object_end(l);
+
+    metrics_line_object_begin(l, "send");
+    metrics_line_u64(l, "datagrams", totals[3]);
+    metrics_line_u64(l, "bytes", totals[4]);
+    metrics_line_u64(l, "failed", totals[5]);
+    metrics_line_object_end(l);
+
+    *bytes_in = totals[1];
+    *bytes_out = totals[4];
+}
+
+// Writes a line for each connection and one for the server, covering the
+// time since the last dump, then starts the next period. Histograms, rates,
+// acked/lost and received/missed are per period; the other counters are
+// totals since the server started.
+static void server_dump_metrics(double now)
+{
+    double period = now - metrics.time_of_last_dump;
+    if(period <= 0.0)
+        return;
+
+    if(metrics_sink_active(&metrics.sink))
+    {
+        static MetricsLine l;
+        double time = now - server.start_time;
+
+        MetricsHistogram rtt = {0};
+        MetricsTraffic in[METRICS_PACKET_TYPES], out[METRICS_PACKET_TYPES];
+        memcpy(in, metrics.departed_in, sizeof(in));
+        memcpy(out, metrics.departed_out, sizeof(out));
+        uint64_t acked = 0, lost = 0, received = 0, missed = 0;
+
+        for(int i = 0; i < server.max_clients; ++i)
+        {
+            ClientInfo* cli = &server.clients[i];
+            if(cli->state == DISCONNECTED)
+                continue;
+
+            MetricsConn* m = &client_cold(cli)->metrics;
+            metrics_histogram_merge(&rtt, &m->rtt);
+            metrics_traffic_merge(in, m->in);
+            metrics_traffic_merge(out, m->out);
+            acked += m->acked;
+            lost += m->lost;
+            received += m->received;
+            missed += m->missed;
+
+            char address[32];
+            snprintf(address, sizeof(address), "%u.%u.%u.%u:%u", cli->address.a, cli->address.b, cli->address.c, cli->address.d, cli->address.port);
+
+            metrics_line_begin(&l);
+            metrics_line_str(&l, "type", "connection");
+            metrics_line_f64(&l, "time", time);
+            metrics_line_u64(&l, "client_id", cli->client_id);
+            metrics_line_str(&l, "address", address);
+            metrics_line_f64(&l, "rtt_ms", 1000.0*m->srtt);
+            metrics_line_f64(&l, "jitter_ms", 1000.0*m->jitter);
+            metrics_line_histogram(&l, "rtt_samples_ms", &m->rtt, 0.001);
+            metrics_line_u64(&l, "acked", m->acked);
+            metrics_line_u64(&l, "lost", m->lost);
+            metrics_line_f64(&l, "loss", (m->acked + m->lost) ? (double)m->lost / (m->acked + m->lost) : 0.0);
+            metrics_line_u64(&l, "received", m->received);
+            metrics_line_u64(&l, "missed", m->missed);
+            metrics_line_f64(&l, "loss_in", (m->received + m->missed) ? (double)m->missed / (m->received + m->missed) : 0.0);
+            metrics_line_u64(&l, "resent_messages", client_cold(cli)->channel.resent_count);
+            metrics_line_traffic(&l, "in", m->in, period);
+            metrics_line_traffic(&l, "out", m->out, period);
+            metrics_line_end(&l);
+            metrics_sink_write(&metrics.sink, &l);
+        }
+
+        ServerTickStats* st = &server.stats;
+
+        metrics_line_begin(&l);
+        metrics_line_str(&l, "type", "server");
+        metrics_line_f64(&l, "time", time);
+        metrics_line_f64(&l, "period", period);
+        metrics_line_u64(&l, "clients", server.num_clients);
+        metrics_line_u64(&l, "max_clients", server.max_clients);
+        metrics_line_f64(&l, "tick_rate", server.tick_rate);
+        metrics_line_u64(&l, "ticks", st->ticks);
+        metrics_line_u64(&l, "skipped_ticks", st->skipped_ticks);
+        metrics_line_u64(&l, "overruns", st->overruns);
+        metrics_line_histogram(&l, "tick_us", &metrics.tick_us, 1.0);
+        metrics_line_histogram(&l, "recv_queue", &metrics.recv_queue, 1.0);
+        metrics_line_histogram(&l, "pending_frames", &metrics.pending_frames, 1.0);
+        metrics_line_histogram(&l, "send_queue", &metrics.send_queue, 1.0);
+
+        uint64_t bytes_in, bytes_out;
+        metrics_line_shard_totals(&l, &bytes_in, &bytes_out);
+        metrics_line_f64(&l, "recv_bytes_per_s", (bytes_in - metrics.last_bytes_in) / period);
+        metrics_line_f64(&l, "send_bytes_per_s", (bytes_out - metrics.last_bytes_out) / period);
+        metrics.last_bytes_in = bytes_in;
+        metrics.last_bytes_out = bytes_out;
+
+        metrics_line_object_begin(&l, "inputs");
+        metrics_line_u64(&l, "missing", st->inputs_missing);
+        metrics_line_u64(&l, "lost", st->inputs_lost);
+        metrics_line_u64(&l, "late", st->inputs_late);
+        metrics_line_u64(&l, "redundant", st->inputs_redundant);
+        metrics_line_object_end(&l);
+
+        metrics_line_object_begin(&l, "connects");
+        metrics_line_u64(&l, "challenges", st->connect_challenges);
+        metrics_line_u64(&l, "failed_challenges", st->connect_failed_challenges);
+        metrics_line_object_end(&l);
+
+        metrics_line_histogram(&l, "rtt_ms", &rtt, 0.001);
+        metrics_line_u64(&l, "acked", acked);
+        metrics_line_u64(&l, "lost", lost);
+        metrics_line_u64(&l, "received", received);
+        metrics_line_u64(&l, "missed", missed);
+        metrics_line_traffic(&l, "in", in, period);
+        metrics_line_traffic(&l, "out", out, period);
+        metrics_line_end(&l);
+        metrics_sink_write(&metrics.sink, &l);
+
+        metrics_sink_flush(&metrics.sink);
+    }
+
+    for(int i = 0; i < server.max_clients; ++i)
+        metrics_conn_period_reset(&server.clients_cold[i].metrics);
+
+    memset(&metrics.tick_us, 0, sizeof(MetricsHistogram));
+    memset(&metrics.recv_queue, 0, sizeof(MetricsHistogram));
+    memset(&metrics.pending_frames, 0, sizeof(MetricsHistogram));
+    memset(&metrics.send_queue, 0, sizeof(MetricsHistogram));
+    memset(metrics.departed_in, 0, sizeof(metrics.departed_in));
+    memset(metrics.departed_out, 0, sizeof(metrics.departed_out));
+    metrics.time_of_last_dump = now;
+}
+
+// Server time in seconds, as recorded for lag compensation
+double net_server_get_time()
+{
+    return server.tick / server.tick_rate;
+}
+
+// Tests a shot against the world as it was at time (server time, e.g. what
+// the shooter was seeing), ignoring the shooter. Shots at the same time in
+// a tick share one rewind.
+bool net_server_raycast(double time, const float origin[3], const float dir[3], float max_dist, int shooter, LagCompHit* hit)
+{
+    if(server.lag_pose_tick != server.tick || server.lag_pose_time != time || server.lag_pose.count == 0)
+    {
+        if(!lagcomp_rewind(&server.lagcomp, time, &server.lag_pose))
+            return false;
+        server.lag_pose_tick = server.tick;
+        server.lag_pose_time = time;
+    }
+
+    return lagcomp_raycast(&server.lag_pose, origin, dir, max_dist, shooter, hit);
+}
+
+void net_server_get_tick_stats(ServerTickStats* stats)
+{
+    *stats = server.stats;
+    stats->recv_stalls = atomic_load_explicit(&pipeline.recv_stalls, memory_order_relaxed);
+    stats->states_oversized = atomic_load_explicit(&server.states_oversized, memory_order_relaxed);
+}
+
+static bool server_events_init()
+{
+#if HAS_EPOLL
+    server.epoll_fd = epoll_create1(0);
+    if(server.epoll_fd < 0)
+    {
+        perror("Failed to create epoll instance");
+        return false;
+    }
+
+    server.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(server.timer_fd < 0)
+    {
+        perror("Failed to create timerfd");
+        return false;
+    }
+
+    server.recv_fd = eventfd(0, EFD_NONBLOCK);
+    if(server.recv_fd < 0)
+    {
+        perror("Failed to create eventfd");
+        return false;
+    }
+
+    // the socket belongs to the receive thread, which signals recv_fd once
+    // it has queued what came in
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+
+    ev.data.fd = server.timer_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.timer_fd, &ev);
+
+    ev.data.fd = server.recv_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.recv_fd, &ev);
+#endif
+    return true;
+}
+
+// Sleeps until timeout (seconds) elapses or, with epoll, the receive thread
+// has queued packets
+static void server_wait_for_event(double timeout)
+{
+    if(timeout <= 0.0)
+        return;
+
+#if HAS_EPOLL
+    struct itimerspec its = {0};
+    its.it_value.tv_sec  = (time_t)timeout;
+    its.it_value.tv_nsec = (long)((timeout - (double)its.it_value.tv_sec)*1000000000.0);
+    if(its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        its.it_value.tv_nsec = 1; // a zero value would disarm the timer
+
+    timerfd_settime(server.timer_fd, 0, &its, NULL);
+
+    struct epoll_event events[2];
+    int count = epoll_wait(server.epoll_fd, events, 2, -1);
+
+    if(count < 0 && errno != EINTR)
+    {
+        perror("epoll_wait error");
+        return;
+    }
+
+    for(int i = 0; i < count; ++i)
+    {
+        // reads reset them, expirations or the count of signals
+        uint64_t value;
+        read(events[i].data.fd, &value, sizeof(value));
+    }
+#else
+    timer_delay_us((int)(timeout*1000000.0));
+#endif
+}
+
+// Receives straight into free slots of the receive queue and checks the
+// format there, so the simulation thread only sees well formed packets.
+// Malformed datagrams are only counted, in invalid_in.
+static void* server_recv_thread(void* arg)
+{
+    (void)arg;
+    SPSCQueue* q = &pipeline.recv_queue;
+    SocketRecvSlot slots[SOCKET_RECV_BATCH_MAX];
+
+    while(!atomic_load(&pipeline.stopping))
+    {
+        if(!wait_for_data(server.info.socket, pipeline.stop_fd, pipeline.stop_fd >= 0 ? -1.0 : RECV_WAIT))
+            continue;
+
+        while(!atomic_load(&pipeline.stopping))
+        {
+            uint32_t n = spsc_free_count(q);
+            if(n == 0)
+            {
+                // the simulation is behind, let the socket buffer hold the rest
+                atomic_fetch_add_explicit(&pipeline.recv_stalls, 1, memory_order_relaxed);
+                timer_delay_us(500);
+                continue;
+            }
+            if(n > SOCKET_RECV_BATCH_MAX)
+                n = SOCKET_RECV_BATCH_MAX;
+
+            for(uint32_t i = 0; i < n; ++i)
+                slots[i].data = (uint8_t*)&((RecvPacket*)spsc_write_slot(q, i))->pkt;
+
+            int count = net_recv_batch(&server.info, slots, n);
+            double now = timer_get_time();
+            uint64_t bytes = 0, invalid = 0;
+
+            for(int i = 0; i < count; ++i)
+            {
+                RecvPacket* rp = spsc_write_slot(q, i);
+                rp->address = slots[i].address;
+                rp->len = slots[i].len;
+                rp->time = now;
+                bytes += slots[i].len;
+
+                if(!validate_packet_format(&rp->pkt, rp->len))
+                {
+                    rp->len = 0;
+                    invalid++;
+                }
+            }
+
+            spsc_commit(q, count);
+
+#if HAS_EPOLL
+            if(count > 0)
+            {
+                uint64_t one = 1;
+                write(server.recv_fd, &one, sizeof(one));
+            }
+#endif
+
+            MetricsShard* shard = &metrics.shards[METRICS_SHARD_RECV];
+            metrics_add(&shard->datagrams_in, count);
+            metrics_add(&shard->bytes_in, bytes);
+            metrics_add(&shard->invalid_in, invalid);
 
-        } break;
+            if(count < (int)n)
+                break;
+        }
+    }
 
-        case PACKET_TYPE_ERROR:
-        {
-            pack_u8(&pkt, (uint8_t)cli->last_packet_error);
-            net_send(&server.info,&cli->address,&pkt, 1);
-        } break;
+    return NULL;
+}
 
-        case PACKET_TYPE_DISCONNECT:
+static void* server_send_thread(void* arg)
+{
+    (void)arg;
+    for(;;)
+    {
+        SendBatch* batch;
+
+        pthread_mutex_lock(&pipeline.lock);
+        while(!spsc_pop(&pipeline.send_queue, &batch))
         {
-            cli->state = DISCONNECTED;
-            pkt.data_len = 0;
-            // redundantly send so packet is guaranteed to get through
-            for(int i = 0; i < 3; ++i)
-                net_send(&server.info,&cli->address,&pkt, 1);
-        } break;
+            if(atomic_load(&pipeline.stopping))
+            {
+                pthread_mutex_unlock(&pipeline.lock);
+                return NULL;
+            }
+            pthread_cond_wait(&pipeline.send_ready, &pipeline.lock);
+        }
+        pthread_mutex_unlock(&pipeline.lock);
 
-        default:
-            break;
+        send_batch_send(batch);
+        spsc_push(&pipeline.free_queue, &batch);
+        pipeline_signal(&pipeline.batch_free);
     }
 }
 
-static void server_simulate(double dt)
+// Gets the receive thread out of its wait to see stopping; without an
+// eventfd it sees it within RECV_WAIT
+static void pipeline_wake_recv()
 {
-    int player_count = 0;
+#if HAS_EPOLL
+    uint64_t one = 1;
+    write(pipeline.stop_fd, &one, sizeof(one));
+#endif
+}
 
-    for(int i = 0; i < MAX_CLIENTS; ++i)
+static bool server_pipeline_start()
+{
+    if(!spsc_create(&pipeline.recv_queue, RECV_QUEUE_SIZE, sizeof(RecvPacket)) ||
+       !spsc_create(&pipeline.send_queue, SEND_BATCH_POOL, sizeof(SendBatch*)) ||
+       !spsc_create(&pipeline.free_queue, SEND_BATCH_POOL, sizeof(SendBatch*)))
     {
-        ClientInfo* cli = &server.clients[i];
-        if(cli->state != CONNECTED)
-            continue;
+        LOGN("Failed to allocate server queues");
+        return false;
+    }
 
-        player_count++;
-        Player* p = &players[cli->client_id];
+    send_batch = &pipeline.batches[0];
+    for(int i = 1; i < SEND_BATCH_POOL; ++i)
+    {
+        SendBatch* batch = &pipeline.batches[i];
+        spsc_push(&pipeline.free_queue, &batch);
+    }
 
-        if(cli->input_count == 0)
-        {
-            player_update(p,dt, false, 0);
-        }
-        else
-        {
-            for(int i = 0; i < cli->input_count; ++i)
-            {
-                // apply input to player
-                for(int j = 0; j < PLAYER_ACTION_MAX; ++j)
-                {
-                    bool key_state = (cli->net_player_inputs[i].keys & ((uint32_t)1<<j)) != 0;
-                    p->actions[j].state = key_state;
-                }
+#if HAS_EPOLL
+    pipeline.stop_fd = eventfd(0, EFD_NONBLOCK);
+    if(pipeline.stop_fd < 0)
+    {
+        perror("Failed to create eventfd");
+        return false;
+    }
+#else
+    pipeline.stop_fd = -1;
+#endif
+    pipeline.stopping = false;
+    pipeline.running = true;
 
-                player_update(p,cli->net_player_inputs[i].delta_t, false, 0);
-            }
+    if(pthread_create(&pipeline.recv_thread, NULL, server_recv_thread, NULL) != 0)
+    {
+        LOGN("Failed to start server threads");
+        pipeline.running = false;
+        return false;
+    }
 
-            cli->input_count = 0;
-        }
+    if(pthread_create(&pipeline.send_thread, NULL, server_send_thread, NULL) != 0)
+    {
+        LOGN("Failed to start server threads");
+        pipeline.stopping = true;
+        pipeline_wake_recv();
+        pthread_join(pipeline.recv_thread, NULL);
+        pipeline.running = false;
+        return false;
     }
 
-    server.frame_no++;
-    if(server.frame_no > 255)
-        server.frame_no = 0;
+    return true;
 }
 
-int net_server_start()
+// Sends what's been built, then stops and joins both threads
+static void server_pipeline_stop()
 {
-    LOGN("%s()", __func__);
+    send_batch_submit();
 
-    // init
-    socket_initialize();
+    // the send thread only sees stopping with its queue empty, so every
+    // batch goes out first
+    pipeline.stopping = true;
+    pipeline_signal(&pipeline.send_ready);
+    pipeline_wake_recv();
 
-    memset(server.clients, 0, sizeof(ClientInfo)*MAX_CLIENTS);
-    server.num_clients = 0;
+    pthread_join(pipeline.recv_thread, NULL);
+    pthread_join(pipeline.send_thread, NULL);
+    pipeline.running = false;
 
-    int sock;
+#if HAS_EPOLL
+    close(pipeline.stop_fd);
+#endif
+    spsc_destroy(&pipeline.recv_queue);
+    spsc_destroy(&pipeline.send_queue);
+    spsc_destroy(&pipeline.free_queue);
+}
 
-    // set timers
-    timer_set_fps(&server_timer,TICK_RATE);
-    timer_begin(&server_timer);
+// A client slot is only taken once the response proves the peer got the
+// challenge sent to its address
+static ClientInfo* server_accept_challenge_response(Address* from, Packet* pkt)
+{
+    if(pkt->data_len != CONNECT_PACKET_SIZE)
+    {
+        LOGN("Packet length doesn't equal %d",CONNECT_PACKET_SIZE);
+        return NULL;
+    }
 
-    LOGN("Creating socket.");
-    socket_create(&sock);
+    BitPack bp;
+    ConnectResponsePayload payload;
+    payload_attach(&bp, pkt, SALT_SIZE);
+    connect_response_read(&bp, &payload);
+    if(bp.overflow != BITPACK_OK)
+    {
+        LOGN("Malformed challenge response");
+        return NULL;
+    }
 
-    LOGN("Binding socket %u to any local ip on port %u.", sock, PORT);
-    socket_bind(sock, NULL, PORT);
-    server.info.socket = sock;
+    uint8_t server_salt[8];
+    if(!connect_cookie_check(from, payload.client_salt, &pkt->data[0], server_salt))
+    {
+        server.stats.connect_failed_challenges++; // counted, not logged, floods would fill the log
+        server_send_rejected(from, CONNECT_REJECT_REASON_FAILED_CHALLENGE);
+        return NULL;
+    }
 
-    bitpack_create(&server.bp, BITPACK_SIZE);
+    if(payload.name[0] == '\0') LOGN("namelen is 0!");
 
-    LOGN("Server Started with tick rate %f.", TICK_RATE);
+    // the same address and port again: a resent response keeps its
+    // connection, a new handshake starts over in a fresh slot so nothing
+    // carries over (input seq, channel, snapshots, metrics)
+    int i = client_table_find(from);
+    if(i != -1 && memcmp(server.clients_cold[i].client_salt, payload.client_salt, 8) != 0)
+        remove_client(&server.clients[i]);
 
-    double t0=timer_get_time();
-    double t1=0.0;
-    double accum = 0.0;
+    ClientInfo* cli = NULL;
+    int ret = server_assign_new_client(from, &cli, payload.name);
+    if(ret == 0)
+    {
+        server_send_rejected(from, CONNECT_REJECT_REASON_SERVER_FULL);
+        return NULL;
+    }
 
-    server.start_time = t0;
+    update_server_num_clients();
 
-    double t0_g=timer_get_time();
-    double t1_g=0.0;
-    double accum_g = 0.0;
+    LOGN("Welcome New Client! (%d/%d)", server.num_clients, server.max_clients);
+    print_address(&cli->address);
 
-    const double dt = 1.0/TICK_RATE;
+    if(ret == 1)
+    {
+        player_reset(&players[cli->client_id]);
+    }
 
-    for(;;)
+    ClientInfoCold* cold = client_cold(cli);
+    memcpy(cold->client_salt, payload.client_salt, 8);
+    memcpy(cold->server_salt, server_salt, 8);
+    store_xor_salts(cold->client_salt, cold->server_salt, cli->xor_salts);
+    print_salt(cli->xor_salts);
+
+    return cli;
+}
+
+// The format was checked on the receive thread (validate_packet_format())
+static void server_process_packet(Address* from, Packet* recv_pkt, int len, double time)
+{
+
+    ClientInfo* cli = NULL;
+
+    if(recv_pkt->hdr.type == PACKET_TYPE_CONNECT_REQUEST)
     {
-        // handle connections, receive inputs
-        for(;;)
+        // answered without allocating anything
+        if(recv_pkt->data_len != CONNECT_PACKET_SIZE)
         {
-            // Read all pending packets
-            bool data_waiting = has_data_waiting(server.info.socket);
-            if(!data_waiting)
-            {
+            LOGN("Packet length doesn't equal %d",CONNECT_PACKET_SIZE);
+            return;
+        }
+
+        server_send_challenge(from, &recv_pkt->data[0]);
+        server.stats.connect_challenges++;
+        return;
+    }
+
+    if(recv_pkt->hdr.type == PACKET_TYPE_CONNECT_CHALLENGE_RESP)
+    {
+        cli = server_accept_challenge_response(from, recv_pkt);
+        if(!cli)
+            return;
+    }
+    else
+    {
+        int client_id = server_get_client(from, &cli);
+        if(client_id == -1) return;
+
+        // existing client
+        bool auth = authenticate_client(recv_pkt,cli);
+
+        if(!auth)
+        {
+            LOGN("Client Failed authentication");
+            return;
+        }
+    }
+
+    MetricsConn* metrics_conn = &client_cold(cli)->metrics;
+    metrics_traffic_add(metrics_conn->in, recv_pkt->hdr.type, len);
+
+    uint16_t prev_latest = cli->remote_latest_packet_id;
+    bool is_latest = track_received_packet(recv_pkt->hdr.id, &cli->remote_latest_packet_id, &cli->received_bits);
+    if(!is_latest)
+    {
+        LOGN("Not latest packet from client. Ignoring...");
+        return;
+    }
+    metrics_conn_received(metrics_conn, recv_pkt->hdr.id, prev_latest);
+
+    cli->remote_ack = recv_pkt->hdr.ack;
+    cli->remote_ack_bits = recv_pkt->hdr.ack_bitfield;
+    cli->time_of_latest_packet = time;
+
+    channel_process_ack(&client_cold(cli)->channel, cli->remote_ack, cli->remote_ack_bits, time);
+    metrics_conn_ack(metrics_conn, cli->remote_ack, cli->remote_ack_bits, time);
+
+    LOGNV("%s() : %s", __func__, packet_type_to_str(recv_pkt->hdr.type));
+
+    switch(recv_pkt->hdr.type)
+    {
+
+        case PACKET_TYPE_CONNECT_CHALLENGE_RESP:
+        {
+            cli->state = SENDING_CHALLENGE_RESPONSE;
+            LOGI("Accept client: %d", cli->client_id);
+            player_set_active(&players[cli->client_id],true);
+
+            server_send(PACKET_TYPE_CONNECT_ACCEPTED,cli);
+            server_send(PACKET_TYPE_INIT, cli);
+            server_send(PACKET_TYPE_STATE,cli);
+
+        } break;
+
+        case PACKET_TYPE_INPUT:
+        {
+            BitPack bp;
+            payload_attach(&bp, recv_pkt, SALT_SIZE);
+            if(!server_read_inputs(cli, &bp))
                 break;
-            }
 
-            Address from = {0};
-            Packet recv_pkt = {0};
-            int offset = 0;
+            // reliable messages ride along after the inputs
+            if(!channel_read(&client_cold(cli)->channel, &bp))
+                LOGN("Malformed messages from client %d", cli->client_id);
+            server_process_messages(cli);
+        } break;
 
-            int bytes_received = net_recv(&server.info, &from, &recv_pkt);
+        // messages sent when there are no inputs to carry them
+        case PACKET_TYPE_MESSAGE:
+        case PACKET_TYPE_SETTINGS:
+        {
+            BitPack bp;
+            payload_attach(&bp, recv_pkt, SALT_SIZE);
+            if(!channel_read(&client_cold(cli)->channel, &bp))
+                LOGN("Malformed messages from client %d", cli->client_id);
+            server_process_messages(cli);
+        } break;
 
-            if(!validate_packet_format(&recv_pkt))
-            {
-                LOGN("Invalid packet format!");
-                timer_delay_us(1000); // delay 1ms
-                continue;
-            }
+        case PACKET_TYPE_PING:
+        {
+            server_send(PACKET_TYPE_PING, cli);
+        } break;
 
-            ClientInfo* cli = NULL;
+        case PACKET_TYPE_DISCONNECT:
+        {
+            remove_client(cli);
+        } break;
 
-            if(recv_pkt.hdr.type == PACKET_TYPE_CONNECT_REQUEST)
-            {
-                if(recv_pkt.data_len != 1024)
-                {
-                    LOGN("Packet length doesn't equal %d",1024);
-                    break;
-                }
+        default:
+        break;
+    }
+}
 
-                uint8_t salt[8] = {0};
-                unpack_bytes(&recv_pkt, salt, 8, &offset);
+// Takes everything received since the last tick
+static void server_process_received()
+{
+    SPSCQueue* q = &pipeline.recv_queue;
+    uint32_t count = spsc_count(q);
+    metrics_histogram_add(&metrics.recv_queue, count);
 
-                char name[PLAYER_NAME_MAX+1] = {0};
-                uint8_t namelen = unpack_string(&recv_pkt, name, PLAYER_NAME_MAX, &offset);
-                if(namelen == 0) printf("namelen is 0!\n");
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        RecvPacket* rp = spsc_read_slot(q, i);
+        if(rp->len > 0)
+            server_process_packet(&rp->address, &rp->pkt, rp->len, rp->time);
+    }
 
-                int ret = server_assign_new_client(&from, &cli, name);
+    spsc_release(q, count);
+}
 
-                if(ret > 0)
-                {
-                    cli->state = SENDING_CONNECTION_REQUEST;
-                    memcpy(&cli->address,&from,sizeof(Address));
-                    update_server_num_clients();
+// Whole Hz, as it's sent to clients in the connect accept
+bool net_server_set_tick_rate(int tick_rate)
+{
+    if(tick_rate < 1 || tick_rate > 255)
+    {
+        LOGN("Invalid tick rate %d (1-255)", tick_rate);
+        return false;
+    }
 
-                    LOGN("Welcome New Client! (%d/%d)", server.num_clients, MAX_CLIENTS);
-                    print_address(&cli->address);
+    server.tick_rate = tick_rate;
+    return true;
+}
 
-                    if(ret == 1)
-                    {
-                        player_reset(&players[cli->client_id]);
-                    }
+bool net_server_set_worker_count(int num_workers)
+{
+    if(num_workers < 1 || num_workers > JOBS_MAX_WORKERS)
+    {
+        LOGN("Invalid worker count %d (1-%d)", num_workers, JOBS_MAX_WORKERS);
+        return false;
+    }
 
-                    // store salt
-                    memcpy(cli->client_salt, salt, 8);
-                    server_send(PACKET_TYPE_CONNECT_CHALLENGE, cli);
-                }
-                else
-                {
-                    LOGNV("Creating temporary client");
-                    // create a temporary ClientInfo so we can send a reject packet back
-                    ClientInfo tmp_cli = {0};
-                    memcpy(&tmp_cli.address,&from,sizeof(Address));
-
-                    tmp_cli.last_reject_reason = CONNECT_REJECT_REASON_SERVER_FULL;
-                    server_send(PACKET_TYPE_CONNECT_REJECTED, &tmp_cli);
-                    break;
-                }
-            }
-            else
-            {
+    server.num_workers = num_workers;
+    return true;
+}
 
-               int client_id = server_get_client(&from, &cli);
-               if(client_id == -1) break;
+// Off sends every player to every client
+void net_server_set_interest_management(bool enabled)
+{
+    server.interest = enabled;
+}
 
-                // existing client
-                bool auth = authenticate_client(&recv_pkt,cli);
-                offset = 8;
+bool net_server_set_metrics_file(const char* path)
+{
+    return metrics_sink_set_file(&metrics.sink, path);
+}
 
-                if(!auth)
-                {
-                    LOGN("Client Failed authentication");
+bool net_server_set_metrics_port(uint16_t port)
+{
+    return metrics_sink_set_port(&metrics.sink, port);
+}
 
-                    if(recv_pkt.hdr.type == PACKET_TYPE_CONNECT_CHALLENGE_RESP)
-                    {
-                        cli->last_reject_reason = CONNECT_REJECT_REASON_FAILED_CHALLENGE;
-                        server_send(PACKET_TYPE_CONNECT_REJECTED,cli);
-                        remove_client(cli);
-                    }
-                    break;
-                }
+bool net_server_set_max_clients(int max_clients)
+{
+    if(max_clients <= 0 || max_clients > MAX_CLIENTS_LIMIT)
+    {
+        LOGN("Invalid client capacity %d (1-%d)", max_clients, MAX_CLIENTS_LIMIT);
+        return false;
+    }
 
-                bool is_latest = is_packet_id_greater(recv_pkt.hdr.id, cli->remote_latest_packet_id);
-                if(!is_latest)
-                {
-                    LOGN("Not latest packet from client. Ignoring...");
-                    break;
-                }
+    server.max_clients = max_clients;
+    return true;
+}
 
-                cli->remote_latest_packet_id = recv_pkt.hdr.id;
-                cli->time_of_latest_packet = timer_get_time();
+int net_server_start()
+{
+    LOGN("%s()", __func__);
 
-                LOGNV("%s() : %s", __func__, packet_type_to_str(recv_pkt.hdr.type));
+    // init
+    socket_initialize();
 
-                switch(recv_pkt.hdr.type)
-                {
+    // the receive and send threads get a core each, encoding takes the rest
+    if(server.num_workers <= 0)
+    {
+#if _WIN32
+        server.num_workers = 1;
+#else
+        server.num_workers = MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN) - 2);
+#endif
+    }
+    jobs_init(server.num_workers);
 
-                    case PACKET_TYPE_CONNECT_CHALLENGE_RESP:
-                    {
-                        cli->state = SENDING_CHALLENGE_RESPONSE;
-                        LOGI("Accept client: %d", cli->client_id);
-                        player_set_active(&players[cli->client_id],true);
+    // snapshot positions are quantised relative to the terrain, and the
+    // interest grid covers the same bounds
+    Vector3 bounds_min, bounds_max;
+    if(terrain_get_bounds(&bounds_min, &bounds_max))
+        snapshot_set_bounds((float*)&bounds_min, (float*)&bounds_max);
 
-                        server_send(PACKET_TYPE_CONNECT_ACCEPTED,cli);
-                        server_send(PACKET_TYPE_INIT, cli);
-                        server_send(PACKET_TYPE_STATE,cli);
+    if(!server_clients_create(server.max_clients > 0 ? server.max_clients : DEFAULT_MAX_CLIENTS))
+        return 1;
 
-                    } break;
+    int sock;
 
-                    case PACKET_TYPE_INPUT:
-                    {
-                        uint8_t _input_count = unpack_u8(&recv_pkt, &offset);
-                        for(int i = 0; i < _input_count; ++i)
-                        {
-                            // get input, copy into array
-                            unpack_bytes(&recv_pkt, (uint8_t*)&cli->net_player_inputs[cli->input_count++], sizeof(NetPlayerInput), &offset);
-                        }
-                    } break;
+    if(server.tick_rate <= 0.0)
+        server.tick_rate = TICK_RATE;
 
-                    case PACKET_TYPE_MESSAGE:
-                    {
-                    } break;
+    if(!lagcomp_init(&server.lagcomp, server.max_clients, server.tick_rate))
+        return 1;
 
-                    case PACKET_TYPE_SETTINGS:
-                    {
-                    } break;
+    connect_cookie_init_key();
 
-                    case PACKET_TYPE_PING:
-                    {
-                        server_send(PACKET_TYPE_PING, cli);
-                    } break;
+    // set timers
+    timer_set_fps(&server_timer,server.tick_rate);
+    timer_begin(&server_timer);
 
-                    case PACKET_TYPE_DISCONNECT:
-                    {
-                        remove_client(cli);
-                    } break;
+    LOGN("Creating socket.");
+    socket_create(&sock);
 
-                    default:
-                    break;
-                }
-            }
-        }
+    LOGN("Binding socket %u to any local ip on port %u.", sock, PORT);
+    socket_bind(sock, NULL, PORT);
+    server.info.socket = sock;
 
-        t1_g = timer_get_time();
-        double elapsed_time_g = t1_g - t0_g;
-        t0_g = t1_g;
+    bitpack_create(&server.bp, BITPACK_SIZE);
 
-        accum_g += elapsed_time_g;
-        double _dt = 1.0/TARGET_FPS;
-        while(accum_g >= _dt)
-        {
-            g_timer += _dt;
-            server_simulate(_dt);
-            accum_g -= _dt;
-        }
+    if(!server_events_init() || !server_pipeline_start())
+        return 1;
+
+    LOGN("Server Started with tick rate %f, %d encode workers.", server.tick_rate, jobs_worker_count());
+
+    double t0 = timer_get_time();
+    double accum = 0.0;
+    double time_of_last_stats = t0;
+
+    server.start_time = t0;
+    metrics.time_of_last_dump = t0;
+
+    const double dt = 1.0/server.tick_rate;
+
+    while(!atomic_load(&server.stop))
+    {
+        // handle connections, take inputs
+        server_process_received();
 
-        t1 = timer_get_time();
-        double elapsed_time = t1 - t0;
+        // replies to what was just received go out together
+        server_flush_frames();
+
+        double t1 = timer_get_time();
+        accum += t1 - t0;
         t0 = t1;
 
-        accum += elapsed_time;
+        // after a stall, catch up a few ticks and skip the rest rather
+        // than falling further behind simulating them
+        int ticks = (int)(accum / dt);
+        if(ticks > SERVER_MAX_CATCHUP_TICKS)
+        {
+            server.stats.skipped_ticks += ticks - SERVER_MAX_CATCHUP_TICKS;
+            accum -= (ticks - SERVER_MAX_CATCHUP_TICKS)*dt;
+            ticks = SERVER_MAX_CATCHUP_TICKS;
+        }
 
-        if(accum >= dt)
+        if(ticks > 0)
         {
-            // send state packet to all clients
+            for(int i = 0; i < ticks; ++i)
+            {
+                g_timer += dt;
+                server_simulate(dt);
+                accum -= dt;
+            }
+
+            // send state packet to all clients, once for however many ticks ran
             if(server.num_clients > 0)
             {
+                server_capture_snapshot();
+
                 // disconnect any client that hasn't sent a packet in DISCONNECTION_TIMEOUT
-                for(int i = 0; i < MAX_CLIENTS; ++i)
+                for(int i = 0; i < server.max_clients; ++i)
                 {
                     ClientInfo* cli = &server.clients[i];
 
@@ -834,12 +3379,48 @@ int net_server_start()
                     server_send(PACKET_TYPE_STATE,cli);
                 }
 
+                server_flush_frames();
+
                 // clear out any queued events
                 server.event_count = 0;
             }
-            accum = 0.0;
+
+            server_update_tick_stats(timer_get_time() - t1, ticks);
+        }
+
+        if(t1 - time_of_last_stats >= SERVER_STATS_PERIOD)
+        {
+            server_log_tick_stats();
+            time_of_last_stats = t1;
         }
 
-        timer_delay_us(1000); // 1ms delay to prevent cpu % from going nuts
+        if(t1 - metrics.time_of_last_dump >= METRICS_PERIOD)
+            server_dump_metrics(t1);
+
+        // sleep until the next packet or the next tick; without epoll,
+        // packets wait for the tick
+        server_wait_for_event(dt - accum);
     }
+
+    LOGN("Server stopping.");
+
+    server_pipeline_stop();
+    socket_close(server.info.socket);
+#if HAS_EPOLL
+    close(server.recv_fd);
+    close(server.timer_fd);
+    close(server.epoll_fd);
+#endif
+    bitpack_delete(&server.bp);
+    lagcomp_free(&server.lagcomp);
+    lagcomp_pose_free(&server.lag_pose);
+    server_clients_destroy();
+    server.stop = false;
+    return 0;
+}
+
+// Safe from a signal handler or another thread
+void net_server_stop()
+{
+    server.stop = true;
 }
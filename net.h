@@ -1,16 +1,20 @@
 #pragma once
 
 #include "socket.h"
+#include "player.h"
+#include "snapshot.h"
+#include "lagcomp.h"
 
 #define TICK_RATE 30.0f
 #define LOCAL_SERVER_IP "127.0.0.1"
 #define ONLINE_SERVER_IP "66.228.36.123"
 #define BITPACK_SIZE 32768
 
-#define MAX_CLIENTS 4
+#define DEFAULT_MAX_CLIENTS 4
+#define MAX_CLIENTS_LIMIT   4096
 
-#define FROM_SERVER 0xFF    //for messaging
-#define TO_ALL      0xFF    //for messaging
+#define FROM_SERVER 0xFFFF  //for messaging, above any client slot
+#define TO_ALL      0xFFFF  //for messaging, above any client slot
 
 #ifdef __GNUC__
 #define PACK( __Declaration__ ) __Declaration__ __attribute__((__packed__))
@@ -20,6 +24,16 @@
 #define PACK( __Declaration__ ) __pragma( pack(push, 1) ) __Declaration__ __pragma( pack(pop))
 #endif
 
+#define CACHE_LINE_SIZE 64
+
+#ifdef __GNUC__
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+#endif
+
+#ifdef _MSC_VER
+#define CACHE_ALIGNED __declspec(align(CACHE_LINE_SIZE))
+#endif
+
 #define CONN_RC_CHALLENGED    (-1)
 #define CONN_RC_INVALID_SALT  (-2)
 #define CONN_RC_REJECTED      (-3)
@@ -40,6 +54,7 @@ typedef enum
     PACKET_TYPE_SETTINGS,
     PACKET_TYPE_MESSAGE,
     PACKET_TYPE_ERROR,
+    PACKET_TYPE_BUNDLE, // several of the above in one datagram
     PACKET_TYPE_MAX,
 } PacketType;
 
@@ -90,13 +105,13 @@ PACK(struct Packet
 
 typedef struct Packet Packet;
 
-PACK(struct NetPlayerInput
-{
-    float delta_t;
-    uint32_t keys;
-});
+#define PACKET_HEADER_SIZE (sizeof(PacketHeader) + sizeof(uint32_t)) // hdr + data_len
 
-typedef struct NetPlayerInput NetPlayerInput;
+// Local player state predicted for an input
+typedef struct
+{
+    NetPlayerState player;
+} WorldState;
 
 //
 // Net Events
@@ -110,8 +125,8 @@ typedef enum
 
 typedef struct
 {
-    uint8_t to;
-    uint8_t from;
+    uint16_t to;
+    uint16_t from;
     char* msg;
 } NetEventMessage;
 
@@ -128,11 +143,42 @@ typedef struct
 
 extern char* server_ip_address;
 
+typedef struct
+{
+    uint64_t ticks;          // simulated
+    uint64_t catchup_ticks;  // run back to back to catch up
+    uint64_t skipped_ticks;  // dropped after a stall
+    uint64_t overruns;       // loop iterations whose work took longer than its ticks
+    double tick_time_avg;    // seconds of work per tick, smoothed
+    double tick_time_max;    // since the last stats log
+
+    uint64_t inputs_missing; // client ticks with no input buffered yet
+    uint64_t inputs_lost;    // gaps skipped in a client's input sequence
+    uint64_t inputs_late;    // arrived after their tick went ahead without them
+    uint64_t inputs_redundant; // copies of inputs already received
+
+    uint64_t recv_stalls;    // times the receive thread found its queue full
+    uint64_t states_oversized; // state packets over NET_MTU, not sent
+
+    uint64_t connect_challenges;        // connect requests answered
+    uint64_t connect_failed_challenges; // responses that didn't match their challenge
+} ServerTickStats;
+
 // Server
+bool net_server_set_max_clients(int max_clients); // call before net_server_start()
+void net_server_stop(); // net_server_start() returns once the threads are joined
+bool net_server_set_tick_rate(int tick_rate);     // Hz, call before net_server_start()
+bool net_server_set_worker_count(int num_workers); // encode threads, call before net_server_start()
+void net_server_set_interest_management(bool enabled); // on by default
+bool net_server_set_metrics_file(const char* path); // appends JSON lines every second, NULL to stop
+bool net_server_set_metrics_port(uint16_t port);    // sends the same lines to 127.0.0.1:port, 0 to stop
+void net_server_get_tick_stats(ServerTickStats* stats);
+double net_server_get_time();
+bool net_server_raycast(double time, const float origin[3], const float dir[3], float max_dist, int shooter, LagCompHit* hit);
 int net_server_start();
 bool net_server_add_event(NetEvent* event);
 
-void server_send_message(uint8_t to, uint8_t from, char* fmt, ...);
+void server_send_message(uint16_t to, uint16_t from, char* fmt, ...);
 bool server_process_command(char* argv[20], int argc, int client_id);
 
 // Client
@@ -148,11 +194,14 @@ int net_client_get_input_count();
 uint16_t net_client_get_latest_local_packet_id();
 bool net_client_add_player_input(NetPlayerInput* input);
 bool net_client_record_player_state(NetPlayerInput* input, WorldState* state);
+void net_client_interpolate(double dt);
+bool net_client_get_remote_player(int index, NetPlayerState* state);
 bool net_client_received_init_packet();
 bool net_client_is_connected();
 void net_client_disconnect();
 void net_client_send_settings();
 void net_client_send_inputs();
+bool net_client_process_packet(Packet* pkt, int len);
 bool net_client_set_server_ip(char* address);
 void net_client_get_server_ip_str(char* ip_str);
 int net_client_data_waiting();
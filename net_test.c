@@ -0,0 +1,1268 @@
+// Tests and benches for net.c, and the runner for every module's own tests.
+// Built as bin/rekt_test by build.sh. net.c is included rather than linked so
+// these can drive its internals: the client table, the frame builder and both
+// ends of the state and input streams.
+#include "net.c"
+
+double g_timer = 0.0;
+
+//
+// Fixture
+//
+
+// max_clients slots with the first num_connected connected from 10.0.x.x,
+// each with a player somewhere in a spread metre square around the origin,
+// walking at up to 5 m/s. Seeds rand() so runs compare.
+static bool fixture_create(int max_clients, int num_connected, float spread)
+{
+    if(!server_clients_create(max_clients))
+        return false;
+
+    bitpack_create(&server.bp, BITPACK_SIZE);
+    srand(1);
+
+    for(int i = 0; i < num_connected; ++i)
+    {
+        Address addr = {10, 0, (uint8_t)(i >> 8), (uint8_t)i, 27001};
+        ClientInfo* cli = server_alloc_client(&addr);
+        cli->state = CONNECTED;
+
+        Player* p = &players[cli->client_id];
+        p->pos.x = spread*((float)rand()/RAND_MAX - 0.5f);
+        p->pos.z = spread*((float)rand()/RAND_MAX - 0.5f);
+        p->vel.x = (rand() % 11) - 5.0f;
+        p->vel.z = (rand() % 11) - 5.0f;
+        p->angle_theta = (float)(rand() % 360);
+    }
+
+    return true;
+}
+
+static void fixture_destroy()
+{
+    bitpack_delete(&server.bp);
+    server_clients_destroy();
+}
+
+// A tick of everyone walking on and turning by turn degrees, then the
+// snapshot the server sends from
+static void fixture_step(int num_players, float turn)
+{
+    const float dt = 1.0f/TICK_RATE;
+
+    for(int i = 0; i < num_players; ++i)
+    {
+        Player* p = &players[i];
+        p->pos.x += p->vel.x*dt;
+        p->pos.z += p->vel.z*dt;
+        p->angle_theta = fmodf(p->angle_theta + turn, 360.0f);
+    }
+
+    server_capture_snapshot();
+}
+
+// As if cli got everything up to pkt, so its next state is a delta on pkt's
+static void fixture_ack(ClientInfo* cli, Packet* pkt)
+{
+    cli->remote_ack = pkt->hdr.id;
+    cli->remote_ack_bits = 0xFFFFFFFF;
+}
+
+// A challenge response from addr, for a request salted with salt, as a peer
+// that got the challenge sends it
+static void fixture_respond(Address* addr, uint64_t salt, Packet* pkt, BitPack* bp)
+{
+    ConnectResponsePayload payload = {.name = "peer"};
+    memcpy(payload.client_salt, &salt, 8);
+
+    uint8_t server_salt[8];
+    connect_cookie(addr, payload.client_salt, connect_cookie_bucket(), server_salt);
+
+    bitpack_reset(bp);
+    connect_response_write(bp, &payload);
+    payload_finish(bp, pkt, SALT_SIZE);
+    store_xor_salts(payload.client_salt, server_salt, pkt->data);
+    pkt->hdr.game_id = GAME_ID;
+    pkt->data_len = CONNECT_PACKET_SIZE;
+    pkt->hdr.type = PACKET_TYPE_CONNECT_CHALLENGE_RESP;
+    pkt->hdr.id = 1;
+    server_process_packet(addr, pkt, get_packet_size(pkt), timer_get_time());
+}
+
+// Back to a client that hasn't received anything
+static void fixture_client_reset()
+{
+    for(int i = 0; i < SNAPSHOT_RING_SIZE; ++i)
+        snapshot_free(&client.snapshots[i]);
+    client.latest_snapshot_id = 0;
+    client.info.remote_latest_packet_id = 0;
+    client.received_bits = 0;
+    interp_free(&client.interp);
+}
+
+//
+// Benches
+//
+
+static bool compare_address(Address* addr1, Address* addr2)
+{
+    return memcmp(addr1, addr2, sizeof(Address)) == 0;
+}
+
+// Replays packets from num_addresses peers through the connection table and
+// through a linear scan of the same slots
+static void bench_client_lookup(int num_addresses, int num_lookups)
+{
+    if(!fixture_create(num_addresses, num_addresses, 0.0f))
+        return;
+
+    Address* addrs = malloc(num_addresses*sizeof(Address));
+    for(int i = 0; i < num_addresses; ++i)
+        addrs[i] = server.clients[i].address;
+
+    int* order = malloc(num_lookups*sizeof(int));
+    for(int i = 0; i < num_lookups; ++i)
+        order[i] = rand() % num_addresses;
+
+    int found = 0;
+
+    double t0 = timer_get_time();
+    for(int i = 0; i < num_lookups; ++i)
+    {
+        ClientInfo* cli = NULL;
+        if(server_get_client(&addrs[order[i]], &cli) != -1)
+            found++;
+    }
+    double t_table = timer_get_time() - t0;
+
+    t0 = timer_get_time();
+    for(int i = 0; i < num_lookups; ++i)
+    {
+        for(int j = 0; j < server.max_clients; ++j)
+        {
+            if(compare_address(&server.clients[j].address, &addrs[order[i]]) && server.clients[j].state != DISCONNECTED)
+            {
+                found++;
+                break;
+            }
+        }
+    }
+    double t_linear = timer_get_time() - t0;
+
+    LOGN("Client lookup (%d addresses, %d lookups, %d found)", num_addresses, num_lookups, found);
+    LOGN("  table:  %8.2f ns/lookup", 1000000000.0*t_table/num_lookups);
+    LOGN("  linear: %8.2f ns/lookup", 1000000000.0*t_linear/num_lookups);
+
+    free(order);
+    free(addrs);
+    fixture_destroy();
+}
+
+// Encodes a state packet for every client through the job workers, for
+// 4..512 moving players on 1..max_workers threads. Each client acks
+// everything, so packets are deltas against the previous tick.
+static void bench_encode(int max_workers)
+{
+    const int ticks = 60;
+    int prev_workers = jobs_worker_count();
+
+    LOGN("State encode (%d ticks per run)", ticks);
+
+    for(int workers = 1; workers <= max_workers; workers *= 2)
+    {
+        jobs_init(workers);
+
+        for(int num_clients = 4; num_clients <= 512; num_clients *= 2)
+        {
+            if(!fixture_create(num_clients, num_clients, 200.0f))
+                return;
+
+            FlushJob* jobs = server.flush_jobs;
+            double encode_time = 0.0;
+            uint64_t bytes = 0;
+
+            for(int t = 0; t < ticks; ++t)
+            {
+                fixture_step(num_clients, 3.0f);
+
+                for(int i = 0; i < num_clients; ++i)
+                {
+                    client_cold(&server.clients[i])->frame.want_state = true;
+                    jobs[i].cli = &server.clients[i];
+                }
+
+                double t0 = timer_get_time();
+                jobs_parallel_for(server_flush_job, jobs, num_clients, ENCODE_GRAIN);
+                encode_time += timer_get_time() - t0;
+
+                for(int i = 0; i < num_clients; ++i)
+                {
+                    uint8_t* src = server.encode_scratch[jobs[i].worker].out + jobs[i].offset;
+                    for(int j = 0; j < jobs[i].count; ++j)
+                    {
+                        Packet* pkt = (Packet*)src;
+                        bytes += get_packet_size(pkt);
+                        fixture_ack(&server.clients[i], pkt);
+                        src += (get_packet_size(pkt) + 7) & ~7;
+                    }
+                }
+
+                for(int i = 0; i < server.encode_scratch_count; ++i)
+                    server.encode_scratch[i].out_used = 0;
+            }
+
+            LOGN("  %2d workers %4d clients: %9.1f us/tick %7.2f us/client %6.0f B/client",
+                 workers, num_clients, 1000000.0*encode_time/ticks,
+                 1000000.0*encode_time/ticks/num_clients, (double)bytes/ticks/num_clients);
+
+            fixture_destroy();
+        }
+    }
+
+    jobs_init(prev_workers);
+}
+
+// State packet bytes per client as the client count grows, with players
+// spread over the default 512m map, sending everyone to everyone and then
+// with interest management. Every client acks everything. With it on,
+// also shows how often a player gets fresh updates by distance from the
+// viewer.
+static void bench_interest(int max_clients)
+{
+    const int ticks = 90;
+    const float bands[] = {32.0f, 64.0f, 96.0f, INTEREST_RADIUS};
+    const int num_bands = sizeof(bands)/sizeof(bands[0]);
+    bool prev = server.interest;
+
+    LOGN("Interest management (%d ticks per run, %d byte budget, %.0fm radius)", ticks, STATE_BUDGET_BYTES, INTEREST_RADIUS);
+
+    for(int num_clients = 16; num_clients <= max_clients; num_clients *= 2)
+    {
+        for(int on = 0; on <= 1; ++on)
+        {
+            server.interest = on;
+            if(!fixture_create(num_clients, num_clients, 500.0f))
+                return;
+
+            uint64_t bytes = 0;
+            uint64_t fresh[4] = {0}, shown[4] = {0};
+            double encode_time = 0.0;
+            Packet* pkt = malloc(sizeof(Packet));
+
+            for(int t = 0; t < ticks; ++t)
+            {
+                fixture_step(num_clients, 1.0f);
+
+                for(int i = 0; i < num_clients; ++i)
+                {
+                    ClientInfo* cli = &server.clients[i];
+                    pkt->hdr.id = cli->local_latest_packet_id++;
+
+                    double t0 = timer_get_time();
+                    bool built = server_build_state_packet(cli, pkt, 0, &server.encode_scratch[0]);
+                    encode_time += timer_get_time() - t0;
+                    if(!built)
+                        continue;
+
+                    bytes += get_packet_size(pkt);
+                    fixture_ack(cli, pkt);
+
+                    ClientSnapshot* cs = client_snapshot_get(cli, server.snapshot_id);
+                    SentEntity* sent = (SentEntity*)cs->data;
+                    for(int k = 0; k < (int)(cs->len/sizeof(SentEntity)); ++k)
+                    {
+                        if(sent[k].index == i)
+                            continue;
+
+                        Player* a = &players[i];
+                        Player* b = &players[sent[k].index];
+                        float d = sqrtf((a->pos.x - b->pos.x)*(a->pos.x - b->pos.x) + (a->pos.z - b->pos.z)*(a->pos.z - b->pos.z));
+
+                        int band = 0;
+                        while(band < num_bands - 1 && d > bands[band])
+                            band++;
+                        shown[band]++;
+                        fresh[band] += (sent[k].source_id == server.snapshot_id);
+                    }
+                }
+            }
+
+            LOGN("  %4d clients, interest %-3s: %7.0f B/client/tick  %6.2f us/client",
+                 num_clients, on ? "on" : "off", (double)bytes/ticks/num_clients,
+                 1000000.0*encode_time/ticks/num_clients);
+
+            if(on)
+            {
+                char line[256];
+                int n = 0;
+                for(int b = 0; b < num_bands; ++b)
+                {
+                    n += snprintf(line + n, sizeof(line) - n, "  <%3.0fm %5.1f Hz",
+                                  bands[b], shown[b] ? TICK_RATE*(double)fresh[b]/shown[b] : 0.0);
+                }
+                LOGN("      updates by distance:%s", line);
+            }
+
+            free(pkt);
+            fixture_destroy();
+        }
+    }
+
+    server.interest = prev;
+}
+
+//
+// Tests
+//
+
+// Floods the connect path with requests and forged responses from
+// num_requests spoofed loopback addresses, then connects a few peers that
+// answer their challenge. Challenges are really sent, so the timings include
+// the send.
+static bool test_connect_flood(int num_requests)
+{
+    const int max_clients = 64;
+    const int num_valid = 16;
+
+    if(!fixture_create(max_clients, 0, 0.0f))
+        return false;
+
+    connect_cookie_init_key();
+    socket_initialize();
+    socket_create(&server.info.socket);
+
+    Packet* pkt = calloc(1, sizeof(Packet));
+    pkt->hdr.game_id = GAME_ID;
+    pkt->data_len = CONNECT_PACKET_SIZE;
+
+    ServerTickStats prev_stats = server.stats;
+
+    double t0 = timer_get_time();
+    for(int i = 0; i < num_requests; ++i)
+    {
+        Address addr = {127, (uint8_t)(i >> 16), (uint8_t)(i >> 8), (uint8_t)i, (uint16_t)(1024 + rand() % 60000)};
+        uint64_t salt = rand64();
+        memcpy(pkt->data, &salt, 8);
+        pkt->hdr.type = PACKET_TYPE_CONNECT_REQUEST;
+        server_process_packet(&addr, pkt, get_packet_size(pkt), timer_get_time());
+    }
+    double t_request = timer_get_time() - t0;
+    int used_after_requests = server.max_clients - server.free_count;
+
+    // responses that guess at the server salt
+    BitPack bp;
+    bitpack_create(&bp, BITPACK_SIZE);
+
+    t0 = timer_get_time();
+    for(int i = 0; i < num_requests; ++i)
+    {
+        Address addr = {127, (uint8_t)(i >> 16), (uint8_t)(i >> 8), (uint8_t)i, (uint16_t)(1024 + rand() % 60000)};
+        ConnectResponsePayload payload = {.name = "flood"};
+        uint64_t salt = rand64(), guess = rand64();
+        memcpy(payload.client_salt, &salt, 8);
+
+        bitpack_reset(&bp);
+        connect_response_write(&bp, &payload);
+        payload_finish(&bp, pkt, SALT_SIZE);
+        memcpy(pkt->data, &guess, 8);
+        pkt->data_len = CONNECT_PACKET_SIZE;
+        pkt->hdr.type = PACKET_TYPE_CONNECT_CHALLENGE_RESP;
+        server_process_packet(&addr, pkt, get_packet_size(pkt), timer_get_time());
+    }
+    double t_response = timer_get_time() - t0;
+    int used_after_forged = server.max_clients - server.free_count;
+
+    // peers that got their challenge
+    for(int i = 0; i < num_valid; ++i)
+    {
+        Address addr = {127, 1, 0, (uint8_t)i, 27001};
+        fixture_respond(&addr, rand64(), pkt, &bp);
+    }
+    int used_after_valid = server.max_clients - server.free_count;
+    int connected = 0;
+    for(int i = 0; i < server.max_clients; ++i)
+        connected += (server.clients[i].state == CONNECTED);
+
+    bool ok = used_after_requests == 0 && used_after_forged == 0 && used_after_valid == num_valid && connected == num_valid;
+
+    LOGN("Connect flood (%d requests, %d forged responses, %d valid, %d slots)", num_requests, num_requests, num_valid, max_clients);
+    LOGN("  request:  %8.2f ns, slots used %d, challenges %llu", 1000000000.0*t_request/num_requests, used_after_requests,
+         (unsigned long long)(server.stats.connect_challenges - prev_stats.connect_challenges));
+    LOGN("  forged:   %8.2f ns, slots used %d, failed %llu", 1000000000.0*t_response/num_requests, used_after_forged,
+         (unsigned long long)(server.stats.connect_failed_challenges - prev_stats.connect_failed_challenges));
+    LOGN("  valid:    slots used %d, connected %d", used_after_valid, connected);
+    LOGN("%s", ok ? "PASSED" : "FAILED");
+
+    bitpack_delete(&bp);
+    free(pkt);
+    socket_close(server.info.socket);
+    server.info.socket = 0;
+    fixture_destroy();
+    return ok;
+}
+
+// A peer that restarts and handshakes again from the same address and port
+// starts a fresh connection, where its inputs count from 1 again. A resent
+// response from the same handshake keeps the connection it has.
+static bool test_reconnect()
+{
+    if(!fixture_create(4, 0, 0.0f))
+        return false;
+
+    connect_cookie_init_key();
+    socket_initialize();
+    socket_create(&server.info.socket);
+
+    Packet* pkt = calloc(1, sizeof(Packet));
+    BitPack bp;
+    bitpack_create(&bp, BITPACK_SIZE);
+    Address addr = {127, 1, 0, 1, 27001};
+    ClientInfo* cli = NULL;
+
+    fixture_respond(&addr, 1, pkt, &bp);
+    bool connected = server_get_client(&addr, &cli) != -1 && cli->state == CONNECTED;
+    if(connected)
+        cli->last_input_seq = 5000;
+
+    fixture_respond(&addr, 1, pkt, &bp);
+    bool kept = connected && server_get_client(&addr, &cli) != -1 && cli->last_input_seq == 5000;
+
+    fixture_respond(&addr, 2, pkt, &bp);
+    bool fresh = server_get_client(&addr, &cli) != -1 && cli->state == CONNECTED && cli->last_input_seq == 0 && server.num_clients == 1;
+
+    bool ok = connected && kept && fresh;
+
+    LOGN("Reconnect (resent response %s, new handshake %s)", kept ? "kept the connection" : "lost it", fresh ? "started over" : "didn't start over");
+    LOGN("%s", ok ? "PASSED" : "FAILED");
+
+    bitpack_delete(&bp);
+    free(pkt);
+    socket_close(server.info.socket);
+    server.info.socket = 0;
+    fixture_destroy();
+    return ok;
+}
+
+// A frame whose messages leave no room for the state: the messages go out
+// alone under their own type and the state follows in its own datagram with
+// the next packet id, which the client decodes. Then a small message and the
+// state share a bundle.
+static bool test_frame_spill()
+{
+    const int num_players = 16;
+
+    if(!fixture_create(num_players, num_players, 50.0f))
+        return false;
+
+    fixture_step(num_players, 0.0f);
+
+    static uint8_t msg[NET_MTU - 40];
+    static Packet pkt;
+    ClientInfo* cli = &server.clients[0];
+    EncodeScratch* es = &server.encode_scratch[0];
+
+    server_frame_append(cli, PACKET_TYPE_MESSAGE, msg, sizeof(msg));
+    client_cold(cli)->frame.want_state = true;
+    uint16_t first_id = cli->local_latest_packet_id;
+    int count = server_build_frame(cli, &pkt, es);
+
+    Packet* spill = &es->spill;
+    ClientSnapshot* cs = client_snapshot_get(cli, server.snapshot_id);
+
+    bool ok = count == 2
+           && pkt.hdr.type == PACKET_TYPE_MESSAGE && pkt.hdr.id == first_id && get_packet_size(&pkt) <= NET_MTU
+           && spill->hdr.type == PACKET_TYPE_STATE && spill->hdr.id == (uint16_t)(first_id + 1) && get_packet_size(spill) <= NET_MTU
+           && cs && cs->packet_id == spill->hdr.id
+           && net_client_process_packet(spill, get_packet_size(spill));
+    PacketType first_type = pkt.hdr.type;
+    int first_size = get_packet_size(&pkt);
+
+    server_frame_append(cli, PACKET_TYPE_MESSAGE, msg, 10);
+    client_cold(cli)->frame.want_state = true;
+    int bundled = server_build_frame(cli, &pkt, es);
+
+    ok &= bundled == 1 && pkt.hdr.type == PACKET_TYPE_BUNDLE && get_packet_size(&pkt) <= NET_MTU;
+
+    LOGN("Frame spill (%d B of messages, %d players)", (int)sizeof(msg), num_players);
+    LOGN("  %d datagrams: %s %d B id %u, %s %d B id %u; then %d, %s %d B",
+         count, packet_type_to_str(first_type), first_size, first_id,
+         packet_type_to_str(spill->hdr.type), get_packet_size(spill), spill->hdr.id,
+         bundled, packet_type_to_str(pkt.hdr.type), get_packet_size(&pkt));
+    LOGN("%s", ok ? "PASSED" : "FAILED");
+
+    fixture_client_reset();
+    fixture_destroy();
+    return ok;
+}
+
+// Simulates num_players moving around for a few seconds and streams the world
+// to one client through the delta encoder, with acks arriving lag_ticks late and
+// loss_pct percent of state packets dropped. Verifies the client reconstructs
+// every snapshot exactly and prints bytes per client per second against sending
+// full snapshots.
+static bool test_snapshot(int num_players, int lag_ticks, int loss_pct)
+{
+    if(!fixture_create(num_players, num_players, 200.0f))
+        return false;
+
+    ClientInfo* cli = &server.clients[0];
+
+    const int seconds = 10;
+    const int ticks = seconds*TICK_RATE;
+    const float dt = 1.0f/TICK_RATE;
+
+    bool* delivered = calloc(ticks, sizeof(bool));
+    uint16_t* packet_ids = calloc(ticks, sizeof(uint16_t));
+    uint32_t delta_bytes = 0;
+    uint32_t full_bytes = 0;
+    int mismatches = 0;
+    int truncated = 0; // accepted cut short
+    int dropped = 0;
+    Snapshot expected = {0};
+
+    for(int t = 0; t < ticks; ++t)
+    {
+        // a quarter of the players run, a quarter only look around, the rest idle
+        for(int i = 0; i < num_players; ++i)
+        {
+            Player* p = &players[i];
+            if(i % 4 == 0)
+            {
+                p->vel.x = 5.0f*cosf(t*0.05f + i);
+                p->vel.z = 5.0f*sinf(t*0.05f + i);
+                p->pos.x += p->vel.x*dt;
+                p->pos.z += p->vel.z*dt;
+                p->angle_theta = fmodf(p->angle_theta + 3.0f, 360.0f);
+            }
+            else if(i % 4 == 1)
+            {
+                p->angle_omega = 30.0f*sinf(t*0.1f);
+            }
+        }
+
+        server_capture_snapshot();
+
+        // acks from the client arrive lag_ticks after the packets they cover
+        int acked = t - 1 - lag_ticks;
+        while(acked >= 0 && !delivered[acked])
+            acked--;
+
+        if(acked >= 0)
+        {
+            cli->remote_ack = packet_ids[acked];
+            cli->remote_ack_bits = 0;
+            for(int b = 1; b <= 32 && acked - b >= 0; ++b)
+            {
+                if(delivered[acked - b])
+                    cli->remote_ack_bits |= (uint32_t)1 << (b - 1);
+            }
+        }
+
+        Packet pkt = {0};
+        pkt.hdr.id = cli->local_latest_packet_id++;
+        packet_ids[t] = pkt.hdr.id;
+        server_build_state_packet(cli, &pkt, 0, &server.encode_scratch[0]);
+        delta_bytes += get_packet_size(&pkt);
+
+        bitpack_reset(&server.bp);
+        snapshot_write(&server.bp, server_get_snapshot(server.snapshot_id), NULL);
+        bitpack_flush(&server.bp);
+        full_bytes += PACKET_HEADER_SIZE + server.bp.words_written*4;
+
+        if(rand() % 100 < loss_pct)
+        {
+            dropped++;
+            continue;
+        }
+
+        delivered[t] = true;
+
+        // cut short, it must be refused rather than read as trailing zeros
+        if(t % 10 == 0)
+        {
+            Packet cut = pkt;
+            cut.data_len -= 4;
+            if(client_process_state_packet(&cut))
+                truncated++;
+        }
+
+        // what the server thinks the client now has
+        if(!server_build_client_view(&expected, client_snapshot_get(cli, server.snapshot_id)))
+            mismatches++;
+        else if(!client_process_state_packet(&pkt) || !snapshot_equals(&client.snapshots[client.latest_snapshot_id % SNAPSHOT_RING_SIZE], &expected))
+            mismatches++;
+    }
+
+    LOGN("Snapshot test (%d players, %d ticks lag, %d%% loss, %d dropped, interest management %s)",
+         num_players, lag_ticks, loss_pct, dropped, server.interest ? "on" : "off");
+    LOGN("  full:  %8.1f B/client/s", (double)full_bytes/seconds);
+    LOGN("  delta: %8.1f B/client/s", (double)delta_bytes/seconds);
+    LOGN("  mismatches: %d, truncated accepted: %d", mismatches, truncated);
+    LOGN("%s", mismatches == 0 && truncated == 0 ? "PASSED" : "FAILED");
+
+    fixture_client_reset();
+    snapshot_free(&expected);
+
+    free(delivered);
+    free(packet_ids);
+    fixture_destroy();
+    return mismatches == 0 && truncated == 0;
+}
+
+// Streams a client's inputs to the server over a link delivering lag_ticks + 1
+// ticks later each way, with loss_pct percent of packets (and acks) dropped, one
+// input packet and one simulated input per tick. Checks every input the
+// server simulates matches what the client sent for that seq, and counts
+// the inputs the server never got.
+#define INPUT_TEST_WORDS 64
+
+static bool test_input(int lag_ticks, int loss_pct)
+{
+    if(!fixture_create(1, 1, 0.0f))
+        return false;
+
+    ClientInfo* cli = &server.clients[0];
+
+    memset(client.history, 0, sizeof(client.history));
+    client.input_seq = 0;
+    client.server_input_seq = 0;
+    client.input_count = 0;
+
+    const int ticks = 60*TICK_RATE;
+    int slots = lag_ticks + 1;
+
+    // in flight, indexed by tick % slots
+    uint32_t (*packets)[INPUT_TEST_WORDS] = calloc(slots, sizeof(*packets));
+    int* packet_len = calloc(slots, sizeof(int));
+    int* acks = calloc(slots, sizeof(int)); // -1 if lost
+
+    uint64_t bytes = 0;
+    int sent = 0, dropped = 0, simulated = 0, mismatches = 0;
+    ServerTickStats prev_stats = server.stats;
+
+    NetPlayerInput input = {0};
+
+    for(int t = 0; t < ticks + slots; ++t)
+    {
+        int slot = t % slots;
+
+        if(t >= slots)
+        {
+            // arrivals from the last time round
+            if(packet_len[slot] > 0)
+            {
+                BitPack bp;
+                bitpack_attach(&bp, packets[slot], packet_len[slot]);
+                if(!server_read_inputs(cli, &bp))
+                    mismatches++;
+            }
+            if(acks[slot] >= 0)
+                client.server_input_seq = (uint16_t)acks[slot];
+
+            NetPlayerInput* in = server_next_input(cli);
+            if(in)
+            {
+                PredictionEntry* e = &client.history[cli->last_input_seq % PREDICTION_HISTORY];
+                if(in->keys != e->input.keys || in->angle_theta != e->input.angle_theta || in->angle_omega != e->input.angle_omega)
+                    mismatches++;
+                simulated++;
+            }
+        }
+
+        packet_len[slot] = 0;
+        acks[slot] = (rand() % 100 < loss_pct) ? -1 : cli->last_input_seq;
+
+        if(t >= ticks)
+            continue;
+
+        // keys held for a while, the view turning most ticks
+        if(rand() % 20 == 0)
+            input.keys = rand() & ((1 << PLAYER_ACTION_MAX) - 1);
+        if(rand() % 10 < 7)
+        {
+            input.angle_theta = fmodf(input.angle_theta + (rand() % 100 - 50)*0.05f, 360.0f);
+            input.angle_omega = fmaxf(-89.0f, fminf(89.0f, input.angle_omega + (rand() % 100 - 50)*0.02f));
+        }
+
+        NetPlayerInput queued = input;
+        net_client_add_player_input(&queued);
+
+        BitPack bp;
+        bitpack_attach(&bp, packets[slot], sizeof(packets[slot]));
+        bitpack_reset(&bp);
+        client_write_inputs(&bp);
+        bitpack_flush(&bp);
+
+        bytes += PACKET_HEADER_SIZE + SALT_SIZE + bp.words_written*4;
+        sent++;
+
+        if(rand() % 100 < loss_pct)
+            dropped++;
+        else
+            packet_len[slot] = bp.words_written*4;
+    }
+
+    int single_bytes = PACKET_HEADER_SIZE + SALT_SIZE + 4*((input_header_MAX_BITS + net_player_input_MAX_BITS + 31)/32);
+
+    LOGN("Input test (%d ticks lag, %d%% loss, %d of %d packets dropped)", lag_ticks, loss_pct, dropped, sent);
+    LOGN("  %.1f B/packet (%d B with one input each), %d simulated, %llu lost, %llu waited for, %d mismatches",
+         (double)bytes/sent, single_bytes, simulated,
+         (unsigned long long)(server.stats.inputs_lost - prev_stats.inputs_lost),
+         (unsigned long long)(server.stats.inputs_missing - prev_stats.inputs_missing), mismatches);
+    LOGN("%s", mismatches == 0 ? "PASSED" : "FAILED");
+
+    free(packets);
+    free(packet_len);
+    free(acks);
+    fixture_destroy();
+    return mismatches == 0;
+}
+
+//
+// Loopback harness
+//
+// Clients of our own, since this tree has no client connect: each does the
+// handshake, sends an input every tick with the redundancy of
+// client_write_inputs() and acks everything it receives. They measure rtt
+// and loss the way the server does, with a MetricsConn.
+
+#define LOOPBACK_RETRY 0.5 // seconds before an unanswered connect request is resent
+
+typedef struct
+{
+    int socket;
+    bool connected;
+    uint8_t client_salt[8];
+    uint8_t xor_salts[8];
+    double time_of_last_request;
+    double connect_time; // seconds from the first request to accepted
+    double tick_rate;    // Hz, the server's from the accept
+    double next_input;
+
+    uint16_t local_packet_id;
+    uint16_t remote_latest_packet_id;
+    uint32_t received_bits;
+    bool received_any;
+
+    uint16_t input_seq;        // newest sent
+    uint16_t server_input_seq; // newest the server has simulated
+    NetPlayerInput inputs[PREDICTION_HISTORY];
+
+    MetricsConn metrics;
+    uint64_t states;
+    uint64_t stale; // arrived after a newer packet, or twice
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} LoopbackClient;
+
+static void loopback_send(LoopbackClient* lc, Address* to, Packet* pkt, double now)
+{
+    pkt->hdr.game_id = GAME_ID;
+    pkt->hdr.id = ++lc->local_packet_id;
+    pkt->hdr.ack = lc->remote_latest_packet_id;
+    pkt->hdr.ack_bitfield = lc->received_bits;
+
+    lc->bytes_out += socket_sendto(lc->socket, to, (uint8_t*)pkt, get_packet_size(pkt));
+    metrics_conn_sent(&lc->metrics, pkt->hdr.id, now);
+}
+
+static void loopback_send_request(LoopbackClient* lc, Address* to, Packet* pkt, double now)
+{
+    // no packet id, it's answered before there's a connection to ack it
+    memset(pkt, 0, PACKET_HEADER_SIZE + CONNECT_PACKET_SIZE);
+    pkt->hdr.game_id = GAME_ID;
+    pkt->hdr.type = PACKET_TYPE_CONNECT_REQUEST;
+    memcpy(pkt->data, lc->client_salt, SALT_SIZE);
+    pkt->data_len = CONNECT_PACKET_SIZE;
+
+    lc->bytes_out += socket_sendto(lc->socket, to, (uint8_t*)pkt, get_packet_size(pkt));
+    lc->time_of_last_request = now;
+}
+
+static void loopback_send_response(LoopbackClient* lc, int index, Address* to, Packet* pkt, BitPack* bp, double now)
+{
+    ConnectResponsePayload payload = {0};
+    memcpy(payload.client_salt, lc->client_salt, 8);
+    snprintf(payload.name, sizeof(payload.name), "loopback%d", index);
+
+    memset(pkt, 0, PACKET_HEADER_SIZE + CONNECT_PACKET_SIZE);
+    pkt->hdr.type = PACKET_TYPE_CONNECT_CHALLENGE_RESP;
+
+    bitpack_reset(bp);
+    connect_response_write(bp, &payload);
+    payload_finish(bp, pkt, SALT_SIZE);
+    memcpy(pkt->data, lc->xor_salts, SALT_SIZE);
+    pkt->data_len = CONNECT_PACKET_SIZE;
+
+    loopback_send(lc, to, pkt, now);
+}
+
+static void loopback_send_inputs(LoopbackClient* lc, Address* to, Packet* pkt, BitPack* bp, double now)
+{
+    // keep turning, change keys now and then
+    NetPlayerInput* prev = &lc->inputs[lc->input_seq % PREDICTION_HISTORY];
+    lc->input_seq++;
+    NetPlayerInput* input = &lc->inputs[lc->input_seq % PREDICTION_HISTORY];
+    *input = *prev;
+    if(rand() % 30 == 0)
+        input->keys = (uint32_t)rand() & ((1 << PLAYER_ACTION_MAX) - 1);
+    input->angle_theta = fmodf(input->angle_theta + 2.0f, 360.0f);
+    input->delta_t = (float)(1.0/lc->tick_rate);
+    client_quantize_input(input);
+
+    int unacked = (uint16_t)(lc->input_seq - lc->server_input_seq);
+    int count = MIN(INPUT_REDUNDANCY, unacked);
+
+    InputHeaderPayload hdr = {
+        .seq = (uint16_t)(lc->input_seq - count + 1),
+        .count = count
+    };
+
+    bitpack_reset(bp);
+    input_header_write(bp, &hdr);
+    for(int i = 0; i < count; ++i)
+    {
+        NetPlayerInput* in = &lc->inputs[(uint16_t)(hdr.seq + i) % PREDICTION_HISTORY];
+        if(i > 0)
+            net_player_input_write_delta(bp, in, &lc->inputs[(uint16_t)(hdr.seq + i - 1) % PREDICTION_HISTORY]);
+        else
+            net_player_input_write(bp, in);
+    }
+    bitpack_write(bp, CHANNEL_COUNT_BITS, 0); // no reliable messages
+
+    pkt->hdr.type = PACKET_TYPE_INPUT;
+    memcpy(pkt->data, lc->xor_salts, SALT_SIZE);
+    if(!payload_finish(bp, pkt, SALT_SIZE))
+        return;
+
+    loopback_send(lc, to, pkt, now);
+}
+
+static void loopback_process_entry(LoopbackClient* lc, Packet* pkt, double now)
+{
+    switch(pkt->hdr.type)
+    {
+        case PACKET_TYPE_CONNECT_ACCEPTED:
+        case PACKET_TYPE_STATE: // the accept may have been lost
+        {
+            if(!lc->connected)
+            {
+                lc->connected = true;
+                lc->connect_time = now - lc->connect_time;
+                lc->next_input = now;
+            }
+
+            if(pkt->hdr.type == PACKET_TYPE_CONNECT_ACCEPTED)
+            {
+                BitPack bp;
+                ConnectAcceptedPayload payload;
+                payload_attach(&bp, pkt, 0);
+                connect_accepted_read(&bp, &payload);
+                if(bp.overflow == BITPACK_OK && payload.tick_rate > 0)
+                    lc->tick_rate = payload.tick_rate;
+            }
+            else
+            {
+                BitPack bp;
+                payload_attach(&bp, pkt, 0);
+                uint16_t acked_input_seq = (uint16_t)bitpack_read(&bp, 16);
+                if(is_packet_id_greater(acked_input_seq, lc->server_input_seq))
+                    lc->server_input_seq = acked_input_seq;
+                lc->states++;
+            }
+        } break;
+
+        default:
+        break;
+    }
+}
+
+static void loopback_receive(LoopbackClient* lc, int index, Address* server_addr, Packet* pkt, int len, Packet* entry, Packet* out, BitPack* bp, double now)
+{
+    if(!validate_packet_format(pkt, len))
+        return;
+
+    lc->bytes_in += len;
+
+    // sent outside the connection's packet ids
+    if(pkt->hdr.type == PACKET_TYPE_CONNECT_CHALLENGE)
+    {
+        BitPack in;
+        ConnectChallengePayload payload;
+        payload_attach(&in, pkt, 0);
+        connect_challenge_read(&in, &payload);
+
+        if(!lc->connected && memcmp(payload.client_salt, lc->client_salt, 8) == 0)
+        {
+            store_xor_salts(lc->client_salt, payload.server_salt, lc->xor_salts);
+            loopback_send_response(lc, index, server_addr, out, bp, now);
+        }
+        return;
+    }
+
+    if(pkt->hdr.type == PACKET_TYPE_CONNECT_REJECTED)
+    {
+        BitPack in;
+        ReasonPayload payload;
+        payload_attach(&in, pkt, 0);
+        reason_read(&in, &payload);
+        LOGN("Loopback client %d rejected, reason %u", index, payload.reason);
+        return;
+    }
+
+    uint16_t id = pkt->hdr.id;
+    if(!lc->received_any)
+    {
+        lc->received_any = true;
+        lc->remote_latest_packet_id = id - 1;
+    }
+    else if(id == lc->remote_latest_packet_id || !is_packet_id_greater(id, lc->remote_latest_packet_id))
+    {
+        lc->stale++;
+        return;
+    }
+
+    metrics_conn_received(&lc->metrics, id, lc->remote_latest_packet_id);
+    track_received_packet(id, &lc->remote_latest_packet_id, &lc->received_bits);
+    metrics_conn_ack(&lc->metrics, pkt->hdr.ack, pkt->hdr.ack_bitfield, now);
+
+    if(pkt->hdr.type != PACKET_TYPE_BUNDLE)
+    {
+        loopback_process_entry(lc, pkt, now);
+        return;
+    }
+
+    int offset = 0;
+    while(bundle_next(pkt, &offset, entry))
+        loopback_process_entry(lc, entry, now);
+}
+
+static void* loopback_server_thread(void* arg)
+{
+    (void)arg;
+    net_server_start();
+    return NULL;
+}
+
+// Runs the server on its own thread with num_clients loopback clients
+// sending to it for the given seconds, all through link (NULL for a clean
+// network), then stops it. Passes if every client got connected.
+static bool test_loopback(int num_clients, double seconds, const LinkConditioner* link)
+{
+    if(!net_server_set_max_clients(num_clients))
+        return false;
+
+    socket_initialize();
+    if(link && !socket_set_link_conditioner(link))
+        return false;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, loopback_server_thread, NULL) != 0)
+    {
+        LOGN("Failed to start the loopback server");
+        return false;
+    }
+
+    LoopbackClient* clients = calloc(num_clients, sizeof(LoopbackClient));
+    Packet* pkt = calloc(3, sizeof(Packet)); // received, bundle entry, to send
+    SocketRecvSlot slots[SOCKET_RECV_BATCH_MAX];
+    uint8_t* recv_data = malloc(SOCKET_RECV_BATCH_MAX*MAX_PACKET_SIZE);
+    BitPack bp;
+    bitpack_create(&bp, BITPACK_SIZE);
+
+    for(int i = 0; i < SOCKET_RECV_BATCH_MAX; ++i)
+        slots[i].data = recv_data + i*MAX_PACKET_SIZE;
+
+    for(int i = 0; i < num_clients; ++i)
+    {
+        LoopbackClient* lc = &clients[i];
+        socket_create(&lc->socket);
+        socket_bind(lc->socket, NULL, 0);
+        uint64_t salt = rand64();
+        memcpy(lc->client_salt, &salt, 8);
+        metrics_conn_reset(&lc->metrics);
+    }
+
+    Address server_addr = {127, 0, 0, 1, PORT};
+    for(int i = 0; i < 5000 && !pipeline.running; ++i)
+        timer_delay_us(1000);
+
+    ServerTickStats prev_stats;
+    net_server_get_tick_stats(&prev_stats);
+
+    const double dt = 1.0/TICK_RATE;
+    double t0 = timer_get_time();
+    double next_tick = t0;
+
+    for(int i = 0; i < num_clients; ++i)
+    {
+        clients[i].connect_time = t0;
+        clients[i].time_of_last_request = t0 - LOOPBACK_RETRY;
+        clients[i].tick_rate = TICK_RATE; // until an accept says otherwise
+    }
+
+    for(;;)
+    {
+        double now = timer_get_time();
+        if(now - t0 >= seconds)
+            break;
+
+        for(int i = 0; i < num_clients; ++i)
+        {
+            LoopbackClient* lc = &clients[i];
+            int count;
+            do
+            {
+                count = socket_recvfrom_batch(lc->socket, slots, SOCKET_RECV_BATCH_MAX);
+                for(int j = 0; j < count; ++j)
+                {
+                    memcpy(&pkt[0], slots[j].data, MIN(slots[j].len, (int)sizeof(Packet)));
+                    loopback_receive(lc, i, &server_addr, &pkt[0], slots[j].len, &pkt[1], &pkt[2], &bp, now);
+                }
+            } while(count == SOCKET_RECV_BATCH_MAX);
+        }
+
+        if(now >= next_tick)
+        {
+            for(int i = 0; i < num_clients; ++i)
+            {
+                LoopbackClient* lc = &clients[i];
+                if(!lc->connected && now - lc->time_of_last_request >= LOOPBACK_RETRY)
+                    loopback_send_request(lc, &server_addr, &pkt[2], now);
+            }
+
+            next_tick += dt;
+            if(next_tick < now)
+                next_tick = now + dt; // fell behind, don't burst
+        }
+
+        // an input per server tick, at the rate the server gave
+        for(int i = 0; i < num_clients; ++i)
+        {
+            LoopbackClient* lc = &clients[i];
+            if(!lc->connected || now < lc->next_input)
+                continue;
+
+            loopback_send_inputs(lc, &server_addr, &pkt[2], &bp, now);
+
+            lc->next_input += 1.0/lc->tick_rate;
+            if(lc->next_input < now)
+                lc->next_input = now + 1.0/lc->tick_rate;
+        }
+
+        timer_delay_us(1000);
+    }
+
+    double elapsed = timer_get_time() - t0;
+
+    ServerTickStats stats;
+    net_server_get_tick_stats(&stats);
+
+    LinkConditionerStats link_stats = {0};
+    if(link)
+        socket_get_link_conditioner_stats(&link_stats);
+
+    net_server_stop();
+    pthread_join(thread, NULL);
+
+    int connected = 0;
+    double connect_time_max = 0.0, connect_time_sum = 0.0;
+    uint64_t states = 0, stale = 0, bytes_in = 0, bytes_out = 0, acked = 0, lost = 0, received = 0, missed = 0;
+    MetricsHistogram rtt = {0};
+
+    for(int i = 0; i < num_clients; ++i)
+    {
+        LoopbackClient* lc = &clients[i];
+        if(lc->connected)
+        {
+            connected++;
+            connect_time_sum += lc->connect_time;
+            connect_time_max = MAX(connect_time_max, lc->connect_time);
+        }
+        states += lc->states;
+        stale += lc->stale;
+        bytes_in += lc->bytes_in;
+        bytes_out += lc->bytes_out;
+        acked += lc->metrics.acked;
+        lost += lc->metrics.lost;
+        received += lc->metrics.received;
+        missed += lc->metrics.missed;
+        metrics_histogram_merge(&rtt, &lc->metrics.rtt);
+    }
+
+    double per_client = (double)MAX(connected, 1)*elapsed;
+
+    LOGN("Loopback test (%d clients, %.1f s)", num_clients, elapsed);
+    if(link)
+    {
+        LOGN("  link: seed %llu, %.1f%% loss, %.0f+%.0f ms, %.1f%% duplicated, %.1f%% reordered by %.0f ms, %.0f kB/s",
+             (unsigned long long)link->seed, link->loss_pct, 1000.0*link->latency, 1000.0*link->jitter,
+             link->duplicate_pct, link->reorder_pct, 1000.0*link->reorder_delay, link->bandwidth/1000.0);
+        LOGN("  link: %llu sent, %llu dropped, %llu duplicated, %llu reordered, %llu over bandwidth",
+             (unsigned long long)link_stats.sent, (unsigned long long)link_stats.dropped,
+             (unsigned long long)link_stats.duplicated, (unsigned long long)link_stats.reordered,
+             (unsigned long long)link_stats.overflowed);
+    }
+    LOGN("  connected %d, connect time avg %.1f ms, max %.1f ms", connected,
+         connected ? 1000.0*connect_time_sum/connected : 0.0, 1000.0*connect_time_max);
+    LOGN("  per client: %.1f states/s, %.2f kB/s down, %.2f kB/s up",
+         states/per_client, bytes_in/per_client/1000.0, bytes_out/per_client/1000.0);
+    LOGN("  rtt ms: mean %.1f, p50 <= %.1f, p99 <= %.1f, max %.1f (includes waiting for the next state)",
+         rtt.count ? (double)rtt.sum/rtt.count/1000.0 : 0.0, metrics_histogram_quantile(&rtt, 0.50)/1000.0, metrics_histogram_quantile(&rtt, 0.99)/1000.0, rtt.max/1000.0);
+    LOGN("  up: %llu acked, %llu lost (%.1f%%); down: %llu received, %llu missed, %llu stale",
+         (unsigned long long)acked, (unsigned long long)lost, 100.0*lost/MAX(acked + lost, 1),
+         (unsigned long long)received, (unsigned long long)missed, (unsigned long long)stale);
+    LOGN("  server inputs: %llu missing, %llu lost, %llu late, %llu redundant; %llu ticks skipped",
+         (unsigned long long)(stats.inputs_missing - prev_stats.inputs_missing),
+         (unsigned long long)(stats.inputs_lost - prev_stats.inputs_lost),
+         (unsigned long long)(stats.inputs_late - prev_stats.inputs_late),
+         (unsigned long long)(stats.inputs_redundant - prev_stats.inputs_redundant),
+         (unsigned long long)(stats.skipped_ticks - prev_stats.skipped_ticks));
+    LOGN("%s", connected == num_clients ? "PASSED" : "FAILED");
+
+    if(link)
+        socket_set_link_conditioner(NULL);
+
+    for(int i = 0; i < num_clients; ++i)
+        socket_close(clients[i].socket);
+
+    bitpack_delete(&bp);
+    free(recv_data);
+    free(pkt);
+    free(clients);
+
+    return connected == num_clients;
+}
+
+//
+// Runner
+//
+
+static void usage(const char* prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("Runs the module and net tests, then the loopback test.\n");
+    printf("  --bench              run the benches instead\n");
+    printf("  --loopback N         loopback clients (8)\n");
+    printf("  --seconds S          loopback run length (3)\n");
+    printf("  --seed N             link conditioner seed, any of the link options turns it on\n");
+    printf("  --loss PCT\n");
+    printf("  --latency MS         one way\n");
+    printf("  --jitter MS          up to this much more\n");
+    printf("  --duplicate PCT\n");
+    printf("  --reorder PCT        held back --reorder-delay MS (50)\n");
+    printf("  --reorder-delay MS\n");
+    printf("  --bandwidth KBPS     kB/s each way per client\n");
+}
+
+static void run_benches()
+{
+    bitpack_bench();
+    lagcomp_bench(64, 100000);
+    bench_client_lookup(4096, 1000000);
+    bench_encode(8);
+    bench_interest(512);
+}
+
+// Returns how many of the net tests failed; the module tests only print
+static int run_tests()
+{
+    bitpack_test();
+    channel_test();
+    interp_test();
+    jobs_test();
+    lagcomp_test();
+    metrics_test();
+    spsc_test();
+    player_state_quantize_test();
+
+    int failed = 0;
+    failed += !test_connect_flood(100000);
+    failed += !test_reconnect();
+    failed += !test_frame_spill();
+
+    for(int on = 0; on <= 1; ++on)
+    {
+        server.interest = on;
+        failed += !test_snapshot(64, 0, 0);
+        failed += !test_snapshot(64, 3, 5);
+        failed += !test_snapshot(600, 3, 5);
+    }
+    server.interest = true;
+
+    failed += !test_input(0, 0);
+    failed += !test_input(3, 10);
+    return failed;
+}
+
+int main(int argc, char* argv[])
+{
+    bool bench = false;
+    int loopback_clients = 8;
+    double loopback_seconds = 3.0;
+
+    bool use_link = false;
+    LinkConditioner link = {.seed = 1, .reorder_delay = 0.05};
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if(strcmp(arg, "--bench") == 0)
+        {
+            bench = true;
+            continue;
+        }
+
+        if(strcmp(arg, "--help") == 0 || !val)
+        {
+            usage(argv[0]);
+            return strcmp(arg, "--help") == 0 ? 0 : 1;
+        }
+        i++;
+
+        if(strcmp(arg, "--loopback") == 0)           loopback_clients = atoi(val);
+        else if(strcmp(arg, "--seconds") == 0)       loopback_seconds = atof(val);
+        else
+        {
+            use_link = true;
+
+            if(strcmp(arg, "--seed") == 0)               link.seed = strtoull(val, NULL, 10);
+            else if(strcmp(arg, "--loss") == 0)          link.loss_pct = atof(val);
+            else if(strcmp(arg, "--latency") == 0)       link.latency = atof(val)/1000.0;
+            else if(strcmp(arg, "--jitter") == 0)        link.jitter = atof(val)/1000.0;
+            else if(strcmp(arg, "--duplicate") == 0)     link.duplicate_pct = atof(val);
+            else if(strcmp(arg, "--reorder") == 0)       link.reorder_pct = atof(val);
+            else if(strcmp(arg, "--reorder-delay") == 0) link.reorder_delay = atof(val)/1000.0;
+            else if(strcmp(arg, "--bandwidth") == 0)     link.bandwidth = atof(val)*1000.0;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    init_timer();
+
+    // ground heights for player movement, snapshot bounds
+    terrain_init();
+
+    // as net_server_start() does, for the fixture's clients
+    Vector3 bounds_min, bounds_max;
+    if(terrain_get_bounds(&bounds_min, &bounds_max))
+        snapshot_set_bounds((float*)&bounds_min, (float*)&bounds_max);
+
+    if(bench)
+    {
+        run_benches();
+        return 0;
+    }
+
+    int failed = run_tests();
+    failed += !test_loopback(loopback_clients, loopback_seconds, use_link ? &link : NULL);
+
+    LOGN("%s (%d net tests failed)", failed == 0 ? "ALL PASSED" : "FAILED", failed);
+    return failed == 0 ? 0 : 1;
+}
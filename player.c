@@ -8,7 +8,12 @@
 #define MOUSE_MOVE_SENSITIVITY  0.003
 
 Player player = {0};
+Player* players = NULL;
 Camera camera = {0};
+
+// HEADLESS builds (bin/rekt_server) have only the simulation: no models,
+// input or drawing
+#if !HEADLESS
 Model girl;
 Model greenman;
 
@@ -16,22 +21,39 @@ ModelAnimation *modelAnimations;
 int animsCount = 0;
 unsigned int animIndex = 2;
 unsigned int animCurrentFrame = 0;
+#endif
 
-void player_init()
+// Simulation state back to spawn defaults, used for the local player and
+// for server-side players when a client joins
+void player_reset(Player* p)
 {
-    player.pos = (Vector3){ 0.0, 0.0, 0.0 };
-    player.target = (Vector3){ 0.0, 0.0, 1.0 };
+    p->pos = (Vector3){ 0.0, 0.0, 0.0 };
+    p->vel = (Vector3){ 0.0, 0.0, 0.0 };
+    p->target = (Vector3){ 0.0, 0.0, 1.0 };
+
+    p->run_speed = 5.0; // m/s
+    p->jump_speed = 4.0; // m/s
+    p->height = 1.0;
+    p->angle_theta = 0.0;
+    p->angle_omega = 0.0;
+    p->running = false;
+}
 
+void player_set_active(Player* p, bool active)
+{
+    p->active = active;
+}
+
+void player_init()
+{
+    player_reset(&player);
     player.viewpoint = VIEWPOINT_FIRST;
-    player.run_speed = 5.0; // m/s
-    player.jump_speed = 4.0; // m/s
-    player.height = 1.0;
-    player.angle_theta = 0.0;
 
     camera.up = (Vector3){ 0.0f, 1.0f, 0.0f };
     camera.fovy = 60.0f;
     camera.projection = CAMERA_PERSPECTIVE;
 
+#if !HEADLESS
     girl = LoadModel("models/female1.obj");
     Texture2D texture = LoadTexture("models/female1.png");
     girl.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture;
@@ -41,104 +63,136 @@ void player_init()
     modelAnimations = LoadModelAnimations("models/greenman.glb", &animsCount);
     greenman.materials[0].shader = lights_shader;
     greenman.materials[1].shader = lights_shader;
+#endif
 }
 
-void player_update(float dt)
+#if !HEADLESS
+// Samples the keyboard and mouse into an input for this frame
+void player_get_input(float dt, NetPlayerInput* input)
 {
-    if(g_editor)
-        return;
+    input->delta_t = dt;
+    input->keys = 0;
+
+    if(IsKeyDown(KEY_W))          input->keys |= (1 << PLAYER_ACTION_FORWARD);
+    if(IsKeyDown(KEY_S))          input->keys |= (1 << PLAYER_ACTION_BACKWARD);
+    if(IsKeyDown(KEY_D))          input->keys |= (1 << PLAYER_ACTION_RIGHT);
+    if(IsKeyDown(KEY_A))          input->keys |= (1 << PLAYER_ACTION_LEFT);
+    if(IsKeyDown(KEY_SPACE))      input->keys |= (1 << PLAYER_ACTION_JUMP);
+    if(IsKeyDown(KEY_LEFT_SHIFT)) input->keys |= (1 << PLAYER_ACTION_RUN);
+
+    float theta = player.angle_theta;
+    float omega = player.angle_omega;
+
+    Vector2 mouse_delta = GetMouseDelta();
+
+    if(ABS(mouse_delta.x) < 255.0f && ABS(mouse_delta.y) < 255.0f) // to avoid wild mouse movement on window resize
+    {
+        theta -= RAD2DEG*mouse_delta.x*MOUSE_MOVE_SENSITIVITY;
+        omega -= RAD2DEG*mouse_delta.y*MOUSE_MOVE_SENSITIVITY;
+    }
+
+    input->angle_theta = fmod(theta,360.0f);
+
+    if(omega < -55.0) omega = -55.0;
+    else if(omega > +55.0) omega = +55.0;
+    input->angle_omega = omega;
+}
+#endif
+
+// One simulation step. Depends only on p and the input so the server and a
+// predicting client replaying the same inputs end up in the same state.
+void player_apply_input(Player* p, NetPlayerInput* input)
+{
+    float dt = input->delta_t;
+    bool key[PLAYER_ACTION_MAX];
+    for(int i = 0; i < PLAYER_ACTION_MAX; ++i)
+        key[i] = (input->keys >> i) & 1;
+
+    p->angle_theta = input->angle_theta;
+    p->angle_omega = input->angle_omega;
 
     // update velocity
 
-    Vector3 fwd = Vector3Normalize(Vector3Subtract(player.target, player.pos));
     Vector3 up = (Vector3){ 0.0, 1.0, 0.0 };
+    Vector3 fwd = Vector3RotateByAxisAngle((Vector3){0.0,0.0,1.0}, up, DEG2RAD*p->angle_theta);
     Vector3 right = Vector3Normalize(Vector3CrossProduct(fwd, up));
 
-    fwd.y = 0.0;
-    right.y = 0.0;
+    float ground_y = terrain_get_ground(p->pos.x, p->pos.z, &p->ground);
+    bool on_ground = p->pos.y <= ground_y + GROUND_EPSILON;
 
-    float ground_y = terrain_get_ground(player.pos.x, player.pos.z, &player.ground);
-    bool on_ground = player.pos.y <= ground_y + GROUND_EPSILON;
-    
     if(on_ground)
     {
-        player.vel.x = 0.0;
-        player.vel.z = 0.0;
-        player.running = false;
+        p->vel.x = 0.0;
+        p->vel.z = 0.0;
+        p->running = key[PLAYER_ACTION_RUN];
 
-        if(IsKeyDown(KEY_LEFT_SHIFT)) { player.running = true; };
-        if(IsKeyDown(KEY_W)) { player.vel = Vector3Add(player.vel,fwd); }
-        if(IsKeyDown(KEY_S)) { player.vel = Vector3Subtract(player.vel,fwd); } 
-        if(IsKeyDown(KEY_D)) { player.vel = Vector3Add(player.vel,right); }
-        if(IsKeyDown(KEY_A)) { player.vel = Vector3Subtract(player.vel, right); }
+        if(key[PLAYER_ACTION_FORWARD])  { p->vel = Vector3Add(p->vel,fwd); }
+        if(key[PLAYER_ACTION_BACKWARD]) { p->vel = Vector3Subtract(p->vel,fwd); }
+        if(key[PLAYER_ACTION_RIGHT])    { p->vel = Vector3Add(p->vel,right); }
+        if(key[PLAYER_ACTION_LEFT])     { p->vel = Vector3Subtract(p->vel, right); }
 
-        if(player.vel.x != 0.0 && player.vel.z != 0.0)
+        if(p->vel.x != 0.0 && p->vel.z != 0.0)
         {
             // handle diagonal movement
-            player.vel.x *= 0.7071;
-            player.vel.z *= 0.7071;
+            p->vel.x *= 0.7071;
+            p->vel.z *= 0.7071;
         }
 
-        player.vel.x *= player.run_speed;
-        player.vel.z *= player.run_speed;
+        p->vel.x *= p->run_speed;
+        p->vel.z *= p->run_speed;
 
-        if(player.running)
+        if(p->running)
         {
-            player.vel.x *= 5.0;
-            player.vel.z *= 5.0;
+            p->vel.x *= 5.0;
+            p->vel.z *= 5.0;
         }
-    }
 
-    if(IsKeyDown(KEY_SPACE)) { 
-        if(on_ground)
-            player.vel.y = player.jump_speed;
-    }
-
-    if(IsKeyPressed(KEY_TAB)) { g_debug = !g_debug; }
-    if(IsKeyPressed(KEY_P)) {
-        if(player.viewpoint == VIEWPOINT_FIRST) player.viewpoint = VIEWPOINT_THIRD;
-        else player.viewpoint = VIEWPOINT_FIRST;
+        if(key[PLAYER_ACTION_JUMP])
+            p->vel.y = p->jump_speed;
     }
 
     // apply gravity
-    if(player.pos.y > ground_y + EPSILON)
-        player.vel.y -= (GRAVITY*dt);
-    
+    if(p->pos.y > ground_y + EPSILON)
+        p->vel.y -= (GRAVITY*dt);
+
     // update position
-    Vector3 pos_delta = Vector3Scale(player.vel, dt);
-    player.pos = Vector3Add(player.pos, pos_delta);
+    Vector3 pos_delta = Vector3Scale(p->vel, dt);
+    p->pos = Vector3Add(p->pos, pos_delta);
 
-    if(player.pos.y < ground_y)
+    if(p->pos.y < ground_y)
     {
-        player.pos.y = ground_y;
-        player.vel.y = 0.0;
+        p->pos.y = ground_y;
+        p->vel.y = 0.0;
     }
 
     // update rotation
 
-    Vector3 rot = Vector3Zero();
-    rot = Vector3Scale(rot, CAMERA_ROTATION_SPEED*dt);
+    Vector3 target = {0.0,0.0,1.0};
+    target = Vector3RotateByAxisAngle(target, up, DEG2RAD*p->angle_theta);
+    target = Vector3RotateByAxisAngle(target, right, DEG2RAD*p->angle_omega);
+    p->target = Vector3Add(p->pos, target);
+}
 
-    Vector2 mouse_delta = GetMouseDelta();
+#if !HEADLESS
+void player_update(float dt)
+{
+    if(g_editor)
+        return;
 
-    if(ABS(mouse_delta.x) < 255.0f && ABS(mouse_delta.y) < 255.0f) // to avoid wild mouse movement on window resize
-    {
-        rot.x += mouse_delta.x*MOUSE_MOVE_SENSITIVITY;
-        rot.y += mouse_delta.y*MOUSE_MOVE_SENSITIVITY;
+    if(IsKeyPressed(KEY_TAB)) { g_debug = !g_debug; }
+    if(IsKeyPressed(KEY_P)) {
+        if(player.viewpoint == VIEWPOINT_FIRST) player.viewpoint = VIEWPOINT_THIRD;
+        else player.viewpoint = VIEWPOINT_FIRST;
     }
 
-    player.angle_theta -= RAD2DEG*rot.x;
-    player.angle_theta = fmod(player.angle_theta,360.0f);
+    NetPlayerInput input;
+    player_get_input(dt, &input);
+    player_apply_input(&player, &input);
 
-    player.angle_omega -= RAD2DEG*rot.y;
-    if(player.angle_omega < -55.0) player.angle_omega = -55.0;
-    else if(player.angle_omega > +55.0) player.angle_omega = +55.0;
+    bool on_ground = player.pos.y <= player.ground.height + GROUND_EPSILON;
 
-    Vector3 target = {0.0,0.0,1.0};
-    target = Vector3RotateByAxisAngle(target, up, DEG2RAD*player.angle_theta);
-    target = Vector3RotateByAxisAngle(target, right, DEG2RAD*player.angle_omega);
-    target = Vector3Add(player.pos, target);
-    player.target = target;
+    Vector3 fwd = Vector3Subtract(player.target, player.pos);
+    fwd.y = 0.0;
 
     // update camera
 
@@ -190,4 +244,4 @@ void player_draw()
         DrawSphere(ground.c, 0.06, BLUE);
     }
 }
-
+#endif
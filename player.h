@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+#include "raylib.h"
 #include "terrain.h"
 
 typedef enum
@@ -8,6 +10,30 @@ typedef enum
     VIEWPOINT_THIRD,
 } ViewPoint;
 
+#define PLAYER_NAME_MAX 32
+
+typedef enum
+{
+    PLAYER_ACTION_FORWARD,
+    PLAYER_ACTION_BACKWARD,
+    PLAYER_ACTION_RIGHT,
+    PLAYER_ACTION_LEFT,
+    PLAYER_ACTION_JUMP,
+    PLAYER_ACTION_RUN,
+
+    PLAYER_ACTION_MAX
+} PlayerActionType;
+
+// Everything a simulation step needs from the user. Sent to the server and
+// kept by the client for replay, so the step must not read anything else.
+typedef struct
+{
+    float delta_t;
+    float angle_theta; // degrees
+    float angle_omega; // degrees
+    uint32_t keys;     // bit per PlayerActionType
+} NetPlayerInput;
+
 typedef struct
 {
     Vector3 vel;
@@ -21,11 +47,17 @@ typedef struct
     ViewPoint viewpoint;
     Ground ground;
     bool running;
+    bool active; // server: slot has a connected client
 } Player;
 
 extern Player player;
+extern Player* players; // server-side, one per client slot
 extern Camera camera;
 
 void player_init();
+void player_reset(Player* p);
+void player_set_active(Player* p, bool active);
+void player_get_input(float dt, NetPlayerInput* input);
+void player_apply_input(Player* p, NetPlayerInput* input);
 void player_update(float dt);
 void player_draw();
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <string.h>
+
+#include "bitpack.h"
+
+// X-macro bit-packed serializers.
+//
+// A schema is a macro that lists a struct's fields using one generator
+// per field kind:
+//
+//   U(name, bits)             unsigned integer
+//   F(name, min, max, bits)   float, clamped and quantised over [min,max]
+//   B(name, count)            fixed size byte array
+//   S(name, max_len)          string, 8-bit length prefix, at most max_len chars
+//
+// SCHEMA_DEFINE(Type, prefix, SCHEMA) then generates:
+//
+//   prefix_MAX_BITS                  worst case encoded size
+//   prefix_write(bp, const Type* s)
+//   prefix_read(bp, Type* s)
+//
+// Everything expands inline, so an encoder is a straight run of shifts.
+// Writers check room once against the worst case and set
+// BITPACK_ERR_OVERFLOW on bp, writing nothing, if it isn't there.
+//
+// SCHEMA_DEFINE_DELTA(Type, prefix, SCHEMA) adds encoders against a previous
+// value for schemas of U and F fields only: 1 bit if anything changed, then
+// per field 1 bit changed + the value. Floats compare quantised.
+//
+//   prefix_DELTA_MAX_BITS
+//   prefix_write_delta(bp, const Type* s, const Type* base)
+//   prefix_read_delta(bp, Type* s, const Type* base)
+
+static inline uint32_t quantize_float(float value, float min, float max, int bits)
+{
+    uint32_t steps = (uint32_t)(((uint64_t)1 << bits) - 1);
+    if(value <= min) return 0;
+    if(value >= max) return steps;
+    return (uint32_t)((value - min) / (max - min) * steps + 0.5f);
+}
+
+static inline float dequantize_float(uint32_t q, float min, float max, int bits)
+{
+    uint32_t steps = (uint32_t)(((uint64_t)1 << bits) - 1);
+    return min + (max - min) * ((float)q / (float)steps);
+}
+
+#define SCHEMA_MASK(bits) ((uint32_t)(((uint64_t)1 << (bits)) - 1))
+
+#define SCHEMA_BITS_U(name, bits)           + (bits)
+#define SCHEMA_BITS_F(name, min, max, bits) + (bits)
+#define SCHEMA_BITS_B(name, count)          + 8*(count)
+#define SCHEMA_BITS_S(name, max_len)        + 8 + 8*(max_len)
+
+#define SCHEMA_CHECK_ROOM(max_bits) \
+    if(!bitpack_has_room(bp, max_bits)) \
+    { \
+        bp->overflow = BITPACK_ERR_OVERFLOW; \
+        return; \
+    }
+
+#define SCHEMA_WRITE_U(name, bits) \
+    bitpack_write_fast(bp, bits, (uint32_t)(s->name) & SCHEMA_MASK(bits));
+#define SCHEMA_WRITE_F(name, min, max, bits) \
+    bitpack_write_fast(bp, bits, quantize_float(s->name, min, max, bits));
+#define SCHEMA_WRITE_B(name, count) \
+    for(int _i = 0; _i < (count); ++_i) bitpack_write_fast(bp, 8, s->name[_i]);
+#define SCHEMA_WRITE_S(name, max_len) \
+    { \
+        int _len = (int)strnlen(s->name, max_len); \
+        bitpack_write_fast(bp, 8, _len); \
+        for(int _i = 0; _i < _len; ++_i) bitpack_write_fast(bp, 8, (uint8_t)s->name[_i]); \
+    }
+
+#define SCHEMA_READ_U(name, bits) \
+    s->name = bitpack_read(bp, bits);
+#define SCHEMA_READ_F(name, min, max, bits) \
+    s->name = dequantize_float(bitpack_read(bp, bits), min, max, bits);
+#define SCHEMA_READ_B(name, count) \
+    for(int _i = 0; _i < (count); ++_i) s->name[_i] = (uint8_t)bitpack_read(bp, 8);
+#define SCHEMA_READ_S(name, max_len) \
+    { \
+        int _len = (int)bitpack_read(bp, 8); \
+        if(_len > (max_len)) { _len = (max_len); bp->overflow = BITPACK_ERR_RANGE; } \
+        for(int _i = 0; _i < _len; ++_i) s->name[_i] = (char)bitpack_read(bp, 8); \
+        s->name[_len] = '\0'; \
+    }
+
+#define SCHEMA_DEFINE(Type, prefix, SCHEMA) \
+    enum { prefix##_MAX_BITS = 0 SCHEMA(SCHEMA_BITS_U, SCHEMA_BITS_F, SCHEMA_BITS_B, SCHEMA_BITS_S) }; \
+    static inline void prefix##_write(BitPack* bp, const Type* s) \
+    { \
+        SCHEMA_CHECK_ROOM(prefix##_MAX_BITS) \
+        SCHEMA(SCHEMA_WRITE_U, SCHEMA_WRITE_F, SCHEMA_WRITE_B, SCHEMA_WRITE_S) \
+    } \
+    static inline void prefix##_read(BitPack* bp, Type* s) \
+    { \
+        SCHEMA(SCHEMA_READ_U, SCHEMA_READ_F, SCHEMA_READ_B, SCHEMA_READ_S) \
+    }
+
+#define SCHEMA_DELTA_BITS_U(name, bits)           + 1 + (bits)
+#define SCHEMA_DELTA_BITS_F(name, min, max, bits) + 1 + (bits)
+#define SCHEMA_DELTA_BITS_B(name, count)          SCHEMA_DELTA_UNSUPPORTED
+#define SCHEMA_DELTA_BITS_S(name, max_len)        SCHEMA_DELTA_UNSUPPORTED
+
+#define SCHEMA_DIFF_U(name, bits) \
+    || (((uint32_t)(s->name) ^ (uint32_t)(base->name)) & SCHEMA_MASK(bits))
+#define SCHEMA_DIFF_F(name, min, max, bits) \
+    || quantize_float(s->name, min, max, bits) != quantize_float(base->name, min, max, bits)
+
+#define SCHEMA_WRITE_DELTA_U(name, bits) \
+    if(((uint32_t)(s->name) ^ (uint32_t)(base->name)) & SCHEMA_MASK(bits)) \
+    { \
+        bitpack_write_fast(bp, 1, 1); \
+        SCHEMA_WRITE_U(name, bits) \
+    } \
+    else bitpack_write_fast(bp, 1, 0);
+#define SCHEMA_WRITE_DELTA_F(name, min, max, bits) \
+    { \
+        uint32_t _q = quantize_float(s->name, min, max, bits); \
+        if(_q != quantize_float(base->name, min, max, bits)) \
+        { \
+            bitpack_write_fast(bp, 1, 1); \
+            bitpack_write_fast(bp, bits, _q); \
+        } \
+        else bitpack_write_fast(bp, 1, 0); \
+    }
+
+#define SCHEMA_READ_DELTA_U(name, bits) \
+    if(bitpack_read(bp, 1)) { SCHEMA_READ_U(name, bits) }
+#define SCHEMA_READ_DELTA_F(name, min, max, bits) \
+    if(bitpack_read(bp, 1)) { SCHEMA_READ_F(name, min, max, bits) }
+
+#define SCHEMA_DEFINE_DELTA(Type, prefix, SCHEMA) \
+    enum { prefix##_DELTA_MAX_BITS = 1 SCHEMA(SCHEMA_DELTA_BITS_U, SCHEMA_DELTA_BITS_F, SCHEMA_DELTA_BITS_B, SCHEMA_DELTA_BITS_S) }; \
+    static inline void prefix##_write_delta(BitPack* bp, const Type* s, const Type* base) \
+    { \
+        SCHEMA_CHECK_ROOM(prefix##_DELTA_MAX_BITS) \
+        if(!(0 SCHEMA(SCHEMA_DIFF_U, SCHEMA_DIFF_F, SCHEMA_DELTA_BITS_B, SCHEMA_DELTA_BITS_S))) \
+        { \
+            bitpack_write_fast(bp, 1, 0); \
+            return; \
+        } \
+        bitpack_write_fast(bp, 1, 1); \
+        SCHEMA(SCHEMA_WRITE_DELTA_U, SCHEMA_WRITE_DELTA_F, SCHEMA_DELTA_BITS_B, SCHEMA_DELTA_BITS_S) \
+    } \
+    static inline void prefix##_read_delta(BitPack* bp, Type* s, const Type* base) \
+    { \
+        *s = *base; \
+        if(!bitpack_read(bp, 1)) \
+            return; \
+        SCHEMA(SCHEMA_READ_DELTA_U, SCHEMA_READ_DELTA_F, SCHEMA_DELTA_BITS_B, SCHEMA_DELTA_BITS_S) \
+    }
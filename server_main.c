@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <signal.h>
+#include "common.h"
+#include "raylib.h" // types only, bin/rekt_server doesn't link raylib
+#include "timer.h"
+#include "player.h"
+#include "terrain.h"
+#include "net.h"
+
+double g_timer = 0.0;
+
+//------------------------------------------------------------------------------------
+// Dedicated server entry point: the simulation and net, no window, GL or input.
+// Built as bin/rekt_server by build.sh, with HEADLESS set.
+//------------------------------------------------------------------------------------
+
+static void usage(const char* prog)
+{
+    printf("Usage: %s [options]\n", prog);
+    printf("  --max-clients N      client slots\n");
+    printf("  --tick-rate HZ       simulation rate, whole Hz (1-255)\n");
+    printf("  --workers N          state encode threads\n");
+    printf("  --no-interest        every player is in range of every client, within the same byte budget\n");
+    printf("  --metrics-file PATH  append JSON lines metrics every second\n");
+    printf("  --metrics-port PORT  send the same lines to 127.0.0.1:PORT\n");
+}
+
+// whole numbers only, so --tick-rate 20.5 is refused rather than truncated
+static bool parse_int(const char* s, int* out)
+{
+    char* end;
+    long v = strtol(s, &end, 10);
+    if(end == s || *end != '\0' || v < INT_MIN || v > INT_MAX)
+        return false;
+
+    *out = (int)v;
+    return true;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    net_server_stop();
+}
+
+int main(int argc, char* argv[])
+{
+    for(int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if(strcmp(arg, "--help") == 0)
+        {
+            usage(argv[0]);
+            return 0;
+        }
+
+        if(strcmp(arg, "--no-interest") == 0)
+        {
+            net_server_set_interest_management(false);
+            continue;
+        }
+
+        if(!val)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        i++;
+
+        bool ok = true;
+        int n = 0;
+
+        if(strcmp(arg, "--max-clients") == 0)        ok = parse_int(val, &n) && net_server_set_max_clients(n);
+        else if(strcmp(arg, "--tick-rate") == 0)     ok = parse_int(val, &n) && net_server_set_tick_rate(n);
+        else if(strcmp(arg, "--workers") == 0)       ok = parse_int(val, &n) && net_server_set_worker_count(n);
+        else if(strcmp(arg, "--metrics-file") == 0)  ok = net_server_set_metrics_file(val);
+        else if(strcmp(arg, "--metrics-port") == 0)  ok = parse_int(val, &n) && n >= 1 && n <= 65535 && net_server_set_metrics_port((uint16_t)n);
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if(!ok)
+        {
+            printf("Bad value for %s: %s\n", arg, val);
+            return 1;
+        }
+    }
+
+    init_timer();
+
+    // ground heights for player movement, snapshot bounds
+    terrain_init();
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    return net_server_start();
+}
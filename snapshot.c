@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include "schema.h"
+#include "snapshot.h"
+
+#define STATE_FIELD_COUNT ((int)(sizeof(QuantizedPlayerState)/sizeof(uint32_t)))
+#define STATE_MAX_BITS (2*NET_POS_XZ_BITS + NET_POS_Y_BITS + 3*NET_VEL_BITS + NET_THETA_BITS + NET_OMEGA_BITS)
+
+#define HEADER_MAX_BITS (16 + 1 + 16 + SNAPSHOT_COUNT_BITS)
+#define ENTITY_MAX_BITS (1 + SNAPSHOT_INDEX_BITS + 1 + STATE_FIELD_COUNT + STATE_MAX_BITS)
+
+#define OMEGA_MAX 90.0f
+
+// bits per QuantizedPlayerState field, in declaration order
+static const int state_field_bits[STATE_FIELD_COUNT] = {
+    NET_POS_XZ_BITS, NET_POS_Y_BITS, NET_POS_XZ_BITS,
+    NET_VEL_BITS, NET_VEL_BITS, NET_VEL_BITS,
+    NET_THETA_BITS,
+    NET_OMEGA_BITS
+};
+
+static float bounds_min[3] = {-256.0f, -16.0f, -256.0f};
+static float bounds_max[3] = {+256.0f, 128.0f, +256.0f};
+
+void snapshot_set_bounds(const float min[3], const float max[3])
+{
+    memcpy(bounds_min, min, sizeof(bounds_min));
+    memcpy(bounds_max, max, sizeof(bounds_max));
+}
+
+void snapshot_get_bounds(float min[3], float max[3])
+{
+    memcpy(min, bounds_min, sizeof(bounds_min));
+    memcpy(max, bounds_max, sizeof(bounds_max));
+}
+
+static inline float wrap_degrees(float a)
+{
+    a = fmodf(a, 360.0f);
+    return a < 0.0f ? a + 360.0f : a;
+}
+
+void player_state_quantize(const NetPlayerState* state, QuantizedPlayerState* q)
+{
+    for(int i = 0; i < 3; ++i)
+    {
+        int pos_bits = (i == 1) ? NET_POS_Y_BITS : NET_POS_XZ_BITS;
+        q->pos[i] = quantize_float(state->pos[i], bounds_min[i], bounds_max[i], pos_bits);
+        q->vel[i] = quantize_float(state->vel[i], -NET_VEL_MAX, NET_VEL_MAX, NET_VEL_BITS);
+    }
+
+    // theta steps wrap, so 360 lands back on 0
+    uint32_t theta_steps = (uint32_t)1 << NET_THETA_BITS;
+    q->angle_theta = (uint32_t)(wrap_degrees(state->angle_theta) / 360.0f * theta_steps + 0.5f) & (theta_steps - 1);
+    q->angle_omega = quantize_float(state->angle_omega, -OMEGA_MAX, OMEGA_MAX, NET_OMEGA_BITS);
+}
+
+void player_state_dequantize(const QuantizedPlayerState* q, NetPlayerState* state)
+{
+    for(int i = 0; i < 3; ++i)
+    {
+        int pos_bits = (i == 1) ? NET_POS_Y_BITS : NET_POS_XZ_BITS;
+        state->pos[i] = dequantize_float(q->pos[i], bounds_min[i], bounds_max[i], pos_bits);
+        state->vel[i] = dequantize_float(q->vel[i], -NET_VEL_MAX, NET_VEL_MAX, NET_VEL_BITS);
+    }
+
+    state->angle_theta = 360.0f * (float)q->angle_theta / (float)((uint32_t)1 << NET_THETA_BITS);
+    state->angle_omega = dequantize_float(q->angle_omega, -OMEGA_MAX, OMEGA_MAX, NET_OMEGA_BITS);
+}
+
+// Entities missing from the baseline delta against a zeroed player, so
+// fields at rest cost a bit each. Depends on the bounds; computed per call
+// rather than cached so encoders on several threads share nothing.
+static void get_zero_state(QuantizedPlayerState* q)
+{
+    NetPlayerState zero = {0};
+    player_state_quantize(&zero, q);
+}
+
+// Largest round trip error per field for values inside the quantised ranges
+void player_state_max_error(NetPlayerState* err)
+{
+    for(int i = 0; i < 3; ++i)
+    {
+        int pos_bits = (i == 1) ? NET_POS_Y_BITS : NET_POS_XZ_BITS;
+        err->pos[i] = 0.5f * (bounds_max[i] - bounds_min[i]) / (float)((1u << pos_bits) - 1);
+        err->vel[i] = 0.5f * (2.0f*NET_VEL_MAX) / (float)((1u << NET_VEL_BITS) - 1);
+    }
+
+    err->angle_theta = 0.5f * 360.0f / (float)(1u << NET_THETA_BITS);
+    err->angle_omega = 0.5f * (2.0f*OMEGA_MAX) / (float)((1u << NET_OMEGA_BITS) - 1);
+}
+
+bool snapshot_reserve(Snapshot* snap, int count)
+{
+    if(count <= snap->cap)
+        return true;
+
+    SnapshotEntity* p = realloc(snap->entities, count*sizeof(SnapshotEntity));
+    if(!p)
+        return false;
+
+    snap->entities = p;
+    snap->cap = count;
+    return true;
+}
+
+void snapshot_free(Snapshot* snap)
+{
+    free(snap->entities);
+    memset(snap, 0, sizeof(Snapshot));
+}
+
+bool snapshot_copy(Snapshot* dst, Snapshot* src)
+{
+    if(!snapshot_reserve(dst, src->count))
+        return false;
+
+    memcpy(dst->entities, src->entities, src->count*sizeof(SnapshotEntity));
+    dst->count = src->count;
+    dst->id = src->id;
+    dst->valid = src->valid;
+    return true;
+}
+
+// Copies the entities of src whose index appears in the sorted indices list
+bool snapshot_filter(Snapshot* dst, Snapshot* src, uint16_t* indices, int count)
+{
+    if(!snapshot_reserve(dst, count))
+        return false;
+
+    dst->count = 0;
+
+    int j = 0;
+    for(int i = 0; i < src->count && j < count; ++i)
+    {
+        while(j < count && indices[j] < src->entities[i].index)
+            j++;
+
+        if(j < count && indices[j] == src->entities[i].index)
+            dst->entities[dst->count++] = src->entities[i];
+    }
+
+    dst->id = src->id;
+    dst->valid = src->valid;
+    return true;
+}
+
+SnapshotEntity* snapshot_find(Snapshot* snap, uint16_t index)
+{
+    int lo = 0, hi = snap->count - 1;
+    while(lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        uint16_t mi = snap->entities[mid].index;
+        if(mi == index) return &snap->entities[mid];
+        if(mi < index) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return NULL;
+}
+
+bool snapshot_equals(Snapshot* a, Snapshot* b)
+{
+    if(a->count != b->count)
+        return false;
+
+    for(int i = 0; i < a->count; ++i)
+    {
+        if(a->entities[i].index != b->entities[i].index)
+            return false;
+        if(memcmp(&a->entities[i].state, &b->entities[i].state, sizeof(QuantizedPlayerState)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static void write_state(BitPack* bp, const QuantizedPlayerState* state, const QuantizedPlayerState* base)
+{
+    const uint32_t* cur = (const uint32_t*)state;
+    const uint32_t* prv = (const uint32_t*)base;
+
+    if(memcmp(state, base, sizeof(QuantizedPlayerState)) == 0)
+    {
+        bitpack_write_fast(bp, 1, 0); // unchanged
+        return;
+    }
+
+    bitpack_write_fast(bp, 1, 1);
+
+    for(int i = 0; i < STATE_FIELD_COUNT; ++i)
+    {
+        if(cur[i] == prv[i])
+        {
+            bitpack_write_fast(bp, 1, 0);
+            continue;
+        }
+
+        bitpack_write_fast(bp, 1, 1);
+        bitpack_write_fast(bp, state_field_bits[i], cur[i]);
+    }
+}
+
+static void read_state(BitPack* bp, QuantizedPlayerState* state, const QuantizedPlayerState* base)
+{
+    *state = *base;
+
+    if(!bitpack_read(bp, 1))
+        return;
+
+    uint32_t* cur = (uint32_t*)state;
+
+    for(int i = 0; i < STATE_FIELD_COUNT; ++i)
+    {
+        if(bitpack_read(bp, 1))
+            cur[i] = bitpack_read(bp, state_field_bits[i]);
+    }
+}
+
+int snapshot_state_bits(const QuantizedPlayerState* state, const QuantizedPlayerState* base)
+{
+    QuantizedPlayerState zero;
+    if(!base)
+    {
+        get_zero_state(&zero);
+        base = &zero;
+    }
+
+    const uint32_t* cur = (const uint32_t*)state;
+    const uint32_t* prv = (const uint32_t*)base;
+
+    int bits = 1;
+    bool changed = false;
+    for(int i = 0; i < STATE_FIELD_COUNT; ++i)
+    {
+        bits += 1;
+        if(cur[i] != prv[i])
+        {
+            bits += state_field_bits[i];
+            changed = true;
+        }
+    }
+
+    return changed ? bits : 1;
+}
+
+// Header:
+//   16 bits  snapshot id
+//    1 bit   has baseline
+//   16 bits  baseline id (if has baseline)
+//   13 bits  entity count
+// Per entity:
+//    1 bit   index follows the previous one, else 12 bits index
+//    1 bit   state changed from baseline (or from zero if not in baseline)
+//            then per field, 1 bit changed + the field's quantised value
+//
+// Fields are written unchecked; room is checked once per entity against the
+// worst case, and running out sets BITPACK_ERR_OVERFLOW on bp.
+void snapshot_write(BitPack* bp, Snapshot* snap, Snapshot* baseline)
+{
+    if(!bitpack_has_room(bp, HEADER_MAX_BITS))
+    {
+        bp->overflow = BITPACK_ERR_OVERFLOW;
+        return;
+    }
+
+    bitpack_write_fast(bp, 16, snap->id);
+    bitpack_write_fast(bp, 1, baseline ? 1 : 0);
+    if(baseline)
+        bitpack_write_fast(bp, 16, baseline->id);
+    bitpack_write_fast(bp, SNAPSHOT_COUNT_BITS, snap->count);
+
+    QuantizedPlayerState zero;
+    get_zero_state(&zero);
+
+    int b = 0;
+    int prior_index = -1;
+
+    for(int i = 0; i < snap->count; ++i)
+    {
+        SnapshotEntity* e = &snap->entities[i];
+
+        if(!bitpack_has_room(bp, ENTITY_MAX_BITS))
+        {
+            bp->overflow = BITPACK_ERR_OVERFLOW;
+            return;
+        }
+
+        if(e->index == prior_index + 1)
+        {
+            bitpack_write_fast(bp, 1, 1);
+        }
+        else
+        {
+            bitpack_write_fast(bp, 1, 0);
+            bitpack_write_fast(bp, SNAPSHOT_INDEX_BITS, e->index);
+        }
+        prior_index = e->index;
+
+        const QuantizedPlayerState* base = &zero;
+        if(baseline)
+        {
+            while(b < baseline->count && baseline->entities[b].index < e->index)
+                b++;
+            if(b < baseline->count && baseline->entities[b].index == e->index)
+                base = &baseline->entities[b].state;
+        }
+
+        write_state(bp, &e->state, base);
+    }
+}
+
+void snapshot_read_header(BitPack* bp, uint16_t* id, bool* has_baseline, uint16_t* baseline_id)
+{
+    *id = (uint16_t)bitpack_read(bp, 16);
+    *has_baseline = bitpack_read(bp, 1) != 0;
+    *baseline_id = *has_baseline ? (uint16_t)bitpack_read(bp, 16) : 0;
+}
+
+bool snapshot_read(BitPack* bp, Snapshot* snap, Snapshot* baseline)
+{
+    int count = (int)bitpack_read(bp, SNAPSHOT_COUNT_BITS);
+    if(!snapshot_reserve(snap, count))
+        return false;
+
+    QuantizedPlayerState zero;
+    get_zero_state(&zero);
+
+    int b = 0;
+    int prior_index = -1;
+
+    for(int i = 0; i < count; ++i)
+    {
+        SnapshotEntity* e = &snap->entities[i];
+
+        if(bitpack_read(bp, 1))
+            e->index = prior_index + 1;
+        else
+            e->index = (uint16_t)bitpack_read(bp, SNAPSHOT_INDEX_BITS);
+
+        if(e->index <= prior_index)
+            return false; // indices must be increasing
+
+        prior_index = e->index;
+
+        const QuantizedPlayerState* base = &zero;
+        if(baseline)
+        {
+            while(b < baseline->count && baseline->entities[b].index < e->index)
+                b++;
+            if(b < baseline->count && baseline->entities[b].index == e->index)
+                base = &baseline->entities[b].state;
+        }
+
+        read_state(bp, &e->state, base);
+    }
+
+    if(bp->overflow != BITPACK_OK)
+        return false; // ran past the end of the packet
+
+    snap->count = count;
+    snap->valid = true;
+    return true;
+}
+
+// Round trips random states (and some out of range ones) through the
+// quantiser and the wire format, checking each field against its error bound.
+// The bound is the analytic half step plus float rounding: quantise and
+// dequantise each round a handful of times at the field's magnitude, so
+// 2*FLT_EPSILON of the largest value the field's arithmetic handles.
+void player_state_quantize_test()
+{
+    NetPlayerState err;
+    player_state_max_error(&err);
+
+    const float* bound = (const float*)&err;
+
+    float eps[STATE_FIELD_COUNT];
+    for(int i = 0; i < 3; ++i)
+    {
+        float m = fmaxf(bounds_max[i] - bounds_min[i], fmaxf(fabsf(bounds_min[i]), fabsf(bounds_max[i])));
+        eps[i] = 2.0f*FLT_EPSILON*m;
+        eps[3+i] = 2.0f*FLT_EPSILON*2.0f*NET_VEL_MAX;
+    }
+    eps[6] = 2.0f*FLT_EPSILON*360.0f;
+    eps[7] = 2.0f*FLT_EPSILON*2.0f*OMEGA_MAX;
+
+    BitPack bp;
+    bitpack_create(&bp, 64);
+
+    QuantizedPlayerState zero;
+    get_zero_state(&zero);
+
+    int failures = 0;
+    float worst[STATE_FIELD_COUNT] = {0};
+
+    for(int n = 0; n < 100000; ++n)
+    {
+        NetPlayerState in;
+        for(int i = 0; i < 3; ++i)
+        {
+            in.pos[i] = bounds_min[i] + (bounds_max[i] - bounds_min[i]) * (rand() / (float)RAND_MAX);
+            in.vel[i] = -NET_VEL_MAX + 2.0f*NET_VEL_MAX * (rand() / (float)RAND_MAX);
+        }
+        in.angle_theta = -720.0f + 1440.0f * (rand() / (float)RAND_MAX);
+        in.angle_omega = -OMEGA_MAX + 2.0f*OMEGA_MAX * (rand() / (float)RAND_MAX);
+
+        QuantizedPlayerState q, q2;
+        player_state_quantize(&in, &q);
+
+        bitpack_reset(&bp);
+        write_state(&bp, &q, &zero);
+        bitpack_flush(&bp);
+        bitpack_seek_begin(&bp);
+        read_state(&bp, &q2, &zero);
+
+        NetPlayerState out;
+        player_state_dequantize(&q2, &out);
+
+        const float* a = (const float*)&in;
+        const float* b = (const float*)&out;
+
+        for(int i = 0; i < STATE_FIELD_COUNT; ++i)
+        {
+            float d = fabsf(a[i] - b[i]);
+            if(i == 6) // theta wraps
+            {
+                d = fmodf(d, 360.0f);
+                if(d > 180.0f) d = 360.0f - d;
+            }
+            if(d > worst[i]) worst[i] = d;
+            if(d > bound[i] + eps[i]) failures++;
+        }
+    }
+
+    // out of range values clamp to the nearest bound
+    NetPlayerState far = {{1e6f, 1e6f, -1e6f}, {1e3f, -1e3f, 0.0f}, 0.0f, 200.0f};
+    QuantizedPlayerState q;
+    player_state_quantize(&far, &q);
+    if(q.pos[0] != (1u << NET_POS_XZ_BITS) - 1 || q.pos[2] != 0 || q.vel[0] != (1u << NET_VEL_BITS) - 1 || q.vel[1] != 0 || q.angle_omega != (1u << NET_OMEGA_BITS) - 1)
+        failures++;
+
+    printf("Quantized player state: %d bits (%.1f bytes) vs %d bits as floats\n", STATE_MAX_BITS, STATE_MAX_BITS/8.0f, (int)(8*sizeof(NetPlayerState)));
+    const char* names[STATE_FIELD_COUNT] = {"pos.x","pos.y","pos.z","vel.x","vel.y","vel.z","theta","omega"};
+    for(int i = 0; i < STATE_FIELD_COUNT; ++i)
+        printf("  %-6s max error %.7f (bound %.7f + %.7f rounding)\n", names[i], worst[i], bound[i], eps[i]);
+    printf("%s (%d failures)\n", failures == 0 ? "PASSED" : "FAILED", failures);
+
+    bitpack_delete(&bp);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bitpack.h"
+
+#define SNAPSHOT_INDEX_BITS 12 // enough for MAX_CLIENTS_LIMIT
+#define SNAPSHOT_COUNT_BITS 13
+
+// Quantisation of player state. Positions are relative to the world bounds
+// (see snapshot_set_bounds()), velocities are clamped to +/-NET_VEL_MAX.
+#define NET_POS_XZ_BITS 18
+#define NET_POS_Y_BITS  16
+#define NET_VEL_BITS    14
+#define NET_VEL_MAX     64.0f // m/s
+#define NET_THETA_BITS  12    // [0,360) degrees
+#define NET_OMEGA_BITS  11    // [-90,90] degrees
+
+// Networked subset of Player
+typedef struct
+{
+    float pos[3];
+    float vel[3];
+    float angle_theta;
+    float angle_omega;
+} NetPlayerState;
+
+// NetPlayerState as sent, one integer per float. Snapshots hold this form so
+// server and client deltas compare the exact same values.
+typedef struct
+{
+    uint32_t pos[3];
+    uint32_t vel[3];
+    uint32_t angle_theta;
+    uint32_t angle_omega;
+} QuantizedPlayerState;
+
+typedef struct
+{
+    uint16_t index; // client slot
+    QuantizedPlayerState state;
+} SnapshotEntity;
+
+// World state at one server tick. Entities are sorted by index.
+typedef struct
+{
+    uint16_t id;
+    bool valid;
+    int count;
+    int cap;
+    SnapshotEntity* entities;
+} Snapshot;
+
+// Defaults to a 512m square if never set
+void snapshot_set_bounds(const float min[3], const float max[3]);
+void snapshot_get_bounds(float min[3], float max[3]);
+void player_state_quantize(const NetPlayerState* state, QuantizedPlayerState* q);
+void player_state_dequantize(const QuantizedPlayerState* q, NetPlayerState* state);
+void player_state_max_error(NetPlayerState* err);
+void player_state_quantize_test();
+
+bool snapshot_reserve(Snapshot* snap, int count);
+void snapshot_free(Snapshot* snap);
+bool snapshot_copy(Snapshot* dst, Snapshot* src);
+bool snapshot_filter(Snapshot* dst, Snapshot* src, uint16_t* indices, int count);
+bool snapshot_equals(Snapshot* a, Snapshot* b);
+SnapshotEntity* snapshot_find(Snapshot* snap, uint16_t index); // binary search, NULL if absent
+
+// Bits snapshot_write() spends on an entity's state against base (NULL for
+// zero), not counting its index: 1 to 1 + SNAPSHOT_INDEX_BITS more
+int snapshot_state_bits(const QuantizedPlayerState* state, const QuantizedPlayerState* base);
+
+// baseline may be NULL, in which case every entity is sent in full
+void snapshot_write(BitPack* bp, Snapshot* snap, Snapshot* baseline);
+
+// Reading is split so the caller can look up the baseline named in the header.
+// snapshot_read() fails on malformed entries or if it reads past the end of bp.
+void snapshot_read_header(BitPack* bp, uint16_t* id, bool* has_baseline, uint16_t* baseline_id);
+bool snapshot_read(BitPack* bp, Snapshot* snap, Snapshot* baseline);
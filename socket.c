@@ -10,8 +10,14 @@
 #define PLATFORM PLATFORM_UNIX
 #endif
 
+#if defined(__linux__)
+    #define _GNU_SOURCE // recvmmsg, sendmmsg
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #if PLATFORM == PLATFORM_WINDOWS
     #include <winsock2.h>
@@ -21,6 +27,17 @@
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
+    #include <stdatomic.h>
+    #include <pthread.h>
+    #include <time.h>
+#endif
+
+#if defined(__linux__)
+    #define HAS_RECVMMSG 1
+    #define HAS_SENDMMSG 1
+#else
+    #define HAS_RECVMMSG 0
+    #define HAS_SENDMMSG 0
 #endif
 
 #if PLATFORM == PLATFORM_WINDOWS
@@ -28,6 +45,7 @@
 #endif
 
 #include "socket.h"
+#include "timer.h"
 
 bool socket_initialize()
 {
@@ -99,6 +117,357 @@ bool socket_bind(int socket_handle, Address* address, uint16_t port)
     return true;
 }
 
+_Static_assert(sizeof(struct sockaddr_in) <= sizeof(SocketAddress), "SocketAddress too small for sockaddr_in");
+
+void socket_address_convert(Address* address, SocketAddress* out)
+{
+    struct sockaddr_in* to = (struct sockaddr_in*)out;
+    memset(out, 0, sizeof(SocketAddress));
+
+    uint32_t address_uint32_t = (address->a << 24) | (address->b << 16) | (address->c << 8) | (address->d);
+
+    to->sin_family      = AF_INET;
+    to->sin_addr.s_addr = htonl(address_uint32_t);
+    to->sin_port        = htons(address->port);
+}
+
+//
+// Link conditioner
+//
+// Only sends are conditioned. In a loopback test both ends send from this
+// process, so that covers both directions. Datagrams are copied into a heap
+// ordered by release time and a thread hands them to the kernel when due.
+// It needs pthreads, so Windows builds go without.
+
+#if PLATFORM != PLATFORM_WINDOWS
+
+#define LINK_DESTINATIONS  1024 // bandwidth cap state, direct mapped, power of 2
+#define LINK_MAX_BACKLOG   0.25 // seconds queued behind a bandwidth cap before it drops
+
+typedef struct
+{
+    double release;
+    uint64_t order; // send order, breaks ties in release
+    int socket_handle;
+    struct sockaddr_in to;
+    int len;
+    uint8_t* data;
+} HeldDatagram;
+
+// One socket's path to one address. Colliding paths evict each other,
+// which only forgets a backlog.
+typedef struct
+{
+    int socket_handle;
+    uint32_t addr;
+    uint16_t port;
+    double free_time; // a datagram is still going out until then
+} LinkDestination;
+
+static struct
+{
+    _Atomic bool enabled;
+    LinkConditioner cfg;
+    uint64_t rng;
+    LinkConditionerStats stats;
+
+    HeldDatagram* held; // min-heap on release
+    int held_count;
+    int held_cap;
+    uint64_t order;
+
+    LinkDestination destinations[LINK_DESTINATIONS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool thread_started;
+} conditioner = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+// splitmix64
+static uint64_t link_rand()
+{
+    uint64_t z = (conditioner.rng += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// [0,1)
+static double link_rand_unit()
+{
+    return (link_rand() >> 11)*(1.0/9007199254740992.0);
+}
+
+static bool link_chance(float pct)
+{
+    return pct > 0.0f && 100.0*link_rand_unit() < pct;
+}
+
+static LinkDestination* link_destination(int socket_handle, const struct sockaddr_in* to)
+{
+    uint32_t addr = to->sin_addr.s_addr;
+    uint16_t port = to->sin_port;
+
+    uint32_t h = (addr*2654435761u) ^ (port*40503u) ^ ((uint32_t)socket_handle*2246822519u);
+    LinkDestination* d = &conditioner.destinations[(h ^ (h >> 16)) & (LINK_DESTINATIONS - 1)];
+
+    if(d->socket_handle != socket_handle || d->addr != addr || d->port != port)
+    {
+        d->socket_handle = socket_handle;
+        d->addr = addr;
+        d->port = port;
+        d->free_time = 0.0;
+    }
+    return d;
+}
+
+static bool held_before(const HeldDatagram* a, const HeldDatagram* b)
+{
+    return a->release < b->release || (a->release == b->release && a->order < b->order);
+}
+
+static bool held_push(HeldDatagram* d)
+{
+    if(conditioner.held_count == conditioner.held_cap)
+    {
+        int cap = conditioner.held_cap ? 2*conditioner.held_cap : 256;
+        HeldDatagram* held = realloc(conditioner.held, cap*sizeof(HeldDatagram));
+        if(!held)
+            return false;
+        conditioner.held = held;
+        conditioner.held_cap = cap;
+    }
+
+    HeldDatagram* held = conditioner.held;
+    int i = conditioner.held_count++;
+    while(i > 0)
+    {
+        int parent = (i - 1)/2;
+        if(!held_before(d, &held[parent]))
+            break;
+        held[i] = held[parent];
+        i = parent;
+    }
+    held[i] = *d;
+    return true;
+}
+
+static HeldDatagram held_pop()
+{
+    HeldDatagram* held = conditioner.held;
+    HeldDatagram top = held[0];
+    HeldDatagram last = held[--conditioner.held_count];
+    int count = conditioner.held_count;
+
+    if(count > 0)
+    {
+        int i = 0;
+        for(;;)
+        {
+            int c = 2*i + 1;
+            if(c >= count)
+                break;
+            if(c + 1 < count && held_before(&held[c + 1], &held[c]))
+                c++;
+            if(!held_before(&held[c], &last))
+                break;
+            held[i] = held[c];
+            i = c;
+        }
+        held[i] = last;
+    }
+
+    return top;
+}
+
+static void* link_thread(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&conditioner.lock);
+    for(;;)
+    {
+        if(conditioner.held_count == 0)
+        {
+            pthread_cond_wait(&conditioner.wake, &conditioner.lock);
+            continue;
+        }
+
+        double wait = conditioner.held[0].release - timer_get_time();
+        if(wait > 0.0)
+        {
+            // timedwait takes a realtime deadline
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            double deadline = ts.tv_sec + ts.tv_nsec/1000000000.0 + wait;
+            ts.tv_sec = (time_t)deadline;
+            ts.tv_nsec = (long)((deadline - (double)ts.tv_sec)*1000000000.0);
+            if(ts.tv_nsec > 999999999)
+                ts.tv_nsec = 999999999;
+            pthread_cond_timedwait(&conditioner.wake, &conditioner.lock, &ts);
+            continue;
+        }
+
+        HeldDatagram d = held_pop();
+        conditioner.stats.queued = conditioner.held_count;
+        pthread_mutex_unlock(&conditioner.lock);
+
+        int sent_bytes = sendto(d.socket_handle, (const char*)d.data, d.len, 0, (struct sockaddr*)&d.to, sizeof(struct sockaddr_in));
+        free(d.data);
+
+        pthread_mutex_lock(&conditioner.lock);
+        if(sent_bytes == d.len)
+            conditioner.stats.sent++;
+    }
+
+    return NULL;
+}
+
+// Returns true if the conditioner took the datagram, to drop or send later,
+// and false if it's off and the caller should send it
+static bool link_send(int socket_handle, const struct sockaddr_in* to, const uint8_t* data, int len)
+{
+    if(!atomic_load_explicit(&conditioner.enabled, memory_order_relaxed))
+        return false;
+
+    pthread_mutex_lock(&conditioner.lock);
+
+    LinkConditioner* cfg = &conditioner.cfg;
+    double now = timer_get_time();
+    bool wake = false;
+
+    if(link_chance(cfg->loss_pct))
+    {
+        conditioner.stats.dropped++;
+        pthread_mutex_unlock(&conditioner.lock);
+        return true;
+    }
+
+    int copies = 1;
+    if(link_chance(cfg->duplicate_pct))
+    {
+        conditioner.stats.duplicated++;
+        copies = 2;
+    }
+
+    for(int i = 0; i < copies; ++i)
+    {
+        double delay = cfg->latency + cfg->jitter*link_rand_unit();
+        if(link_chance(cfg->reorder_pct))
+        {
+            delay += cfg->reorder_delay;
+            conditioner.stats.reordered++;
+        }
+
+        // a capped path sends one datagram at a time, taking len/bandwidth
+        // each, and the latency starts once it's through
+        double start = now;
+        if(cfg->bandwidth > 0.0)
+        {
+            LinkDestination* dest = link_destination(socket_handle, to);
+            if(dest->free_time > start)
+                start = dest->free_time;
+            if(start - now > LINK_MAX_BACKLOG)
+            {
+                conditioner.stats.overflowed++;
+                continue;
+            }
+            start += len/cfg->bandwidth;
+            dest->free_time = start;
+        }
+
+        HeldDatagram d = {
+            .release = start + delay,
+            .order = conditioner.order++,
+            .socket_handle = socket_handle,
+            .to = *to,
+            .len = len,
+            .data = malloc(len),
+        };
+        if(!d.data)
+            continue;
+        memcpy(d.data, data, len);
+
+        if(!held_push(&d))
+        {
+            free(d.data);
+            continue;
+        }
+        wake |= conditioner.held[0].order == d.order;
+    }
+
+    conditioner.stats.queued = conditioner.held_count;
+    pthread_mutex_unlock(&conditioner.lock);
+
+    if(wake)
+        pthread_cond_signal(&conditioner.wake);
+
+    return true;
+}
+
+bool socket_set_link_conditioner(const LinkConditioner* link)
+{
+    pthread_mutex_lock(&conditioner.lock);
+
+    if(link)
+    {
+        if(!conditioner.thread_started)
+        {
+            pthread_t thread;
+            if(pthread_create(&thread, NULL, link_thread, NULL) != 0)
+            {
+                pthread_mutex_unlock(&conditioner.lock);
+                printf("Failed to start link conditioner thread\n");
+                return false;
+            }
+            pthread_detach(thread);
+            conditioner.thread_started = true;
+        }
+
+        conditioner.cfg = *link;
+        conditioner.rng = link->seed;
+        memset(&conditioner.stats, 0, sizeof(conditioner.stats));
+        conditioner.stats.queued = conditioner.held_count;
+        memset(conditioner.destinations, 0, sizeof(conditioner.destinations));
+    }
+
+    atomic_store(&conditioner.enabled, link != NULL);
+    pthread_mutex_unlock(&conditioner.lock);
+    return true;
+}
+
+void socket_get_link_conditioner_stats(LinkConditionerStats* stats)
+{
+    pthread_mutex_lock(&conditioner.lock);
+    *stats = conditioner.stats;
+    pthread_mutex_unlock(&conditioner.lock);
+}
+
+#else
+
+static bool link_send(int socket_handle, const struct sockaddr_in* to, const uint8_t* data, int len)
+{
+    (void)socket_handle; (void)to; (void)data; (void)len;
+    return false;
+}
+
+bool socket_set_link_conditioner(const LinkConditioner* link)
+{
+    if(link)
+        printf("No link conditioner on this platform\n");
+    return link == NULL;
+}
+
+void socket_get_link_conditioner_stats(LinkConditionerStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+#endif
+
 int socket_sendto(int socket_handle, Address* address, uint8_t* pkt, uint32_t pkt_size)
 {
     struct sockaddr_in to = {0};
@@ -109,9 +478,12 @@ int socket_sendto(int socket_handle, Address* address, uint8_t* pkt, uint32_t pk
     to.sin_addr.s_addr = htonl(address_uint32_t);
     to.sin_port        = htons(address->port);
 
+    if(link_send(socket_handle, &to, pkt, pkt_size))
+        return pkt_size;
+
     int sent_bytes = sendto(socket_handle,(const uint8_t*)pkt, pkt_size, 0, (struct sockaddr*)&to, sizeof(struct sockaddr_in));
 
-    if (sent_bytes != pkt_size)
+    if (sent_bytes != (int)pkt_size)
     {
         perror("Failed to send packet.\n");
         return 0;
@@ -120,22 +492,95 @@ int socket_sendto(int socket_handle, Address* address, uint8_t* pkt, uint32_t pk
     return sent_bytes;
 }
 
-int socket_recvfrom(int socket_handle, Address* address, uint8_t* pkt)
+// Sends count datagrams, each to its own pre-converted address, in as few
+// system calls as the platform allows. Returns the number of datagrams sent.
+int socket_sendto_batch(int socket_handle, SocketSendSlot* slots, int count)
 {
-    uint8_t packet_data[MAX_PACKET_SIZE] = {0};
+#if PLATFORM != PLATFORM_WINDOWS
+    if(atomic_load_explicit(&conditioner.enabled, memory_order_relaxed))
+    {
+        for(int i = 0; i < count; ++i)
+        {
+            if(!link_send(socket_handle, (struct sockaddr_in*)slots[i].to, slots[i].data, slots[i].len))
+                return i + socket_sendto_batch(socket_handle, slots + i, count - i); // turned off meanwhile
+        }
+        return count;
+    }
+#endif
 
-    struct sockaddr_in from;
-    socklen_t from_len = sizeof(from);
+#if HAS_SENDMMSG
+    struct mmsghdr msgs[SOCKET_SEND_BATCH_MAX];
+    struct iovec iovecs[SOCKET_SEND_BATCH_MAX];
 
-    int recv_bytes = recvfrom(socket_handle, (uint8_t*)&packet_data, MAX_PACKET_SIZE, 0, (struct sockaddr*)&from, &from_len);
+    int sent = 0;
 
-    memcpy(pkt,packet_data,recv_bytes);
+    while(sent < count)
+    {
+        int n = count - sent;
+        if(n > SOCKET_SEND_BATCH_MAX)
+            n = SOCKET_SEND_BATCH_MAX;
+
+        memset(msgs, 0, n*sizeof(struct mmsghdr));
+
+        for(int i = 0; i < n; ++i)
+        {
+            SocketSendSlot* slot = &slots[sent + i];
 
-    address->a = (uint8_t)(from.sin_addr.s_addr >> 0);
-    address->b = (uint8_t)(from.sin_addr.s_addr >> 8);
-    address->c = (uint8_t)(from.sin_addr.s_addr >> 16);
-    address->d = (uint8_t)(from.sin_addr.s_addr >> 24);
-    address->port = ntohs(from.sin_port);
+            iovecs[i].iov_base = slot->data;
+            iovecs[i].iov_len  = slot->len;
+
+            msgs[i].msg_hdr.msg_iov     = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+            msgs[i].msg_hdr.msg_name    = slot->to;
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+
+        int ret = sendmmsg(socket_handle, msgs, n, 0);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            perror("Failed to send packets.\n");
+            break;
+        }
+
+        sent += ret;
+        if(ret == 0)
+            break;
+    }
+
+    return sent;
+#else
+    int sent = 0;
+
+    for(int i = 0; i < count; ++i)
+    {
+        int sent_bytes = sendto(socket_handle, (const char*)slots[i].data, slots[i].len, 0, (struct sockaddr*)slots[i].to, sizeof(struct sockaddr_in));
+        if(sent_bytes == slots[i].len)
+            sent++;
+    }
+
+    return sent;
+#endif
+}
+
+static void sockaddr_to_address(struct sockaddr_in* from, Address* address)
+{
+    address->a = (uint8_t)(from->sin_addr.s_addr >> 0);
+    address->b = (uint8_t)(from->sin_addr.s_addr >> 8);
+    address->c = (uint8_t)(from->sin_addr.s_addr >> 16);
+    address->d = (uint8_t)(from->sin_addr.s_addr >> 24);
+    address->port = ntohs(from->sin_port);
+}
+
+// Receives straight into pkt, which must hold at least MAX_PACKET_SIZE bytes.
+// Only the received bytes are written; the rest of pkt is left untouched.
+int socket_recvfrom(int socket_handle, Address* address, uint8_t* pkt)
+{
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+
+    int recv_bytes = recvfrom(socket_handle, pkt, MAX_PACKET_SIZE, 0, (struct sockaddr*)&from, &from_len);
 
     if (recv_bytes < 0 )
     {
@@ -143,5 +588,77 @@ int socket_recvfrom(int socket_handle, Address* address, uint8_t* pkt)
         return 0;
     }
 
+    sockaddr_to_address(&from, address);
+
     return recv_bytes;
 }
+
+// Receives up to max_count pending datagrams without blocking.
+// Returns the number of slots filled (0 if nothing was waiting).
+int socket_recvfrom_batch(int socket_handle, SocketRecvSlot* slots, int max_count)
+{
+    if(max_count > SOCKET_RECV_BATCH_MAX)
+        max_count = SOCKET_RECV_BATCH_MAX;
+
+#if HAS_RECVMMSG
+    struct mmsghdr msgs[SOCKET_RECV_BATCH_MAX];
+    struct iovec iovecs[SOCKET_RECV_BATCH_MAX];
+    struct sockaddr_in froms[SOCKET_RECV_BATCH_MAX];
+
+    memset(msgs, 0, max_count*sizeof(struct mmsghdr));
+
+    for(int i = 0; i < max_count; ++i)
+    {
+        iovecs[i].iov_base = slots[i].data;
+        iovecs[i].iov_len  = MAX_PACKET_SIZE;
+
+        msgs[i].msg_hdr.msg_iov     = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+        msgs[i].msg_hdr.msg_name    = &froms[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    int count = recvmmsg(socket_handle, msgs, max_count, MSG_DONTWAIT, NULL);
+
+    if(count < 0)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            perror("Failed to receive packets.\n");
+        return 0;
+    }
+
+    for(int i = 0; i < count; ++i)
+    {
+        slots[i].len = (int)msgs[i].msg_len;
+        sockaddr_to_address(&froms[i], &slots[i].address);
+    }
+
+    return count;
+#else
+    int count = 0;
+
+    for(; count < max_count; ++count)
+    {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+
+#if PLATFORM == PLATFORM_WINDOWS
+        u_long available = 0;
+        ioctlsocket(socket_handle, FIONREAD, &available);
+        if(available == 0)
+            break;
+
+        int recv_bytes = recvfrom(socket_handle, (char*)slots[count].data, MAX_PACKET_SIZE, 0, (struct sockaddr*)&from, &from_len);
+#else
+        int recv_bytes = recvfrom(socket_handle, slots[count].data, MAX_PACKET_SIZE, MSG_DONTWAIT, (struct sockaddr*)&from, &from_len);
+#endif
+        if(recv_bytes < 0)
+            break;
+
+        slots[count].len = recv_bytes;
+        sockaddr_to_address(&from, &slots[count].address);
+    }
+
+    return count;
+#endif
+}
@@ -5,6 +5,8 @@
 
 #define MAX_PACKET_DATA_SIZE 32768
 #define MAX_PACKET_SIZE MAX_PACKET_DATA_SIZE + 20
+#define SOCKET_RECV_BATCH_MAX 32
+#define SOCKET_SEND_BATCH_MAX 64
 
 typedef struct
 {
@@ -15,6 +17,53 @@ typedef struct
     uint16_t port;
 } Address;
 
+// A caller-owned receive buffer for socket_recvfrom_batch()
+typedef struct
+{
+    Address address;
+    uint8_t* data; // must hold at least MAX_PACKET_SIZE bytes
+    int len;       // bytes received into data
+} SocketRecvSlot;
+
+// Address already converted to the OS form (a sockaddr_in), for peers that
+// are sent to every tick. See socket_address_convert().
+typedef struct
+{
+    uint32_t data[4];
+} SocketAddress;
+
+// One datagram for socket_sendto_batch()
+typedef struct
+{
+    SocketAddress* to;
+    uint8_t* data;
+    int len;
+} SocketSendSlot;
+
+// Simulated bad network for testing (see socket_set_link_conditioner()).
+// Times are in seconds, chances in percent.
+typedef struct
+{
+    uint64_t seed;        // same seed and same sends, same drops and delays
+    float loss_pct;
+    float duplicate_pct;  // a second copy is sent, delayed on its own
+    float reorder_pct;    // held back reorder_delay on top of its latency
+    double latency;       // one way, added to every datagram
+    double jitter;        // up to this much more, uniformly random
+    double reorder_delay;
+    double bandwidth;     // bytes/s to each destination address, 0 for no cap
+} LinkConditioner;
+
+typedef struct
+{
+    uint64_t sent;        // handed to the kernel
+    uint64_t dropped;     // by loss_pct
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t overflowed;  // dropped with the bandwidth cap's backlog full
+    uint64_t queued;      // waiting to be sent right now
+} LinkConditionerStats;
+
 bool socket_initialize();
 void socket_shutdown();
 
@@ -22,5 +71,14 @@ bool socket_create(int* socket_handle);
 bool socket_bind(int socket_handle, Address* address, uint16_t port);
 void socket_close(int socket_handle);
 
+void socket_address_convert(Address* address, SocketAddress* out);
 int socket_sendto(int socket_handle, Address* address, uint8_t* pkt, uint32_t pkt_size);
+int socket_sendto_batch(int socket_handle, SocketSendSlot* slots, int count);
 int socket_recvfrom(int socket_handle, Address* address, uint8_t* pkt);
+int socket_recvfrom_batch(int socket_handle, SocketRecvSlot* slots, int max_count);
+
+// Puts everything sent from this process through the conditioner, or sends
+// straight to the kernel again if NULL. Datagrams already held back are
+// still sent when due.
+bool socket_set_link_conditioner(const LinkConditioner* link);
+void socket_get_link_conditioner_stats(LinkConditionerStats* stats);
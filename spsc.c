@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "spsc.h"
+#include "timer.h"
+
+bool spsc_create(SPSCQueue* q, uint32_t capacity, size_t item_size)
+{
+    if(capacity == 0 || (capacity & (capacity - 1)) != 0)
+        return false;
+
+    q->items = aligned_alloc(SPSC_CACHE_LINE, ((capacity*item_size + SPSC_CACHE_LINE - 1) / SPSC_CACHE_LINE)*SPSC_CACHE_LINE);
+    if(!q->items)
+        return false;
+
+    q->mask = capacity - 1;
+    q->item_size = item_size;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return true;
+}
+
+void spsc_destroy(SPSCQueue* q)
+{
+    free(q->items);
+    q->items = NULL;
+}
+
+bool spsc_push(SPSCQueue* q, const void* item)
+{
+    if(spsc_free_count(q) == 0)
+        return false;
+
+    memcpy(spsc_write_slot(q, 0), item, q->item_size);
+    spsc_commit(q, 1);
+    return true;
+}
+
+bool spsc_pop(SPSCQueue* q, void* item)
+{
+    if(spsc_count(q) == 0)
+        return false;
+
+    memcpy(item, spsc_read_slot(q, 0), q->item_size);
+    spsc_release(q, 1);
+    return true;
+}
+
+// Streams a counter from one thread to another through a small queue and
+// checks every value arrives once and in order.
+#define SPSC_TEST_COUNT 20000000
+
+static void* spsc_test_producer(void* arg)
+{
+    SPSCQueue* q = arg;
+    uint64_t next = 0;
+
+    while(next < SPSC_TEST_COUNT)
+    {
+        uint32_t n = spsc_free_count(q);
+        if(n == 0)
+        {
+            sched_yield();
+            continue;
+        }
+        if(n > SPSC_TEST_COUNT - next)
+            n = (uint32_t)(SPSC_TEST_COUNT - next);
+
+        for(uint32_t i = 0; i < n; ++i)
+            *(uint64_t*)spsc_write_slot(q, i) = next++;
+        spsc_commit(q, n);
+    }
+    return NULL;
+}
+
+void spsc_test()
+{
+    SPSCQueue q;
+    if(!spsc_create(&q, 1024, sizeof(uint64_t)))
+        return;
+
+    pthread_t producer;
+    double t0 = timer_get_time();
+    pthread_create(&producer, NULL, spsc_test_producer, &q);
+
+    uint64_t expected = 0;
+    int errors = 0;
+
+    while(expected < SPSC_TEST_COUNT)
+    {
+        uint32_t n = spsc_count(&q);
+        if(n == 0)
+        {
+            sched_yield();
+            continue;
+        }
+
+        for(uint32_t i = 0; i < n; ++i)
+        {
+            if(*(uint64_t*)spsc_read_slot(&q, i) != expected)
+                errors++;
+            expected++;
+        }
+        spsc_release(&q, n);
+    }
+
+    pthread_join(producer, NULL);
+    double t = timer_get_time() - t0;
+
+    printf("SPSC test (%d items, capacity 1024)\n", SPSC_TEST_COUNT);
+    printf("  %.1f M items/s, %d out of order\n", SPSC_TEST_COUNT / t / 1e6, errors);
+    printf("%s\n", errors == 0 ? "PASSED" : "FAILED");
+
+    spsc_destroy(&q);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+// Lock-free single producer, single consumer queue of fixed size items.
+//
+// Items live in the queue, so both sides work in place: the producer fills
+// spsc_write_slot(q, i) for i < spsc_free_count() and publishes them with
+// spsc_commit(), the consumer reads spsc_read_slot(q, i) for
+// i < spsc_count() and hands them back with spsc_release(). Only the
+// producer writes head and only the consumer writes tail, each on its own
+// cache line.
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct
+{
+    _Alignas(SPSC_CACHE_LINE) _Atomic uint32_t head; // next slot to write
+    _Alignas(SPSC_CACHE_LINE) _Atomic uint32_t tail; // next slot to read
+
+    _Alignas(SPSC_CACHE_LINE) uint32_t mask;
+    size_t item_size;
+    uint8_t* items;
+} SPSCQueue;
+
+// capacity must be a power of 2
+bool spsc_create(SPSCQueue* q, uint32_t capacity, size_t item_size);
+void spsc_destroy(SPSCQueue* q);
+
+// producer
+static inline uint32_t spsc_free_count(SPSCQueue* q)
+{
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    return q->mask + 1 - (head - tail);
+}
+
+static inline void* spsc_write_slot(SPSCQueue* q, uint32_t i)
+{
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    return q->items + ((head + i) & q->mask)*q->item_size;
+}
+
+static inline void spsc_commit(SPSCQueue* q, uint32_t count)
+{
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    atomic_store_explicit(&q->head, head + count, memory_order_release);
+}
+
+// consumer
+static inline uint32_t spsc_count(SPSCQueue* q)
+{
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    return head - tail;
+}
+
+static inline void* spsc_read_slot(SPSCQueue* q, uint32_t i)
+{
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return q->items + ((tail + i) & q->mask)*q->item_size;
+}
+
+static inline void spsc_release(SPSCQueue* q, uint32_t count)
+{
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    atomic_store_explicit(&q->tail, tail + count, memory_order_release);
+}
+
+// single item helpers, false if full/empty
+bool spsc_push(SPSCQueue* q, const void* item);
+bool spsc_pop(SPSCQueue* q, void* item);
+
+void spsc_test();
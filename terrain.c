@@ -1,9 +1,20 @@
+#include <stdlib.h>
+#include <string.h>
 #include "common.h"
 #include "raylib.h"
 #include "raymath.h"
 #include "lights.h"
 #include "terrain.h"
 
+#if HEADLESS
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "external/stb_image.h"
+#pragma GCC diagnostic pop
+#endif
+
 float terrain_scale_planar = 2.0;
 float terrain_scale_height = 10.0;
 
@@ -13,9 +24,74 @@ typedef struct
     Vector3 pos;
     Vector3 scale;
     Vector2 size; // w,h
+    float* vertices; // the heightmap mesh's, 18 floats per quad
 } Terrain;
 
 static Terrain terrain;
+
+#if HEADLESS
+
+static inline float gray_value(const uint8_t* px)
+{
+    return (float)(px[0] + px[1] + px[2])/3.0f;
+}
+
+// The vertices GenMeshHeightmap() makes, from RGBA pixels, so ground
+// heights on the server match the client's exactly
+static float* terrain_gen_vertices(const uint8_t* pixels, int map_x, int map_z, Vector3 size)
+{
+    float* v = malloc((size_t)(map_x - 1)*(map_z - 1)*18*sizeof(float));
+    if(!v)
+        return NULL;
+
+    Vector3 scale = { size.x/(map_x - 1), size.y/255.0f, size.z/(map_z - 1) };
+    int n = 0;
+
+    for(int z = 0; z < map_z - 1; z++)
+    {
+        for(int x = 0; x < map_x - 1; x++)
+        {
+            float x0 = (float)x*scale.x, x1 = (float)(x + 1)*scale.x;
+            float z0 = (float)z*scale.z, z1 = (float)(z + 1)*scale.z;
+
+            float h00 = gray_value(&pixels[4*(x + z*map_x)])*scale.y;
+            float h01 = gray_value(&pixels[4*(x + (z + 1)*map_x)])*scale.y;
+            float h10 = gray_value(&pixels[4*((x + 1) + z*map_x)])*scale.y;
+            float h11 = gray_value(&pixels[4*((x + 1) + (z + 1)*map_x)])*scale.y;
+
+            float quad[18] = {
+                x0, h00, z0,  x0, h01, z1,  x1, h10, z0,
+                x1, h10, z0,  x0, h01, z1,  x1, h11, z1,
+            };
+            memcpy(&v[n], quad, sizeof(quad));
+            n += 18;
+        }
+    }
+
+    return v;
+}
+
+// Only what terrain_get_ground() needs, no mesh or textures
+void terrain_init()
+{
+    int width, height, channels;
+    uint8_t* pixels = stbi_load("textures/heightmap.png", &width, &height, &channels, 4);
+    if(!pixels)
+    {
+        printf("Failed to load textures/heightmap.png\n");
+        return;
+    }
+
+    terrain.size = (Vector2) {width - 1.0, height - 1.0};
+    terrain.scale = (Vector3){ terrain_scale_planar*(terrain.size.x), terrain_scale_height, terrain_scale_planar*(terrain.size.y) };
+    terrain.pos = (Vector3) {-0.5*terrain.scale.x, 0.0, -0.5*terrain.scale.z};
+    terrain.vertices = terrain_gen_vertices(pixels, width, height, terrain.scale);
+
+    stbi_image_free(pixels);
+}
+
+#else
+
 static Texture2D grass;
 static Image heightmap_image;
 
@@ -32,6 +108,7 @@ void terrain_init()
 
     Mesh mesh = GenMeshHeightmap(heightmap_image, terrain.scale);
     terrain.model = LoadModelFromMesh(mesh);
+    terrain.vertices = terrain.model.meshes[0].vertices;
 
     terrain.model.materials[0].shader = lights_shader;
     terrain.model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = grass;
@@ -49,11 +126,27 @@ void terrain_update()
         Mesh mesh = GenMeshHeightmap(heightmap_image, terrain.scale);
         UnloadModel(terrain.model);
         terrain.model = LoadModelFromMesh(mesh);
+        terrain.vertices = terrain.model.meshes[0].vertices;
         terrain.model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = grass;
         terrain.model.materials[0].shader = lights_shader;
     }
 }
 
+#endif
+
+// Space a player can occupy over the terrain: the mesh footprint, with
+// headroom above the highest point. False until terrain_init() has run.
+bool terrain_get_bounds(Vector3* min, Vector3* max)
+{
+    if(terrain.size.x <= 0.0 || terrain.size.y <= 0.0)
+        return false;
+
+    *min = (Vector3) {terrain.pos.x, -TERRAIN_HEADROOM, terrain.pos.z};
+    *max = (Vector3) {terrain.pos.x + terrain.scale.x, terrain.scale.y + TERRAIN_HEADROOM, terrain.pos.z + terrain.scale.z};
+    return true;
+}
+
+#if !HEADLESS
 void terrain_draw()
 {
     if(g_debug)
@@ -65,11 +158,12 @@ void terrain_draw()
         DrawModel(terrain.model, terrain.pos, 1.0f, WHITE);
     }
 }
+#endif
 
 float terrain_get_ground(float x, float z, Ground* ground)
 {
     // check if point is outside terrain mesh, and set height to 0 if so
-    if((ABS(x) >= 0.5 * terrain.scale.x) || (ABS(z) >= 0.5 * terrain.scale.z))
+    if(!terrain.vertices || (ABS(x) >= 0.5 * terrain.scale.x) || (ABS(z) >= 0.5 * terrain.scale.z))
     {
         ground->height = 0.0;
         return 0.0;
@@ -80,7 +174,7 @@ float terrain_get_ground(float x, float z, Ground* ground)
     float _z = floor(z/terrain_scale_planar) + (terrain.size.y / 2.0);
     int p = (int)(18*(terrain.size.y*_z + _x)); // 18 floats per quad (6 vertices * 3 axis)
 
-    Mesh* m = &terrain.model.meshes[0];
+    float* v = terrain.vertices;
 
     float dx = (x/terrain_scale_planar) - floor(x/terrain_scale_planar);
     float dz = (z/terrain_scale_planar) - floor(z/terrain_scale_planar);
@@ -88,15 +182,15 @@ float terrain_get_ground(float x, float z, Ground* ground)
     // find the specific terrain triangle (points a,b,c) where (x,z) is within
     if (dx <= (1.0-dz))
     {
-        ground->a = Vector3Add(terrain.pos, (Vector3){m->vertices[p],m->vertices[p+1],m->vertices[p+2]});
-        ground->b = Vector3Add(terrain.pos, (Vector3){m->vertices[p+3],m->vertices[p+4],m->vertices[p+5]});
-        ground->c = Vector3Add(terrain.pos, (Vector3){m->vertices[p+6],m->vertices[p+7],m->vertices[p+8]});
+        ground->a = Vector3Add(terrain.pos, (Vector3){v[p],v[p+1],v[p+2]});
+        ground->b = Vector3Add(terrain.pos, (Vector3){v[p+3],v[p+4],v[p+5]});
+        ground->c = Vector3Add(terrain.pos, (Vector3){v[p+6],v[p+7],v[p+8]});
     }
     else
     {
-        ground->a = Vector3Add(terrain.pos, (Vector3){m->vertices[p+9],m->vertices[p+10],m->vertices[p+11]});
-        ground->b = Vector3Add(terrain.pos, (Vector3){m->vertices[p+12],m->vertices[p+13],m->vertices[p+14]});
-        ground->c = Vector3Add(terrain.pos, (Vector3){m->vertices[p+15],m->vertices[p+16],m->vertices[p+17]});
+        ground->a = Vector3Add(terrain.pos, (Vector3){v[p+9],v[p+10],v[p+11]});
+        ground->b = Vector3Add(terrain.pos, (Vector3){v[p+12],v[p+13],v[p+14]});
+        ground->c = Vector3Add(terrain.pos, (Vector3){v[p+15],v[p+16],v[p+17]});
     }
 
     // calculate the y value based on the point in the triangle
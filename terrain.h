@@ -1,6 +1,9 @@
 #pragma once
 
+#include "raylib.h"
+
 #define GROUND_EPSILON 0.1
+#define TERRAIN_HEADROOM 50.0 // meters above/below the terrain in bounds
 
 typedef struct
 {
@@ -16,4 +19,5 @@ void terrain_init();
 void terrain_update();
 void terrain_draw();
 
+bool terrain_get_bounds(Vector3* min, Vector3* max);
 float terrain_get_ground(float x, float z, Ground* ground);
@@ -6,6 +6,7 @@
 #include <profileapi.h>
 #else
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
@@ -179,12 +180,6 @@ void stopwatch_capture(char* str)
     _stopwatch_time_prior = _stopwatch_time;
     _stopwatch_time = (get_time() - _stopwatch_start);
 
-    double time_left = _stopwatch_time;
-
-    int min = (int)(time_left/60.0f); time_left -= (min*60.0);
-    int sec = (int)(time_left);       time_left -= (sec);
-    int ms = (int)(time_left*1000.0); 
-
     float delta_time = _stopwatch_time - _stopwatch_time_prior;
 
     printf("[STOPWATCH] %08.4f ms [delta: %08.4f ms] (%s)\n", _stopwatch_time*1000.0, delta_time*1000.0, str);